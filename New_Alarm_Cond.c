@@ -8,555 +8,706 @@
  * Minh Nguyen
  * Harpreet Kaur Saini
  *
+ * The command line front end over the alarm engine, see alarm_engine.h.
+ * It reads commands from the prompt, a file or clients, and prints the
+ * engine's events as lines of text, or takes and answers binary records
+ * instead, see binary.h.
  */
 #include <pthread.h>
 #include <time.h>
-#include <semaphore.h>
 #include "errors.h"
+#include "alarm_engine.h"
+#include "sweep.h"
+#include "parse.h"
+#include "output.h"
+#include "metrics.h"
+#include "server.h"
+#include "binary.h"
 #include <stdio.h>
+#include <getopt.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-#define TYPE_A 0
-#define TYPE_B 1
+//The stats series, see alarm_engine_stats()
+#define STATS_TO_PROMPT 0
+#define STATS_TO_FILE 1
 
-#define FIRST_ALARM 0
-#define REPLACEMENT 1
-#define NO_MATCHING_ALARM 2
-#define MULTIPLE_CANCEL 3
-#define CANCEL_REQ 4
+int jitter_report = 0;
 
+//The engine's settings, which --replay only gets to use once it has the trace's start
+alarm_engine_config_t config;
+int engine_created = 0;
+
+//Set with --binary: the console speaks binary.h records instead of lines
+int binary_mode = 0;
+//Set once the binary input lost track of where records start
+int binary_broken = 0;
+
+#ifdef ALARM_METRICS
+//Where --stats-file dumps go, and how often, in seconds
+FILE *stats_file = NULL;
+int stats_interval = 10;
+#endif
+
+//How listed alarms are, by ALARM_ENTRY_ state
+static const char * entry_states[] = {"Set", "Replaced", "Replacement Pending", "Cancel Pending"};
 
 /*
- * The "alarm" structure now contains the time_t (time since the
- * Epoch, in seconds) for each alarm, so that they can be
- * sorted. Storing the requested number of seconds would not be
- * enough, since the "alarm thread" cannot tell how long it has
- * been on the list.
+ * Prints a page of listed alarms, one line each.
  */
-typedef struct alarm_tag {
-    struct alarm_tag    *link;
-    int                 seconds;
-    int                 alarm_number;
-    int                 request_type;
-    char                message[128];
-    int                 changed;
-} alarm_t;
+void print_entries(uint32_t client, const alarm_entry_t * entry, size_t count){
+    for(; count > 0; count--, entry++)
+        output_printf_to(client, "Alarm With Message Number (%d): %d%s Next Display at %d.%03d %s\n",
+                         entry->alarm_number, entry->interval, parse_unit_suffix(entry->unit),
+                         (int) (entry->next / NSEC_PER_SEC),
+                         (int) (entry->next % NSEC_PER_SEC / 1000000), entry_states[entry->state]);
+}
 
 /*
- * The append_list structure contains the alarm to move to a new thread and append.
- * This structure is useful in the case of flooded alarm requests, so it will append all in a batch,
- * or simply one by one.
- *
- * The reference to last allows us to append to the end of the list
- *
+ * Prints an event from the engine, on the line the engine used to print
+ * itself, to the client it is for. Client numbers are output destinations.
  */
-typedef struct append_list{
-    alarm_t *           alarm;
-    struct append_list* next;
-    struct append_list* last;
-} append_list;
+void print_event(const alarm_event_t *event, void *context){
+    uint32_t client = event->client;
+    const char *unit = parse_unit_suffix(event->unit);
+    int number = event->alarm_number, when = (int) event->time;
+
+    switch(event->type){
+        case ALARM_EVENT_SET:
+            output_printf_to(client, "First Alarm Request With Message Number (%d) Received at %d: %d%s Message(%d) %s\n",
+                             number, when, event->interval, unit, number, event->message);
+            break;
+        case ALARM_EVENT_REPLACE:
+            output_printf_to(client, "Replacement Alarm Request With Message Number (%d) Received at %d: %d%s Message(%d) %s\n",
+                             number, when, event->interval, unit, number, event->message);
+            break;
+        case ALARM_EVENT_TOO_MANY_ALARMS:
+            output_printf_to(client, "Error: Too Many Alarms, Alarm Request With Message Number (%d) Rejected!\n",
+                             number);
+            break;
+        case ALARM_EVENT_OUT_OF_MEMORY:
+            output_printf_to(client, "Error: Out Of Memory, Alarm Request With Message Number (%d) Rejected!\n",
+                             number);
+            break;
+        case ALARM_EVENT_CANCEL:
+            output_printf_to(client, "Cancel Alarm Request With Message Number (Message_Number) Received at %d: Cancel: Message(%d)\n",
+                             when, number);
+            break;
+        case ALARM_EVENT_NO_SUCH_ALARM:
+            output_printf_to(client, "Error: No Alarm Request With Message Number (%d) to Cancel!\n",
+                             number);
+            break;
+        case ALARM_EVENT_ALREADY_CANCELLING:
+            output_printf_to(client, "Error: More Than One Request to Cancel Alarm Request With Message Number (%d)\n",
+                             number);
+            break;
+        case ALARM_EVENT_CANCEL_RANGE:
+            output_printf_to(client, "Cancel Alarm Requests With Message Numbers (%d..%d) Received at %d: %zu Alarms Cancelled\n",
+                             number, event->last_number, when, event->count);
+            break;
+        case ALARM_EVENT_CANCEL_ALL:
+            output_printf_to(client, "Cancel All Alarm Requests Received at %d: %zu Alarms Cancelled\n",
+                             when, event->count);
+            break;
+        case ALARM_EVENT_INTERVAL_RANGE:
+            output_printf_to(client, "Interval Replacement For Message Numbers (%d..%d) Received at %d: %d%s, %zu Alarms Replaced\n",
+                             number, event->last_number, when, event->interval, unit, event->count);
+            break;
+        case ALARM_EVENT_STATS:
+#ifdef ALARM_METRICS
+            if(number == STATS_TO_FILE){
+                fprintf(stats_file, "%s output_backlog=%zu\n", event->message, output_backlog());
+                fflush(stats_file);
+                break;
+            }
+#endif
+            output_printf_to(client, "Stats: %s output_backlog=%zu\n", event->message, output_backlog());
+            break;
+        case ALARM_EVENT_RELEASE:
+            output_close(client);
+            break;
+        case ALARM_EVENT_LIST:
+        case ALARM_EVENT_COUNT:
+            if(number == INT_MIN && event->last_number == INT_MAX)
+                output_printf_to(client, "%s Of All Alarms Received at %d: %zu Alarms\n",
+                                 event->type == ALARM_EVENT_LIST ? "List" : "Count", when,
+                                 event->count);
+            else
+                output_printf_to(client, "%s Of Alarms With Message Numbers (%d..%d) Received at %d: %zu Alarms\n",
+                                 event->type == ALARM_EVENT_LIST ? "List" : "Count", number,
+                                 event->last_number, when, event->count);
+            break;
+        case ALARM_EVENT_LIST_PAGE:
+            print_entries(client, event->entries, event->count);
+            break;
+        case ALARM_EVENT_FIRED:
+            output_printf_to(client, "%sAlarm With Message Number (%d) Displayed at %d: %d%s Message(%d) %s\n",
+                             event->replaced ? "Replacement " : "", number, when, event->interval,
+                             unit, number, event->message);
+            break;
+        case ALARM_EVENT_REPLACED:
+            output_printf_to(client, "Alarm With Message Number (%d) Replaced at %d: %d%s Message(%d) %s\n",
+                             number, when, event->interval, unit, number, event->message);
+            break;
+        case ALARM_EVENT_CANCELLED:
+            output_printf_to(client, "Display thread exiting at time %d: %d%s Message(%d) %s\n",
+                             when, event->interval, unit, number, event->message);
+            break;
+    }
+}
 
 /*
- * Structure to hold the display thread's alarm object and
- * information regarding the alarm's removal (aka free() called on alarm).
- *
+ * Writes an event from the engine as a binary status record, for --binary.
  */
-typedef struct display_thread_alarm {
-    alarm_t *       alarm;
-    int             removed;
-} thread_alarm;
+void print_binary_event(const alarm_event_t *event, void *context){
+    binary_status_t status;
+    struct iovec parts[2];
+
+    //Clients of the server still get lines, and so does the stats file
+    if(event->client != OUTPUT_CONSOLE
+       || (event->type == ALARM_EVENT_STATS && event->alarm_number == STATS_TO_FILE)){
+        print_event(event, context);
+        return;
+    }
+    parts[0].iov_base = &status;
+    parts[0].iov_len = BINARY_STATUS_SIZE;
+    parts[1].iov_base = (void *) event->message;
+    parts[1].iov_len = binary_status(event, OUTPUT_MAX_WRITE - BINARY_STATUS_SIZE, &status);
+    output_write_to(event->client, parts, 2);
+}
 
 /*
- * Linked list holding a reference to the current threads
- * and their respective data structures.
- *
+ * Answers a binary record the engine never saw. The engine answers the
+ * records before it first: the answer is only queued once they are all
+ * out, on the same ordered output.
  */
-typedef struct thread_alarm_list {
-    struct thread_alarm_list *   next;
-    struct thread_alarm_list *   previous;
-    thread_alarm *               data;
-} display_thread_list;
-
-
-int alarm_thread_flag = 0;
-int reader_flag = 0;
-//for alarm list cleanup
-
-alarm_t *alarm_list = NULL;
-append_list *list_to_append = NULL;
-
-sem_t main_semaphore;
-sem_t display_sem;
-
-int append_flag = 0;
-int delete_flag = 0;
+void binary_reply(uint32_t client, int type, int alarm_number){
+    alarm_event_t event;
+
+    alarm_engine_drain();
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    event.client = client;
+    event.alarm_number = alarm_number;
+    event.time = time(NULL);
+    print_binary_event(&event, NULL);
+}
 
-display_thread_list * thread_list = NULL;
+#ifdef ALARM_METRICS
+void * stats_dumper(void * arg){
+    while(1){
+        sleep(stats_interval);
+        alarm_engine_stats(OUTPUT_CONSOLE, STATS_TO_FILE);
+    }
+    return NULL;
+}
+#endif
 
 /*
- * Finds a thread in the list to mark as removed.
- *
+ * Hands a parsed command from `client` to the engine, which reports the
+ * outcome. Commands that are not requests are reported here.
  */
-void find_in_list(int alarm_num){
-    display_thread_list * list = thread_list;
-    while(list != NULL){
-        if(list->data->alarm->alarm_number == alarm_num){
-            //Mark as removed;
-            list->data->removed = 1;
-            //Remove from list, the thread will clean itself up
-            if(list->next != NULL)
-                list->next->previous = list->previous;
-            if(list->previous != NULL)
-                list->previous->next = list->next;
-
-            //If we have freed the first element, make sure to move the index over to the next one
-            if(thread_list == list){
-                thread_list = thread_list->next;
-            }
-            //Free the latest in the list
-            free(list);
-            return;
-        }
-        list = list->next;
+void submit_command(int kind, parsed_command_t * command, uint32_t client){
+    switch(kind){
+        case PARSE_INCORRECT_FORMAT:
+            METRIC_ADD(METRIC_ERRORS, 1);
+            output_printf_to(client, "Error: Incorrect format\n");
+            break;
+        case PARSE_BAD_COMMAND:
+            METRIC_ADD(METRIC_ERRORS, 1);
+            if(client == OUTPUT_CONSOLE)
+                fprintf (stderr, "Bad command\n");
+            else
+                output_printf_to(client, "Bad command\n");
+            break;
+        case PARSE_STATS:
+#ifdef ALARM_METRICS
+            alarm_engine_stats(client, STATS_TO_PROMPT);
+#else
+            output_printf_to(client, "Error: Stats are not compiled in\n");
+#endif
+            break;
+        case PARSE_SET:
+            alarm_engine_set(client, command->alarm_number, command->interval, command->unit,
+                             command->message, command->message_length);
+            break;
+        case PARSE_CANCEL:
+            alarm_engine_cancel(client, command->alarm_number);
+            break;
+        case PARSE_CANCEL_RANGE:
+            alarm_engine_cancel_range(client, command->alarm_number, command->last_number);
+            break;
+        case PARSE_CANCEL_ALL:
+            alarm_engine_cancel_all(client);
+            break;
+        case PARSE_INTERVAL_RANGE:
+            alarm_engine_interval_range(client, command->alarm_number, command->last_number,
+                                        command->interval, command->unit);
+            break;
+        case PARSE_LIST:
+            alarm_engine_list(client, command->alarm_number, command->last_number);
+            break;
+        case PARSE_COUNT:
+            alarm_engine_count(client, command->alarm_number, command->last_number);
+            break;
     }
 }
 
-
-
 /*
- * Function to execute a cancel request.
- * In the case of multiple type B request, it will remove all type B requests inserted in one go.
- * It achieves this by setting the flag in find_in_list
- * Note: last_rem should be null
- *
+ * Parses a block of complete lines from `client` and posts the requests in
+ * batches. Returns a pointer past the last complete line.
  */
-void alarm_delete(){
-    alarm_t **last, *next, *to_remove;
-
-    /*Locking protocol:
-     *
-     * We will assume prior to calling this method, it will wait for the writer semaphore.
-     *
-     */
-    last = &alarm_list;
-    next = *last;
-    while(next != NULL){
-        if(next->request_type == TYPE_B){
-            to_remove = next->link;
-            //Check if to_remove is of type A
-            if(to_remove != NULL && to_remove->request_type == TYPE_A){
-                //Before removing, mark thread as removed
-                find_in_list(to_remove->alarm_number);
-
-                //Remove both the cancellation requests as well as alarm itself
-                *last = to_remove->link;
-                free(to_remove);
-                free(next);
-                next = *last;
-                continue;
-            }
-        }
-        last = &next->link;
-        next = next->link;
+const char * ingest_lines(uint32_t client, const char * p, const char * end){
+    parsed_command_t command;
+    const char *line, *newline;
+
+    while(p < end){
+        newline = memchr(p, '\n', (size_t) (end - p));
+        if(newline == NULL)
+            break;
+        line = p;
+        p = newline + 1;
+        //Empty lines are skipped, like the prompt does
+        if(p - line <= 1)
+            continue;
+
+        submit_command(parse_command(line, p, &command), &command, client);
     }
-};
+    alarm_engine_flush();
+    return p;
+}
 
 /*
- * Insert alarm entry on list, in order.
- * Note: It will always insert a type B request in front of a type A, as is requred by
- * alarm_delete.
+ * Takes a block of binary records from `client`, and posts the requests in
+ * batches, like ingest_lines(). Returns a pointer past the last complete
+ * record.
  */
-int alarm_insert (alarm_t *alarm) {
-    alarm_t **last, *next;
-
-    /*
-     * LOCKING PROTOCOL:
-     * 
-     * This routine requires that the caller have locked the
-     * alarm_mutex!
-     */
-    last = &alarm_list;
-    next = *last;
-    while (next != NULL) {
-        if (next->alarm_number >= alarm->alarm_number) {
-            //If both alarm types are the same, handle is based on the message type
-            if(next->alarm_number == alarm->alarm_number){
-                //If alarms are of the same type
-                if(next->request_type == alarm->request_type) {
-                    //If it is a replacement,
-                    if(alarm->request_type == TYPE_A){
-                        //Copy the message and the new time
-                        next->seconds = alarm->seconds;
-                        strcpy(next->message, alarm->message);
-                        next->changed = 1;
-                        //Free the previous alarm
-                        free(alarm);
-                        //Replace its pointer in memory.
-
-                        //Return a replacement code
-                        return REPLACEMENT;
-                    }
-                    //Otherwise, both are type B free the alarm, signal multiple cancel.
-                    free(alarm);
-                    return MULTIPLE_CANCEL;
-                }
-                //Otherwise, they are of different types.
-                //If alarm is of type B and next is of type A, append alarm in front of next.
-                if(alarm->request_type == TYPE_B){
-                    alarm->link = next;
-                    *last = alarm;
-                    return CANCEL_REQ;
-                }
-
-            }
-            //If its' a standalone B that doesn't match, return error and free
-            //Leave list unchanged.
-            if(alarm->request_type == TYPE_B){
-                free(alarm);
-                return NO_MATCHING_ALARM;
-            }
-
-            alarm->link = next;
-            *last = alarm;
-            return FIRST_ALARM;
+const char * binary_records(uint32_t client, const char * p, const char * end){
+    parsed_command_t command;
+    size_t length;
+    int kind;
+
+    if(binary_broken)
+        return end;
+    while(p < end){
+        kind = binary_parse(p, end, &command, &length);
+        if(kind == BINARY_INCOMPLETE)
+            break;
+        if(kind == BINARY_BROKEN){
+            METRIC_ADD(METRIC_ERRORS, 1);
+            binary_reply(client, BINARY_STATUS_BROKEN, 0);
+            binary_broken = 1;
+            p = end;
+            break;
         }
-        last = &next->link;
-        next = next->link;
-    }
-    /*
-     * If we reached the end of the list, insert the new alarm
-     * there.  ("next" is NULL, and "last" points to the link
-     * field of the last item, or to the list header.)
-     */
-    if (next == NULL) {
-
-        if(alarm->request_type == TYPE_A){
-            *last = alarm;
-            alarm->link = NULL;
-            return FIRST_ALARM;
+        p += length;
+        if(kind == PARSE_INCORRECT_FORMAT){
+            METRIC_ADD(METRIC_ERRORS, 1);
+            binary_reply(client, BINARY_STATUS_BAD_RECORD, command.alarm_number);
+            continue;
         }
-        free(alarm);
-        return NO_MATCHING_ALARM;
+        submit_command(kind, &command, client);
     }
+    alarm_engine_flush();
+    return p;
 }
 
 /*
- * The display thread
- * arg gets cast into the thread_alarm struct containing information
- * pertaining to the specific thread
- *
+ * Reads the time a trace line starts with, in seconds, which may have a
+ * fraction, into nanoseconds. Returns a pointer past it, or NULL if the
+ * line does not start with a time.
  */
-void * display_thread(void * arg) {
-
-    thread_alarm * alarm = (thread_alarm *) arg;
-
-    char msg[128];
-    strcpy(msg, alarm->alarm->message);
-    int alarm_num = alarm->alarm->alarm_number;
-    int interval = alarm->alarm->seconds;
-    int has_changed =0;
-    time_t now;
-    time_t display_interval = time(NULL);
-
-    while(1){
-        //Readers-first synchronization
-        sem_wait(&display_sem);
-        reader_flag++;
-        if(reader_flag == 1)
-            sem_wait(&main_semaphore);
-        sem_post(&display_sem);
-        now = time(NULL);
-        //If alarm was removed, exit.
-        if(alarm->removed == 1){
-            flockfile(stdout);
-            printf("Display thread exiting at time %d: %d Message(%d) %s\n",
-                   (int) now, interval, alarm_num, msg);
-            fflush(stdout);
-            funlockfile(stdout);
-
-            //Exit safely and not abruptly
-            //If this is the last thread to exit, make sure it unlocks the semaphore as well
-            sem_wait(&display_sem);
-            reader_flag--;
-            if(reader_flag ==0)
-                sem_post(&main_semaphore);
-            sem_post(&display_sem);
-            //Free the thread_alarm struct used in this thread
-            free(alarm);
-            pthread_exit(NULL);
-
-
-        }
-
-        //If the alarm has been altered, display the message and then set the altered flag.
-        if(alarm->alarm->changed == 1){
-            printf("Alarm With Message Number (%d) Replaced at %d: %d Message(%d) %s\n",
-                   alarm->alarm->alarm_number, (int) now, alarm->alarm->seconds,alarm->alarm->alarm_number, alarm->alarm->message);
-            interval = alarm->alarm->seconds;
-            display_interval = now + interval;
-            has_changed = 1;
-            alarm->alarm->changed = 0;
-            strcpy(msg, alarm->alarm->message);
-        } else if(now >= display_interval){
-            //Check if the interval has been satisfied and
-            if(has_changed == 1){
-                printf("Replacement Alarm With Message Number (%d) Displayed at %d: %d Message(%d) %s\n",
-                       alarm->alarm->alarm_number, (int) now, alarm->alarm->seconds,alarm->alarm->alarm_number, alarm->alarm->message);
-
-            } else {
-                printf("Alarm With Message Number (%d) Displayed at %d: %d Message(%d) %s\n",
-                       alarm->alarm->alarm_number, (int) now, alarm->alarm->seconds,alarm->alarm->alarm_number, alarm->alarm->message);
-            }
-            display_interval = now+ alarm->alarm->seconds;
+const char * parse_trace_time(const char * p, const char * end, uint64_t * time){
+    uint64_t scale = NSEC_PER_SEC;
+    const char *start = p;
+
+    *time = 0;
+    while(p < end && *p >= '0' && *p <= '9')
+        *time = *time * 10 + (uint64_t) (*p++ - '0');
+    if(p == start)
+        return NULL;
+    *time *= NSEC_PER_SEC;
+    if(p < end && *p == '.'){
+        for(p++; p < end && *p >= '0' && *p <= '9'; p++){
+            scale /= 10;
+            *time += (uint64_t) (*p - '0') * scale;
         }
-
-        //Readers-first synchro
-        sem_wait(&display_sem);
-        reader_flag--;
-        if(reader_flag ==0)
-            sem_post(&main_semaphore);
-        sem_post(&display_sem);
     }
-
+    return p;
 }
 
 /*
- * Creates the list of display threads based on the last appended to the list.
- * It functions as a queue, creating threads in the order which they were added to the list.
- * We are assuming the `last` element is will not be passed as null, otherwise this could result in a
- * segfault.
- *
+ * Replays a block of complete trace lines, each a time followed by a
+ * command, on the engine's virtual clock: the clock is moved up to each
+ * line's time, firing whatever was due by then, and the command is made
+ * at that time. A line with only a time just moves the clock. The engine
+ * is started at the time of the first line. Returns a pointer past the
+ * last complete line.
  */
-display_thread_list * create_display_threads(display_thread_list * last){
-    if(last == NULL)
-        errno_abort("Last should not be null!");
-
-    //Reference to old element
-    append_list * old;
-    //New list node for the display thread list
-    display_thread_list * new_list_node;
-    //New thread_alarm
-    thread_alarm * new_thread_alarm;
-    //create a new thread. We don't care about the reference so we can discard it after the loop
-    pthread_t new_thread;
-    int counter = 0;
-    while(list_to_append != NULL){
-
-
-        old = list_to_append;
-        new_list_node = (display_thread_list *)malloc(sizeof(display_thread_list));
-        if (new_list_node == NULL) {
-            printf("Out of memory!\n");
-            exit(1);
+const char * replay_lines(uint32_t client, const char * p, const char * end){
+    parsed_command_t command;
+    const char *line, *newline, *rest;
+    uint64_t time;
+
+    while(p < end){
+        newline = memchr(p, '\n', (size_t) (end - p));
+        if(newline == NULL)
+            break;
+        line = p;
+        p = newline + 1;
+        if(p - line <= 1)
+            continue;
+
+        rest = parse_trace_time(line, newline, &time);
+        if(rest == NULL){
+            submit_command(PARSE_BAD_COMMAND, &command, client);
+            continue;
         }
-        new_list_node->previous = last;
-        new_list_node->next = NULL;
-        //Initialize the new thread's data
-        new_thread_alarm = (thread_alarm *) malloc(sizeof(thread_alarm));
-        if (new_thread_alarm == NULL) {
-            printf("Out of memory!\n");
-            exit(1);
+        if(!engine_created){
+            config.virtual_start = time;
+            alarm_engine_create(&config, print_event, NULL);
+            engine_created = 1;
         }
-        new_thread_alarm->alarm = old->alarm;
-        new_thread_alarm->removed = 0;
-        //Add the new thread data to a list struct
-        last->data = new_thread_alarm;
-        //Append the
-        last->next = new_list_node;
-        last = last->next;
-
-        list_to_append = list_to_append->next;
-        pthread_create(&new_thread, NULL, display_thread, (void *) new_thread_alarm);
-        free(old);
-        counter++;
+        alarm_engine_advance(time);
+        while(rest < newline && (*rest == ' ' || *rest == '\t'))
+            rest++;
+        if(rest < newline)
+            submit_command(parse_command(rest, p, &command), &command, client);
     }
-
-    //Return the reference to the last element
-    return last;
-
+    alarm_engine_flush();
+    return p;
 }
 
 /*
- * The alarm thread's start routine.
+ * Non-interactive input. A regular file is mapped and parsed in place,
+ * anything else is read in large blocks. There is no prompt. Blocks of
+ * lines go to `lines`.
  */
-void *alarm_thread (void *arg) {
-    thread_list = (display_thread_list *) malloc(sizeof(display_thread_list));
-    if (thread_list == NULL)
-        errno_abort("Out of memory\n");
-    display_thread_list * last = thread_list;
-
-    /*
-     * Loop forever, processing commands. The alarm thread will
-     * be disintegrated when the process exits.
-     * The default alarm_thread_flag will be 0, so the thread will busy wait
-     * until there are tasks for it
-     *
-     */
-    while (1) {
-
-        //Busy wait while the flag is 0
-        while(alarm_thread_flag == 0);
-        sem_wait(&main_semaphore);
-
-        if(append_flag == 1) {
-
-            //Create display threads
-            last = create_display_threads(last);
-            append_flag = 0;
-
+void ingest_batch(int fd, server_lines_t lines){
+    size_t size = 1 << 20, used = 0, rest;
+    struct stat info;
+    const char *done;
+    char *buffer, *last;
+    ssize_t bytes;
+
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+        buffer = (char *) mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(buffer != MAP_FAILED){
+            madvise(buffer, (size_t) info.st_size, MADV_SEQUENTIAL);
+            done = lines(OUTPUT_CONSOLE, buffer, buffer + info.st_size);
+            //The last line may have no newline, but a record cut short is lost
+            if(done < buffer + info.st_size && binary_mode){
+                if(!binary_broken)
+                    binary_reply(OUTPUT_CONSOLE, BINARY_STATUS_BROKEN, 0);
+            } else if(done < buffer + info.st_size){
+                rest = (size_t) (buffer + info.st_size - done);
+                last = (char *) malloc(rest + 1);
+                if(last == NULL)
+                    errno_abort("Allocate last line");
+                memcpy(last, done, rest);
+                last[rest] = '\n';
+                lines(OUTPUT_CONSOLE, last, last + rest + 1);
+                free(last);
+            }
+            munmap(buffer, (size_t) info.st_size);
+            return;
         }
+    }
 
-        if (delete_flag == 1){
-            alarm_delete();
-            delete_flag = 0;
+    buffer = (char *) malloc(size);
+    if(buffer == NULL)
+        errno_abort("Allocate input buffer");
+    while(1){
+        bytes = read(fd, buffer + used, size - used);
+        if(bytes < 0 && errno == EINTR)
+            continue;
+        if(bytes <= 0)
+            break;
+        used += (size_t) bytes;
+        done = lines(OUTPUT_CONSOLE, buffer, buffer + used);
+        //Carry the partial last line over to the next block
+        rest = used - (size_t) (done - buffer);
+        memmove(buffer, done, rest);
+        used = rest;
+        if(used == size){
+            size *= 2;
+            buffer = (char *) realloc(buffer, size);
+            if(buffer == NULL)
+                errno_abort("Grow input buffer");
         }
+    }
+    if(used > 0 && binary_mode){
+        if(!binary_broken)
+            binary_reply(OUTPUT_CONSOLE, BINARY_STATUS_BROKEN, 0);
+    } else if(used > 0){
+        buffer[used] = '\n';
+        lines(OUTPUT_CONSOLE, buffer, buffer + used + 1);
+    }
+    free(buffer);
+}
 
-        alarm_thread_flag = 0;
-        sem_post(&main_semaphore);
+/*
+ * Tells the engine that a client has gone. Its alarms are cancelled, and
+ * its destination closed once everything before is written.
+ */
+void disconnect_client(uint32_t client){
+    alarm_engine_release(client);
+}
 
-    }
+/*
+ * Prints how late alarms were displayed, over all the display workers.
+ */
+void report_jitter(){
+    histogram_t total;
+
+    alarm_engine_jitter(&total);
+    fprintf(stderr, "Jitter: %llu displays, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+            (unsigned long long) atomic_load(&total.total),
+            histogram_percentile(&total, 50) / 1000.0,
+            histogram_percentile(&total, 99) / 1000.0,
+            atomic_load(&total.max) / 1000.0);
 }
 
-int main (int argc, char *argv[]) {
-    int status;
-    char line[160]; //Messages with higher allocated size
-    char msg[10];
-    char cancellation[10];
-    int err_num, message_num;
-
-    time_t now;
-    alarm_t *alarm;
-    pthread_t thread;
-    append_list * to_append;
-
-    if(sem_init(&main_semaphore,0,1) < 0){
-        printf("Error creating semaphore!");
-        exit(1);
+/*
+ * Waits for everything read so far to be reported, then exits.
+ */
+void shut_down(){
+    //An empty trace never got the engine started
+    if(engine_created){
+#ifdef ALARM_METRICS
+        if(stats_file != NULL)
+            alarm_engine_stats(OUTPUT_CONSOLE, STATS_TO_FILE);
+#endif
+        alarm_engine_drain();
     }
+    output_flush();
+    if(jitter_report && engine_created)
+        report_jitter();
+    exit (0);
+}
 
-    if(sem_init(&display_sem,0,1) < 0){
-        printf("Error creating semaphore!");
-        exit(1);
+/*
+ * Parses a size in bytes, which may be followed by k, m or g.
+ */
+size_t parse_size(const char * text){
+    char * end;
+    size_t size = (size_t) strtoull(text, &end, 10);
+
+    switch(*end){
+        case 'g': case 'G':
+            size *= 1024;
+            //Fall through
+        case 'm': case 'M':
+            size *= 1024;
+            //Fall through
+        case 'k': case 'K':
+            size *= 1024;
     }
+    return size;
+}
 
-    //Create the alarm thread
-    status = pthread_create (
-            &thread, NULL, alarm_thread, NULL);
-    if (status != 0)
-        err_abort (status, "Create alarm thread");
-    while (1) {
-        printf ("Alarm> ");
-        if (fgets (line, sizeof (line), stdin) == NULL) exit (0);
-        if (strlen (line) <= 1) continue;
-        alarm = (alarm_t*)malloc (sizeof (alarm_t));
-        if (alarm == NULL)
-            errno_abort ("Allocate alarm");
-
-        //Parse input if it's of type A, check format correctness
-        if (sscanf (line, "%d %10[^(](%d) %128[^\n]", &alarm->seconds, msg, &alarm->alarm_number,alarm->message) == 4) {
-            //Check if message is in the right format
-            if (strcmp(msg, "Message") == 0) {
-                //This is a type A message
-                now = time(NULL);
-                alarm->link = NULL;
-                alarm->request_type = TYPE_A;
-                alarm->changed = 0;
-                //Main thread always counts as a writer, never a reader.
-                status = sem_wait(&main_semaphore);
-                if (status != 0)
-                    err_abort (status, "Lock mutex");
-
-                err_num = alarm_insert(alarm);
-                //Check the return type of the function.
-                switch (err_num) {
-                    case FIRST_ALARM:
-                        printf("First Alarm Request With Message Number (%d) Received at %d: %d Message(%d) %s\n",
-                               alarm->alarm_number, (int) now, alarm->seconds, alarm->alarm_number, alarm->message);
-                        //Add the element to the append list
-                        to_append = (append_list *) malloc(sizeof(append_list));
-                        to_append->next = NULL;
-                        to_append->alarm = alarm;
-                        to_append->last = NULL;
-                        //If the list is null, make the list reference the element
-                        if(list_to_append == NULL) {
-                            list_to_append = to_append;
-                        } else {
-                            //Otherwise, append in the next available
-                            if(list_to_append->next == NULL){
-                                list_to_append->next = to_append;
-                                list_to_append->last = to_append;
-                            } else {
-                                list_to_append->last->next = to_append;
-                                list_to_append->last = to_append;
-                            }
-                        }
-                        //Set the append flag, telling the alarm_thread we want to create threads
-                        append_flag = 1;
-                        break;
-                    case REPLACEMENT:
-                        printf("Replacement Alarm Request With Message Number (%d) Received at %d: %d Message(%d) %s\n",
-                               alarm->alarm_number, (int) now, alarm->seconds, alarm->alarm_number, alarm->message);
-                        break;
-                    default:
-                        err_abort(1, "Alarm added an incorrect type");
-                        break;
+int main (int argc, char *argv[]) {
+    //Lines are as long as the messages typed
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_length;
+    parsed_command_t command;
+    int batch_mode = 0, input_fd = STDIN_FILENO;
+    output_policy_t flush_policy;
+    int flush_set = 0;
+    //Where --listen and --tcp take clients
+    const char *listen_path = NULL;
+    int tcp_port = 0, listeners[2], listener_count = 0;
+    int replay = 0;
+    int option;
+
+    static struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"batch", no_argument, NULL, 'b'},
+        {"flush", required_argument, NULL, 'f'},
+        {"jitter", no_argument, NULL, 'j'},
+        {"stats-file", required_argument, NULL, 's'},
+        {"stats-interval", required_argument, NULL, 'i'},
+        {"state", required_argument, NULL, 'd'},
+        {"snapshot-every", required_argument, NULL, 'S'},
+        {"scheduler", required_argument, NULL, 'm'},
+        {"listen", required_argument, NULL, 'u'},
+        {"tcp", required_argument, NULL, 't'},
+        {"shards", required_argument, NULL, 'k'},
+        {"coalesce", required_argument, NULL, 'c'},
+        {"max-alarms", required_argument, NULL, 'A'},
+        {"max-memory", required_argument, NULL, 'M'},
+        {"max-pending", required_argument, NULL, 'P'},
+        {"replay", no_argument, NULL, 'r'},
+        {"binary", no_argument, NULL, 'B'},
+        {NULL, 0, NULL, 0}
+    };
+
+    //Default to one display worker per core
+    alarm_engine_default_config(&config);
+    while((option = getopt_long(argc, argv, "w:bf:js:i:d:S:m:u:t:k:c:A:M:P:rB", long_options, NULL)) != -1){
+        switch(option){
+            case 'w':
+                config.workers = atoi(optarg);
+                if(config.workers < 1 || config.workers > ALARM_MAX_WORKERS){
+                    fprintf(stderr, "Workers must be from 1 to %d\n", ALARM_MAX_WORKERS);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                batch_mode = 1;
+                break;
+            case 'r':
+                replay = 1;
+                batch_mode = 1;
+                break;
+            case 'B':
+                binary_mode = 1;
+                batch_mode = 1;
+                break;
+            case 'f':
+                if(!output_parse_policy(optarg, &flush_policy)){
+                    fprintf(stderr, "Unknown flush policy: %s\n", optarg);
+                    exit(1);
                 }
-                alarm_thread_flag = 1;
+                flush_set = 1;
+                break;
+            case 'j':
+                jitter_report = 1;
+                break;
+            case 'm':
+                if(strcmp(optarg, "wheel") == 0){
+                    config.sweep = 0;
+                } else if(strncmp(optarg, "sweep", 5) == 0
+                          && (optarg[5] == '\0' || (optarg[5] == ':' && sweep_select(optarg + 6)))){
+                    config.sweep = 1;
+                } else {
+                    fprintf(stderr, "Unknown scheduler: %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'd':
+                config.state_directory = optarg;
+                break;
+            case 'u':
+                listen_path = optarg;
+                break;
+            case 't':
+                tcp_port = atoi(optarg);
+                break;
+            case 'k':
+                config.shards = atoi(optarg);
+                if(config.shards < 1 || config.shards > ALARM_MAX_SHARDS){
+                    fprintf(stderr, "Shards must be from 1 to %d\n", ALARM_MAX_SHARDS);
+                    exit(1);
+                }
+                break;
+            case 'c':
+                config.coalesce_ns = strtoull(optarg, NULL, 10) * 1000;
+                break;
+            case 'A':
+                config.max_alarms = (size_t) strtoull(optarg, NULL, 10);
+                break;
+            case 'M':
+                config.max_memory = parse_size(optarg);
+                break;
+            case 'P':
+                config.max_pending = (size_t) strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                config.snapshot_every = (size_t) strtoull(optarg, NULL, 10);
+                break;
+#ifdef ALARM_METRICS
+            case 's':
+                stats_file = fopen(optarg, "a");
+                if(stats_file == NULL)
+                    errno_abort("Open stats file");
+                break;
+            case 'i':
+                stats_interval = atoi(optarg);
+                if(stats_interval < 1)
+                    stats_interval = 1;
+                break;
+#endif
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-b] [-f latency|throughput[:usec]] [-j]"
+                        " [-s stats file] [-i stats interval] [-d state directory] [-S snapshot every]"
+                        " [-m wheel|sweep[:avx2|sse|scalar]] [-u socket path] [-t tcp port]"
+                        " [-k shards] [-c coalesce usec] [-A max alarms] [-M max memory[k|m|g]]"
+                        " [-P max pending] [-r] [-B]"
+                        " [command file]\n", argv[0]);
+                exit(1);
+        }
+    }
+    //Commands from a file, or from anything that is not a terminal, are read in batches
+    if(optind < argc){
+        input_fd = open(argv[optind], O_RDONLY);
+        if(input_fd < 0)
+            errno_abort("Open command file");
+        batch_mode = 1;
+    }
+    if(!isatty(input_fd))
+        batch_mode = 1;
+    //A trace's times are text
+    if(binary_mode && replay){
+        fprintf(stderr, "--binary and --replay do not go together\n");
+        exit(1);
+    }
 
-                status = sem_post(&main_semaphore);
-                if (status != 0)
-                    err_abort (status, "Unlock mutex");
+    if(listen_path != NULL && !replay)
+        listeners[listener_count++] = server_listen_unix(listen_path);
+    if(tcp_port > 0 && !replay)
+        listeners[listener_count++] = server_listen_tcp(tcp_port);
+
+    //Batches favour throughput, a person at the prompt or a client favours latency
+    if(!flush_set)
+        output_default_policy(batch_mode && listener_count == 0 ? OUTPUT_THROUGHPUT : OUTPUT_LATENCY,
+                              &flush_policy);
+    output_init(STDOUT_FILENO, &flush_policy);
+
+    //A replay runs flat out on the engine's own clock, which starts with the
+    //trace, and stops at the end of the trace
+    if(replay){
+        config.virtual_clock = 1;
+        ingest_batch(input_fd, replay_lines);
+        shut_down();
+    }
 
+    alarm_engine_create(&config, binary_mode ? print_binary_event : print_event, NULL);
+    engine_created = 1;
 
-            } else {
-                printf("Error: Incorrect format\n");
+#ifdef ALARM_METRICS
+    if(stats_file != NULL){
+        pthread_t thread;
+        int status;
 
-            }
-            //Else, check if of type b
-        } else if(sscanf (line, "%[^:]: %10[^(](%d)", cancellation, msg, &message_num) == 3){
-            if(strcmp(cancellation, "Cancel") == 0) {
-                //Alarm is of type b
-                now = time(NULL);
-                alarm->alarm_number = message_num;
-                alarm->request_type = TYPE_B;
-
-                status = sem_wait(&main_semaphore);
-                if (status != 0)
-                    err_abort (status, "Lock mutex");
-
-                err_num = alarm_insert(alarm);
-                //Check the return type of the function.
-                switch(err_num){
-                    case NO_MATCHING_ALARM:
-                        printf("Error: No Alarm Request With Message Number (%d) to Cancel!\n",
-                               message_num);
-                        break;
-                    case MULTIPLE_CANCEL:
-                        printf("Error: More Than One Request to Cancel Alarm Request With Message Number (%d)\n",
-                               message_num);
-                        break;
-                    case CANCEL_REQ:
-                        printf("Cancel Alarm Request With Message Number (Message_Number) Received at %d: Cancel: Message(%d)\n",
-                               (int) now, alarm->alarm_number);
-                        //Set the alarm thread flag
-                        alarm_thread_flag = 1;
-                        //Set the delete flag, telling the alarm_thread we want to delete items.
-                        delete_flag = 1;
-                        break;
-                    default:
-                        err_abort(1, "Alarm added an incorrect type");
-                }
+        status = pthread_create(&thread, NULL, stats_dumper, NULL);
+        if(status != 0)
+            err_abort(status, "Create stats dumper");
+    }
+#endif
 
-                status = sem_post(&main_semaphore);
-                if (status != 0)
-                    err_abort (status, "Unlock mutex");
+    //Serve clients instead of reading commands, until killed
+    if(listener_count > 0)
+        server_run(listeners, listener_count, ingest_lines, disconnect_client);
 
+    if(batch_mode){
+        ingest_batch(input_fd, binary_mode ? binary_records : ingest_lines);
+        shut_down();
+    }
 
-            } else {
-                printf("Error: Incorrect format\n");
-            }
-        } else {
-            fprintf (stderr, "Bad command\n");
-            free (alarm);
-        }
+    while (1) {
+        output_printf ("Alarm> ");
+        line_length = getline(&line, &line_size, stdin);
+        if (line_length < 0)
+            shut_down();
+        if (line_length <= 1) continue;
+
+        //Hand it to the engine, which reports the outcome
+        submit_command(parse_command(line, line + line_length, &command), &command,
+                       OUTPUT_CONSOLE);
+        alarm_engine_flush();
     }
 }
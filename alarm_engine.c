@@ -0,0 +1,2245 @@
+/*
+ * alarm_engine.c
+ *
+ * The alarm engine: the shards, their alarm threads and display workers.
+ * See alarm_engine.h for the interface, and New_Alarm_Cond.c for the
+ * command line front end over it.
+ */
+//For pinning threads to cores
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include "errors.h"
+#include "alarm_engine.h"
+#include "timer_wheel.h"
+#include "sweep.h"
+#include "alarm_table.h"
+#include "slab.h"
+#include "cmd_queue.h"
+#include "epoch.h"
+#include "mono_clock.h"
+#include "metrics.h"
+#include "journal.h"
+#include <stdio.h>
+#include <limits.h>
+
+#define TYPE_A 0
+#define TYPE_B 1
+#define TYPE_STATS 2
+#define TYPE_CANCEL_RANGE 3
+#define TYPE_CANCEL_ALL 4
+#define TYPE_INTERVAL_RANGE 5
+#define TYPE_DISCONNECT 6
+#define TYPE_SNAPSHOT 7
+#define TYPE_WAKE 8
+#define TYPE_LIST 9
+#define TYPE_COUNT 10
+
+#define FIRST_ALARM 0
+#define REPLACEMENT 1
+#define NO_MATCHING_ALARM 2
+#define MULTIPLE_CANCEL 3
+#define CANCEL_REQ 4
+#define TOO_MANY_ALARMS 5
+#define OUT_OF_MEMORY 6
+
+
+/*
+ * The "alarm" structure holds both type A (alarm) and type B (cancel)
+ * requests, on their way to the alarm thread. Accepted type A alarms are
+ * kept in their shard's table, and the request is freed. A type B request
+ * waiting for the alarm thread is queued on the shard's cancel list through
+ * `link`, and its alarm is flagged ALARM_CANCELLING. `received` is when
+ * the request was made. `interval` is counted in `unit`, one of the PARSE_UNIT_ constants.
+ * A TYPE_STATS request asks for a metrics report of the series numbered
+ * `alarm_number`. The bulk requests apply to the alarms numbered from
+ * `alarm_number` to `last_number`. `client` is whoever made the request,
+ * which is who its outcome is reported to, and a TYPE_DISCONNECT request
+ * releases that client's alarms. TYPE_LIST and TYPE_COUNT requests look
+ * at the alarms numbered from `alarm_number` to `last_number`. Requests
+ * that go to every shard share a `fan_out`. A type A request's `message` is kept in `inline_message` if
+ * it fits, and allocated otherwise; request_free() frees either.
+ */
+#define REQUEST_INLINE_MESSAGE 64
+
+typedef struct alarm_tag {
+    struct alarm_tag    *link;
+    int                 interval;
+    int                 unit;
+    int                 alarm_number;
+    int                 last_number;
+    int                 request_type;
+    char *              message;
+    size_t              message_length;
+    time_t              received;
+    uint32_t            client;
+    struct fan_out      *fan_out;
+    char                inline_message[REQUEST_INLINE_MESSAGE];
+} alarm_t;
+
+/*
+ * A list in the making. Each shard's part holds the entries for its alarms
+ * as they were when it got to its copy of the request, see list_start().
+ * The last shard to get to its copy queues the list for list_thread(),
+ * through `next`, which finishes the parts and owns them from then on.
+ */
+typedef struct alarm_list {
+    struct alarm_list * next;
+    alarm_entry_t *     parts[ALARM_MAX_SHARDS];
+    size_t              counts[ALARM_MAX_SHARDS];
+    size_t              capacities[ALARM_MAX_SHARDS];
+    int                 first;
+    int                 last;
+    uint32_t            client;
+    time_t              received;
+} alarm_list_t;
+
+/*
+ * What the copies of a request sent to every shard share. Each shard adds
+ * what it did to the totals, and the last one to get to its copy reports
+ * the outcome. `list` is only there for a TYPE_LIST request.
+ */
+typedef struct fan_out {
+    atomic_int          pending;
+    atomic_size_t       count;
+    atomic_size_t       scheduled;
+    atomic_size_t       memory;
+    alarm_list_t *      list;
+} fan_out_t;
+
+/*
+ * The append_list structure contains the number of an alarm to move to a new thread and append.
+ * This structure is useful in the case of flooded alarm requests, so it will append all in a batch,
+ * or simply one by one.
+ *
+ * The reference to last allows us to append to the end of the list
+ *
+ */
+typedef struct append_list{
+    int                 alarm_number;
+    struct append_list* next;
+    struct append_list* last;
+} append_list;
+
+/*
+ * What the display workers show for an alarm. A body is never modified
+ * once published: a replacement publishes a new body with the next version
+ * number, and the old one is reclaimed once no worker can be reading it.
+ * `period` is the interval in nanoseconds, and `owner` where the displays
+ * go. `message` is shared with the message arena, see message_arena.h, and
+ * held until the body is freed.
+ */
+typedef struct alarm_body {
+    int             interval;
+    int             unit;
+    uint64_t        period;
+    int             version;
+    uint32_t        owner;
+    message_t *     message;
+} alarm_body_t;
+
+/*
+ * Structure to hold the display state of an alarm and information
+ * regarding the alarm's removal.
+ *
+ * Display threads have been replaced by a pool of display workers sharing
+ * a timing wheel, so this structure is what gets scheduled. The wheel entry
+ * must remain the first member, so that a wheel_entry_t can be cast back.
+ *
+ * `body` is read by workers inside an epoch critical section. Of the rest,
+ * removed, published and in_flight are protected by wheel_mutex, and the
+ * others belong to the worker holding the alarm. `deadline` is when the
+ * alarm is next meant to be displayed, in nanoseconds on CLOCK_MONOTONIC.
+ * In sweep mode, `slot` is the alarm's place in the sweep, and is protected
+ * by wheel_mutex; the wheel entry goes unused. `shard` is the shard
+ * scheduling the alarm. `message` is the message last displayed, held
+ * like a body's.
+ */
+typedef struct display_thread_alarm {
+    wheel_entry_t   entry;
+    _Atomic(alarm_body_t *) body;
+    int             removed;
+    int             published;
+    int             in_flight;
+    int             version;
+    int             has_changed;
+    int             alarm_num;
+    int             interval;
+    int             unit;
+    uint64_t        deadline;
+    size_t          slot;
+    uint32_t        owner;
+    struct shard *  shard;
+    message_t *     message;
+} thread_alarm;
+
+//Values of `removed`: alarms cancelled in bulk go without a line each
+#define DISPLAY_REMOVED 1
+#define DISPLAY_REMOVED_QUIETLY 2
+
+/*
+ * Maximum number of due alarms a display worker takes off the wheel
+ * at a time, so that a burst of due alarms is spread among the workers.
+ */
+#define DISPLAY_BATCH 64
+
+/*
+ * Deadlines are kept in nanoseconds, and the timing wheel turns once every
+ * WHEEL_TICK_NS. An alarm is displayed on the first tick at or after its
+ * deadline, so it is never early and at most a tick late, plus however long
+ * the worker takes to wake up.
+ */
+#define WHEEL_TICK_NS 100000
+#define WHEEL_TICK(ns) (((ns) + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS)
+
+/*
+ * Each pass of the sweeper goes over every alarm, so passes are at least
+ * SWEEP_TICK_NS apart, and an alarm is displayed up to that much late.
+ */
+#define SWEEP_TICK_NS 1000000
+
+/*
+ * Requests are posted to a shard's queue by the threads making them, and
+ * the shard's alarm thread drains them in batches of up to CMD_BATCH. A
+ * full queue blocks the poster until there is room, which slows ingest
+ * down to what the alarm threads keep up with. --max-pending sets the
+ * size of the queues.
+ */
+#define CMD_QUEUE_SIZE 65536
+#define CMD_BATCH 256
+
+/*
+ * Parts of lists are copied LIST_CHUNK alarms at a time, holding
+ * wheel_mutex and the shard's copy_mutex, so neither the display workers
+ * nor the alarm thread are ever held up for long, however many alarms
+ * there are.
+ */
+#define LIST_CHUNK 4096
+
+//Matches the alarms of every client
+#define ANY_OWNER UINT32_MAX
+
+/*
+ * The engine is split into shards, and every alarm number belongs to one
+ * of them. A shard owns the table of its alarms, the queue of requests for
+ * them, and the scheduler displaying them, and runs its own alarm thread
+ * and display workers, pinned to cores of their own when there is more
+ * than one shard. Shards share no locks, so they meet only in the event
+ * callback, the journal writer and the slab caches. A single shard is the
+ * engine as it was before.
+ *
+ * Requests go to the queue of the shard owning their alarm. Requests that
+ * are not about one alarm go to every shard, see fan_out().
+ *
+ * The shard's alarm thread is the only one touching `table`, the cancel
+ * list and the append list, so they need no lock, and display workers
+ * never hold it up. `wheel_mutex` protects the wheel or the sweep, and
+ * `wheel_cond` is signalled whenever an alarm is made due outside of a
+ * display worker; waits on it time out on CLOCK_MONOTONIC, see main.
+ * With --scheduler sweep, a single sweeper fires every alarm of the shard
+ * from `sweep` instead of the workers sharing the wheel. wheel_mutex and
+ * wheel_cond serve it all the same.
+ *
+ * Replacements are not passed on to the display workers one by one. The
+ * alarm thread updates the table, and publishes every alarm replaced in
+ * the last `coalesce_window` nanoseconds at once, with one new body per
+ * alarm, however many times it was replaced, and one wakeup for them all.
+ * A window of 0 publishes at the end of every batch of requests.
+ *
+ * `copying` is the list the shard is copying its part of, if any, and
+ * `copy_cursor` the row the list thread got to. A row is copied once its
+ * ALARM_LISTED flag matches `list_mark`. The alarm thread holds
+ * `copy_mutex` for each batch of requests, and the list thread for each
+ * chunk it copies, setting `list_wants` while it waits for its turn.
+ */
+typedef struct shard {
+    cmd_queue_t     queue;
+    alarm_table_t   table;
+    //Cancel requests waiting for the alarm thread, in arrival order
+    alarm_t *       cancel_list;
+    alarm_t *       cancel_list_last;
+    size_t          cancelling;
+    append_list *   list_to_append;
+
+    timer_wheel_t   wheel;
+    pthread_mutex_t wheel_mutex;
+    pthread_cond_t  wheel_cond;
+    sweep_t         sweep;
+    int             workers;
+    //How late each display worker's alarms were, in nanoseconds
+    histogram_t *   jitter;
+
+    //Alarms replaced since the last publish_replacements(), and since when
+    int *           replaced;
+    size_t          replaced_count;
+    size_t          replaced_capacity;
+    uint64_t        replaced_since;
+
+    //The shard's share of --max-alarms and --max-memory, 0 for no limit
+    size_t          alarm_limit;
+    size_t          memory_limit;
+
+    int             index;
+    //Part of a snapshot in the making, see snapshot_part()
+    snapshot_part_t snapshot;
+    int             holding;
+
+    pthread_mutex_t copy_mutex;
+    _Atomic(alarm_list_t *) copying;
+    size_t          copy_cursor;
+    uint8_t         list_mark;
+    atomic_int      list_wants;
+} shard_t;
+
+/*
+ * What a display worker starts with.
+ */
+typedef struct display_worker_arg {
+    shard_t *       shard;
+    int             index;
+} display_worker_arg_t;
+
+static shard_t *shards = NULL;
+static int shard_count = 1;
+static int sweep_mode = 0;
+
+//Where events go
+static alarm_callback_t callback;
+static void *callback_context;
+
+//Whether a snapshot is in the making, and how many were handed over
+static atomic_int snapshotting = 0;
+static atomic_size_t snapshots_taken = 0;
+
+static uint64_t coalesce_window = 0;
+
+//Lists queued for list_thread(), and how many are not handed over in full yet
+static alarm_list_t *list_jobs = NULL, *list_jobs_last = NULL;
+static int listing = 0;
+static pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t list_ready = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Admission control. New alarms are rejected once a shard holds its share
+ * of `max_alarms`, or its alarms take up its share of `max_memory` bytes;
+ * 0 is no limit. Replacements and cancels are always let through. Memory
+ * is counted as ALARM_FOOTPRINT per alarm, which is its table row, index
+ * slots, display data and body, plus the messages interned for them.
+ */
+static size_t max_alarms = 0;
+static size_t max_memory = 0;
+
+#define ALARM_FOOTPRINT (2 * sizeof(int32_t) + sizeof(uint64_t) + 2 * sizeof(uint8_t) \
+                         + 2 * sizeof(uint32_t) + sizeof(void *) + 2 * sizeof(alarm_store_slot) \
+                         + sizeof(thread_alarm) + sizeof(alarm_body_t))
+
+//Where --state keeps the alarms, and how many journal records between snapshots
+static const char *state_directory = NULL;
+static size_t snapshot_every = 1000000;
+
+//When the engine started, which the first report of each stats series counts from
+static uint64_t start_time;
+
+/*
+ * The virtual clock, see alarm_engine.h. `virtual_now` is in nanoseconds
+ * since the epoch, and stands in for both clocks: the monotonic one the
+ * deadlines are kept on, and the wall clock events are stamped with.
+ */
+static int virtual_clock = 0;
+static uint64_t virtual_now;
+
+static inline uint64_t engine_now(void){
+    return virtual_clock ? virtual_now : mono_now();
+}
+
+static inline time_t engine_wall(void){
+    return virtual_clock ? (time_t) (virtual_now / NSEC_PER_SEC) : time(NULL);
+}
+
+static inline uint64_t engine_wall_ns(void){
+    struct timespec now;
+
+    if(virtual_clock)
+        return virtual_now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * NSEC_PER_SEC + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * Slab caches for the structures allocated for every request. They are
+ * freed by other threads than the ones allocating them, and recycled.
+ */
+static slab_cache_t alarm_cache;
+static slab_cache_t append_cache;
+static slab_cache_t thread_alarm_cache;
+static slab_cache_t body_cache;
+
+static void free_body(void *body){
+    message_drop(((alarm_body_t *) body)->message);
+    slab_free(&body_cache, body);
+}
+
+/*
+ * Frees a request, and its message if it has one of its own.
+ */
+static void request_free(alarm_t * alarm){
+    if(alarm->message != alarm->inline_message)
+        free(alarm->message);
+    slab_free(&alarm_cache, alarm);
+}
+
+/*
+ * Roughly how much memory a shard's alarms take, see ALARM_FOOTPRINT.
+ */
+static size_t shard_memory(shard_t * shard){
+    return shard->table.count * ALARM_FOOTPRINT + shard->table.arena.bytes;
+}
+
+/*
+ * Pins the calling thread to its shard's share of the cores, when there is
+ * more than one shard. Shards share cores when there are more of them than
+ * cores. Pinning is only a hint; if it fails, the thread runs anywhere.
+ */
+static void pin_to_shard(shard_t * shard){
+    long cores = sysconf(_SC_NPROCESSORS_ONLN), first, last, core;
+    cpu_set_t set;
+
+    if(shard_count == 1 || cores < 1)
+        return;
+    first = shard->index * cores / shard_count;
+    last = (shard->index + 1) * cores / shard_count;
+    if(last == first)
+        last = first + 1;
+    CPU_ZERO(&set);
+    for(core = first; core < last; core++)
+        CPU_SET((int) core, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/*
+ * Returns the shard owning an alarm number. The number is hashed first, so
+ * that numbers following a stride still spread over every shard.
+ */
+static shard_t * shard_of(int alarm_number){
+    uint32_t hash = (uint32_t) alarm_number * 2654435761u;
+
+    return &shards[((uint64_t) hash * (uint64_t) shard_count) >> 32];
+}
+
+static void process_bulk(shard_t * shard, alarm_t *alarm);
+static void create_display_alarms(shard_t * shard);
+static void list_touch(shard_t * shard, size_t row, int locked);
+
+/*
+ * Sends a request that is not about one alarm to every shard, each getting
+ * a copy, and frees it. `self` is the calling alarm thread's own shard, or
+ * NULL for any other thread: an alarm thread applies its copy right away,
+ * rather than wait on its own queue.
+ */
+static void fan_out(alarm_t * alarm, shard_t * self){
+    fan_out_t * shared = (fan_out_t *) malloc(sizeof(fan_out_t));
+    alarm_t * copy;
+    int i;
+
+    if(shared == NULL)
+        errno_abort("Allocate fan out");
+    atomic_init(&shared->pending, shard_count);
+    atomic_init(&shared->count, 0);
+    atomic_init(&shared->scheduled, 0);
+    atomic_init(&shared->memory, 0);
+    shared->list = NULL;
+    if(alarm->request_type == TYPE_LIST){
+        shared->list = (alarm_list_t *) calloc(1, sizeof(alarm_list_t));
+        if(shared->list == NULL)
+            errno_abort("Allocate list");
+        shared->list->first = alarm->alarm_number;
+        shared->list->last = alarm->last_number;
+        shared->list->client = alarm->client;
+        shared->list->received = alarm->received;
+    }
+    alarm->fan_out = shared;
+    for(i = 0; i < shard_count; i++){
+        copy = (alarm_t *) slab_alloc(&alarm_cache);
+        *copy = *alarm;
+        //Nothing sent to every shard has a message
+        copy->message = NULL;
+        if(&shards[i] == self){
+            process_bulk(self, copy);
+            request_free(copy);
+        } else {
+            METRIC_TIMED(METRIC_ENQUEUE_WAIT, cmd_queue_push(&shards[i].queue, copy));
+        }
+    }
+    request_free(alarm);
+}
+
+/*
+ * Makes an alarm's display data due right away, so that its change is
+ * picked up. An alarm a display worker holds is looked at again once the
+ * worker is done with it. The caller holds wheel_mutex, and signals
+ * wheel_cond.
+ */
+static void make_due(thread_alarm * display){
+    shard_t * shard = display->shard;
+
+    if(sweep_mode)
+        shard->sweep.deadlines[display->slot] = 0;
+    else if(!display->in_flight)
+        wheel_add(&shard->wheel, &display->entry, shard->wheel.current);
+}
+
+/*
+ * Marks an alarm's display data as removed.
+ * The alarm is put back on the wheel as due, so that a display worker
+ * prints the exit message and cleans it up.
+ *
+ */
+static void remove_display_alarm(thread_alarm * display){
+    shard_t * shard;
+
+    if(display == NULL)
+        return;
+    shard = display->shard;
+
+    //Mark as removed. If a worker currently holds it, the worker will reschedule it.
+    METRIC_LOCK(&shard->wheel_mutex);
+    display->removed = DISPLAY_REMOVED;
+    make_due(display);
+    pthread_cond_signal(&shard->wheel_cond);
+    pthread_mutex_unlock(&shard->wheel_mutex);
+}
+
+/*
+ * Publishes the replaced message and interval of an alarm to its display
+ * data, and returns the display data. Returns NULL if the alarm is not
+ * scheduled yet, in which case the change is seen on its first display.
+ */
+static thread_alarm * publish_body(shard_t * shard, size_t row){
+    thread_alarm * display = (thread_alarm *) shard->table.displays[row];
+    alarm_body_t * body, * old;
+    if(display == NULL)
+        return NULL;
+
+    old = atomic_load_explicit(&display->body, memory_order_relaxed);
+    body = (alarm_body_t *) slab_alloc(&body_cache);
+    body->interval = shard->table.intervals[row];
+    body->unit = shard->table.units[row];
+    body->period = shard->table.periods[row];
+    body->version = old->version + 1;
+    body->owner = shard->table.owners[row];
+    body->message = message_hold(&shard->table.arena, shard->table.messages[row]);
+    atomic_store_explicit(&display->body, body, memory_order_release);
+    epoch_retire(old, free_body);
+    return display;
+}
+
+/*
+ * Notes that an alarm was replaced, for publish_replacements() to pass on.
+ * An alarm replaced again before then is noted once.
+ */
+static void defer_replacement(shard_t * shard, size_t row){
+    if(shard->table.flags[row] & ALARM_UNPUBLISHED)
+        return;
+    shard->table.flags[row] |= ALARM_UNPUBLISHED;
+    if(shard->replaced_count == 0)
+        shard->replaced_since = engine_now();
+    if(shard->replaced_count == shard->replaced_capacity){
+        shard->replaced_capacity = shard->replaced_capacity ? shard->replaced_capacity * 2 : 64;
+        shard->replaced = (int *) realloc(shard->replaced,
+                                          shard->replaced_capacity * sizeof(int));
+        if(shard->replaced == NULL)
+            errno_abort("Grow replaced alarms");
+    }
+    shard->replaced[shard->replaced_count++] = shard->table.numbers[row];
+}
+
+/*
+ * Publishes the latest message and interval of every alarm replaced since
+ * the last call, and reschedules them so that the display workers pick up
+ * the changes right away. Alarms cancelled meanwhile are skipped.
+ *
+ */
+static void publish_replacements(shard_t * shard){
+    thread_alarm * display;
+    size_t i, row, published = 0;
+
+    METRIC_LOCK(&shard->wheel_mutex);
+    for(i = 0; i < shard->replaced_count; i++){
+        row = alarm_table_find(&shard->table, shard->replaced[i]);
+        if(row == ALARM_NONE || !(shard->table.flags[row] & ALARM_UNPUBLISHED))
+            continue;
+        list_touch(shard, row, 1);
+        shard->table.flags[row] &= (uint8_t) ~ALARM_UNPUBLISHED;
+        display = publish_body(shard, row);
+        if(display == NULL)
+            continue;
+        display->published = atomic_load_explicit(&display->body, memory_order_relaxed)->version;
+        make_due(display);
+        published++;
+    }
+    if(published > 0)
+        pthread_cond_broadcast(&shard->wheel_cond);
+    pthread_mutex_unlock(&shard->wheel_mutex);
+    shard->replaced_count = 0;
+}
+
+/*
+ * Function to execute the cancel requests.
+ * Every type B request queued since the last call removes its alarm from
+ * the store, and marks the alarm's display data as removed.
+ *
+ */
+static void alarm_delete(shard_t * shard){
+    alarm_t *next;
+    size_t row;
+
+    /*Locking protocol:
+     *
+     * Only the alarm thread may call this method.
+     *
+     */
+    while(shard->cancel_list != NULL){
+        next = shard->cancel_list;
+        shard->cancel_list = next->link;
+
+        row = alarm_table_find(&shard->table, next->alarm_number);
+        if(row != ALARM_NONE){
+            if(state_directory != NULL)
+                journal_append(JOURNAL_CANCEL, next->alarm_number, 0, 0, NULL, 0);
+            //The last row moves into the gap, perhaps behind a list's copy
+            list_touch(shard, row, 0);
+            list_touch(shard, shard->table.count - 1, 0);
+            //Before removing, mark display as removed
+            remove_display_alarm((thread_alarm *) shard->table.displays[row]);
+            alarm_table_remove(&shard->table, row);
+        }
+        request_free(next);
+    }
+    shard->cancel_list_last = NULL;
+    shard->cancelling = 0;
+};
+
+/*
+ * Copies a type A request's interval and message into a row of the table.
+ * The alarm's displays go to whoever set it last.
+ */
+static void set_alarm(shard_t * shard, size_t row, alarm_t *alarm){
+    shard->table.owners[row] = alarm->client;
+    shard->table.intervals[row] = alarm->interval;
+    shard->table.units[row] = (uint8_t) alarm->unit;
+    shard->table.periods[row] = parse_interval_ns(alarm->interval, alarm->unit);
+    alarm_table_set_message(&shard->table, row, alarm->message, alarm->message_length);
+}
+
+/*
+ * Insert alarm entry in the table.
+ * A type A alarm is either new or replaces the alarm with the same number.
+ * An alarm with a cancel pending is cancelled first, and set as new.
+ * A type B request is queued for alarm_delete, if there is an alarm to cancel.
+ */
+static int alarm_insert(shard_t * shard, alarm_t *alarm) {
+    size_t row;
+
+    /*
+     * LOCKING PROTOCOL:
+     * 
+     * Only the alarm thread may call this routine.
+     */
+    row = alarm_table_find(&shard->table, alarm->alarm_number);
+
+    //The caller still reports a type A request, so it frees the alarm.
+    if(alarm->request_type == TYPE_A){
+        //The cancel came first: carry it out, then set the alarm anew
+        if(row != ALARM_NONE && (shard->table.flags[row] & ALARM_CANCELLING)){
+            if(shard->list_to_append != NULL)
+                create_display_alarms(shard);
+            alarm_delete(shard);
+            row = ALARM_NONE;
+        }
+        if(row == ALARM_NONE){
+            //Alarms about to be cancelled have given up their place
+            if(shard->alarm_limit != 0 && shard->table.count - shard->cancelling >= shard->alarm_limit)
+                return TOO_MANY_ALARMS;
+            if(shard->memory_limit != 0
+               && shard_memory(shard) + ALARM_FOOTPRINT + alarm->message_length > shard->memory_limit)
+                return OUT_OF_MEMORY;
+            row = alarm_table_add(&shard->table, alarm->alarm_number);
+            //Lists being copied did not have it
+            shard->table.flags[row] |= shard->list_mark;
+            set_alarm(shard, row, alarm);
+            return FIRST_ALARM;
+        }
+        //It is a replacement, copy the message and the new time
+        list_touch(shard, row, 0);
+        set_alarm(shard, row, alarm);
+        shard->table.flags[row] |= ALARM_CHANGED;
+        defer_replacement(shard, row);
+        return REPLACEMENT;
+    }
+
+    //If its' a standalone B that doesn't match, return error and free
+    if(row == ALARM_NONE){
+        request_free(alarm);
+        return NO_MATCHING_ALARM;
+    }
+    //Cancel already requested, free the alarm, signal multiple cancel.
+    if(shard->table.flags[row] & ALARM_CANCELLING){
+        request_free(alarm);
+        return MULTIPLE_CANCEL;
+    }
+
+    list_touch(shard, row, 0);
+    shard->table.flags[row] |= ALARM_CANCELLING;
+    alarm->link = NULL;
+    if(shard->cancel_list == NULL)
+        shard->cancel_list = alarm;
+    else
+        shard->cancel_list_last->link = alarm;
+    shard->cancel_list_last = alarm;
+    shard->cancelling++;
+    return CANCEL_REQ;
+}
+
+/*
+ * Hands a display event about an alarm to the callback, with the interval
+ * and message given.
+ */
+static void notify_display(int type, thread_alarm * alarm, uint32_t owner, int interval,
+                           int unit, message_t * message, time_t wall){
+    alarm_event_t event = {0};
+
+    event.type = type;
+    event.client = owner;
+    event.alarm_number = alarm->alarm_num;
+    event.interval = interval;
+    event.unit = unit;
+    event.replaced = type == ALARM_EVENT_FIRED && alarm->has_changed;
+    event.message = message->text;
+    event.message_length = message->length;
+    event.time = wall;
+    callback(&event, callback_context);
+}
+
+/*
+ * Displays a single due alarm, the same way the display threads used to.
+ * `removed` is the alarm's removed flag as of when the worker took it.
+ * `now` is the monotonic time the alarm was found due at, and `wall` the
+ * same moment in seconds since the epoch, which is what gets reported.
+ * Returns the next deadline, or 0 if the alarm was removed and freed.
+ * Requires the caller to be inside an epoch critical section.
+ *
+ */
+static uint64_t display_alarm(thread_alarm * alarm, int removed, uint64_t now, time_t wall,
+                              histogram_t * lateness) {
+    alarm_body_t * body;
+    uint64_t period;
+
+    //If alarm was removed, exit.
+    if(removed){
+        if(removed == DISPLAY_REMOVED)
+            notify_display(ALARM_EVENT_CANCELLED, alarm, alarm->owner, alarm->interval,
+                           alarm->unit, alarm->message, wall);
+
+        //Free the thread_alarm struct and its body, nothing else references them
+        free_body(atomic_load_explicit(&alarm->body, memory_order_relaxed));
+        message_drop(alarm->message);
+        slab_free(&thread_alarm_cache, alarm);
+        return 0;
+    }
+
+    METRIC_ADD(METRIC_DISPLAYS, 1);
+    //Alarms brought forward by a replacement are not late for anything
+    if(now >= alarm->deadline)
+        histogram_record(lateness, now - alarm->deadline);
+
+    body = atomic_load_explicit(&alarm->body, memory_order_acquire);
+    //An interval under a second would keep the alarm permanently due
+    period = body->period != 0 ? body->period : NSEC_PER_SEC;
+    //If the alarm has been altered, display the message and then note the version seen.
+    if(body->version != alarm->version){
+        notify_display(ALARM_EVENT_REPLACED, alarm, body->owner, body->interval, body->unit,
+                       body->message, wall);
+        alarm->interval = body->interval;
+        alarm->unit = body->unit;
+        alarm->has_changed = 1;
+        alarm->version = body->version;
+        alarm->owner = body->owner;
+        message_drop(alarm->message);
+        alarm->message = message_share(body->message);
+        //The new interval counts from now
+        alarm->deadline = now + period;
+        return alarm->deadline;
+    }
+    notify_display(ALARM_EVENT_FIRED, alarm, body->owner, body->interval, body->unit,
+                   body->message, wall);
+
+    //Keep to the original schedule, so lateness does not add up. An alarm
+    //that fell more than a period behind skips the displays it missed.
+    alarm->deadline += period;
+    if(alarm->deadline <= now)
+        alarm->deadline = now + period;
+    return alarm->deadline;
+}
+
+/*
+ * Takes up to DISPLAY_BATCH due alarms off a shard's wheel, noting their
+ * removed flags. The caller holds wheel_mutex.
+ */
+static int take_due(shard_t * shard, thread_alarm ** batch, int * removed){
+    wheel_entry_t * entry;
+    int count = 0;
+
+    while(count < DISPLAY_BATCH && (entry = wheel_pop_due(&shard->wheel)) != NULL){
+        batch[count] = (thread_alarm *) entry;
+        batch[count]->in_flight = 1;
+        removed[count] = batch[count]->removed;
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Puts displayed alarms back on the wheel for their next display. Anything
+ * removed or replaced in the meantime is due right away. The caller holds
+ * wheel_mutex.
+ */
+static void rearm(shard_t * shard, thread_alarm ** batch, uint64_t * next, int count){
+    int i;
+
+    for(i = 0; i < count; i++){
+        if(next[i] == 0)
+            continue;
+        batch[i]->in_flight = 0;
+        if(batch[i]->removed || batch[i]->published > batch[i]->version)
+            wheel_add(&shard->wheel, &batch[i]->entry, shard->wheel.current);
+        else
+            wheel_add(&shard->wheel, &batch[i]->entry, WHEEL_TICK(next[i]));
+    }
+}
+
+/*
+ * The display worker
+ * Takes due alarms off the timing wheel in batches, displays them and
+ * puts them back on the wheel for their next display.
+ * Idle workers block until the wheel's next deadline, or until they are
+ * signalled about a new, replaced or cancelled alarm.
+ * `arg` is a display_worker_arg_t, with the worker's index into its
+ * shard's jitter.
+ *
+ */
+static void * display_worker(void * arg) {
+    shard_t * shard = ((display_worker_arg_t *) arg)->shard;
+    thread_alarm * batch[DISPLAY_BATCH];
+    int removed[DISPLAY_BATCH];
+    uint64_t next[DISPLAY_BATCH];
+    histogram_t * lateness = &shard->jitter[((display_worker_arg_t *) arg)->index];
+    uint64_t now, expires;
+    time_t wall;
+    int count, i;
+
+    struct timespec deadline;
+
+    pin_to_shard(shard);
+    METRIC_LOCK(&shard->wheel_mutex);
+    while(1){
+        now = mono_now();
+        wheel_advance(&shard->wheel, now / WHEEL_TICK_NS);
+        count = take_due(shard, batch, removed);
+
+        if(count == 0){
+            //Block until the next deadline, or until someone makes an alarm due
+            if(wheel_next_expiry(&shard->wheel, &expires)){
+                deadline = mono_timespec(expires * WHEEL_TICK_NS);
+                pthread_cond_timedwait(&shard->wheel_cond, &shard->wheel_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&shard->wheel_cond, &shard->wheel_mutex);
+            }
+            continue;
+        }
+        //Leave the rest of a burst to another worker
+        if(shard->wheel.due.next != &shard->wheel.due)
+            pthread_cond_signal(&shard->wheel_cond);
+        pthread_mutex_unlock(&shard->wheel_mutex);
+
+        //Bodies replaced meanwhile stay around until the worker leaves the epoch
+        wall = time(NULL);
+        epoch_enter();
+        for(i = 0; i < count; i++)
+            next[i] = display_alarm(batch[i], removed[i], now, wall, lateness);
+        epoch_exit();
+
+        //The lock is kept for the next pass through the loop
+        METRIC_LOCK(&shard->wheel_mutex);
+        rearm(shard, batch, next, count);
+    }
+
+}
+
+static int descending(const void *a, const void *b){
+    size_t x = *(const size_t *) a, y = *(const size_t *) b;
+
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * The sweeper, which displays every alarm in sweep mode.
+ * Each pass over the sweep finds the due alarms and re-arms them for their
+ * next display in one go. The sweeper then displays them without the lock,
+ * and afterwards fixes up the deadlines of the alarms that were replaced,
+ * and drops the removed ones. It blocks until the earliest deadline, or
+ * until it is signalled about a new, replaced or cancelled alarm, but
+ * never passes more than once per SWEEP_TICK_NS.
+ *
+ */
+static void * sweep_worker(void * arg) {
+    shard_t * shard = ((display_worker_arg_t *) arg)->shard;
+    thread_alarm ** batch = NULL;
+    size_t * removed_slots = NULL;
+    uint64_t * next = NULL;
+    uint32_t * due = NULL;
+    int * removed = NULL, * version = NULL;
+    histogram_t * lateness = &shard->jitter[0];
+    thread_alarm * moved;
+    size_t room = 0, count, removals, i;
+    uint64_t now, earliest, last = 0;
+    time_t wall;
+
+    struct timespec deadline;
+
+    pin_to_shard(shard);
+    METRIC_LOCK(&shard->wheel_mutex);
+    while(1){
+        now = mono_now();
+        if(now < last + SWEEP_TICK_NS){
+            deadline = mono_timespec(last + SWEEP_TICK_NS);
+            pthread_cond_timedwait(&shard->wheel_cond, &shard->wheel_mutex, &deadline);
+            continue;
+        }
+        last = now;
+        if(room < shard->sweep.count){
+            room = shard->sweep.capacity;
+            batch = (thread_alarm **) realloc(batch, room * sizeof(thread_alarm *));
+            removed_slots = (size_t *) realloc(removed_slots, room * sizeof(size_t));
+            next = (uint64_t *) realloc(next, room * sizeof(uint64_t));
+            due = (uint32_t *) realloc(due, room * sizeof(uint32_t));
+            removed = (int *) realloc(removed, room * sizeof(int));
+            version = (int *) realloc(version, room * sizeof(int));
+            if(batch == NULL || removed_slots == NULL || next == NULL || due == NULL
+               || removed == NULL || version == NULL)
+                errno_abort("Allocate sweep batch");
+        }
+        count = sweep_run(&shard->sweep, now, due, &earliest);
+
+        if(count == 0){
+            //Block until the next deadline, or until someone makes an alarm due
+            if(earliest != UINT64_MAX){
+                deadline = mono_timespec(earliest);
+                pthread_cond_timedwait(&shard->wheel_cond, &shard->wheel_mutex, &deadline);
+            } else {
+                pthread_cond_wait(&shard->wheel_cond, &shard->wheel_mutex);
+            }
+            continue;
+        }
+        for(i = 0; i < count; i++){
+            batch[i] = (thread_alarm *) shard->sweep.items[due[i]];
+            batch[i]->in_flight = 1;
+            removed[i] = batch[i]->removed;
+            version[i] = batch[i]->version;
+            //A removed alarm is freed once displayed, so its slot is noted now
+            removed_slots[i] = due[i];
+        }
+        pthread_mutex_unlock(&shard->wheel_mutex);
+
+        wall = time(NULL);
+        epoch_enter();
+        for(i = 0; i < count; i++)
+            next[i] = display_alarm(batch[i], removed[i], now, wall, lateness);
+        epoch_exit();
+
+        METRIC_LOCK(&shard->wheel_mutex);
+        removals = 0;
+        for(i = 0; i < count; i++){
+            if(next[i] == 0){
+                removed_slots[removals++] = removed_slots[i];
+                continue;
+            }
+            batch[i]->in_flight = 0;
+            if(batch[i]->removed || batch[i]->published > batch[i]->version){
+                shard->sweep.deadlines[batch[i]->slot] = 0;
+            } else if(batch[i]->version != version[i]){
+                //The replacement's interval counts from now
+                shard->sweep.deadlines[batch[i]->slot] = next[i];
+                shard->sweep.periods[batch[i]->slot] = next[i] - now;
+            }
+        }
+        //From the last slot down, so that no removed alarm gets moved
+        qsort(removed_slots, removals, sizeof(size_t), descending);
+        for(i = 0; i < removals; i++){
+            moved = (thread_alarm *) sweep_remove(&shard->sweep, removed_slots[i]);
+            if(moved != NULL)
+                moved->slot = removed_slots[i];
+        }
+    }
+
+}
+
+/*
+ * Adds an alarm to the list of alarms to schedule for display.
+ */
+static void queue_for_display(shard_t * shard, int alarm_number){
+    append_list * to_append;
+
+    to_append = (append_list *) slab_alloc(&append_cache);
+    to_append->next = NULL;
+    to_append->alarm_number = alarm_number;
+    to_append->last = NULL;
+    //If the list is null, make the list reference the element
+    if(shard->list_to_append == NULL) {
+        shard->list_to_append = to_append;
+    } else {
+        //Otherwise, append in the next available
+        if(shard->list_to_append->next == NULL){
+            shard->list_to_append->next = to_append;
+            shard->list_to_append->last = to_append;
+        } else {
+            shard->list_to_append->last->next = to_append;
+            shard->list_to_append->last = to_append;
+        }
+    }
+}
+
+/*
+ * Schedules the alarms appended to the list for display.
+ * It functions as a queue, scheduling alarms in the order which they were added to the list.
+ *
+ */
+static void create_display_alarms(shard_t * shard){
+    //Reference to old element
+    append_list * old;
+    //New thread_alarm
+    thread_alarm * new_thread_alarm;
+    alarm_body_t * body;
+    uint64_t now = engine_now();
+    size_t row;
+    while(shard->list_to_append != NULL){
+
+
+        old = shard->list_to_append;
+        //Rows only move when alarms are deleted, after this
+        row = alarm_table_find(&shard->table, old->alarm_number);
+        //Initialize the new alarm's display data
+        new_thread_alarm = (thread_alarm *) slab_alloc(&thread_alarm_cache);
+        body = (alarm_body_t *) slab_alloc(&body_cache);
+        body->interval = shard->table.intervals[row];
+        body->unit = shard->table.units[row];
+        body->period = shard->table.periods[row];
+        body->version = 0;
+        body->owner = shard->table.owners[row];
+        body->message = message_hold(&shard->table.arena, shard->table.messages[row]);
+        atomic_init(&new_thread_alarm->body, body);
+        new_thread_alarm->removed = 0;
+        new_thread_alarm->published = 0;
+        new_thread_alarm->in_flight = 0;
+        //Replaced before its first display, which then reports the replacement
+        new_thread_alarm->version = shard->table.flags[row] & ALARM_CHANGED ? -1 : 0;
+        new_thread_alarm->has_changed = 0;
+        new_thread_alarm->alarm_num = old->alarm_number;
+        new_thread_alarm->interval = body->interval;
+        new_thread_alarm->unit = body->unit;
+        new_thread_alarm->deadline = now;
+        new_thread_alarm->owner = body->owner;
+        new_thread_alarm->shard = shard;
+        new_thread_alarm->message = message_share(body->message);
+        new_thread_alarm->entry.state = WHEEL_IDLE;
+        shard->table.displays[row] = new_thread_alarm;
+
+        shard->list_to_append = shard->list_to_append->next;
+        //First display is right away, as it was when each alarm had its own thread
+        METRIC_LOCK(&shard->wheel_mutex);
+        if(sweep_mode)
+            new_thread_alarm->slot = sweep_add(&shard->sweep, new_thread_alarm, now,
+                                               body->period != 0 ? body->period : NSEC_PER_SEC);
+        else
+            wheel_add(&shard->wheel, &new_thread_alarm->entry, WHEEL_TICK(now));
+        pthread_cond_signal(&shard->wheel_cond);
+        pthread_mutex_unlock(&shard->wheel_mutex);
+        slab_free(&append_cache, old);
+    }
+
+}
+
+/*
+ * Reports the metrics, on one line of key=value pairs, to `client`. Rates
+ * are per second since the previous report of the same series. `live`,
+ * `scheduled` and `memory` are added up over the shards by the caller.
+ * Without ALARM_METRICS, only the figures kept anyway are reported.
+ */
+static void report_stats(int series, uint32_t client, time_t received, size_t live,
+                         size_t scheduled, size_t memory){
+    static pthread_mutex_t report_mutex = PTHREAD_MUTEX_INITIALIZER;
+    slab_cache_t *caches[] = { &alarm_cache, &append_cache, &thread_alarm_cache, &body_cache };
+    slab_stats_t slab;
+#ifdef ALARM_METRICS
+    static uint64_t previous_at[ALARM_STATS_SERIES];
+    static uint64_t previous[ALARM_STATS_SERIES][METRIC_COUNTERS];
+    static const char *names[METRIC_COUNTERS] = {
+        "inserts", "replacements", "cancels", "errors", "displays", "lock_waits", "rejects"
+    };
+    histogram_t histograms[METRIC_HISTOGRAMS];
+    uint64_t counters[METRIC_COUNTERS], now = engine_now();
+    double elapsed;
+#endif
+    alarm_event_t event = {0};
+    histogram_t lateness;
+    size_t depth = 0;
+    char line[2048];
+    int length, i, j;
+
+#ifdef ALARM_METRICS
+    for(i = 0; i < METRIC_HISTOGRAMS; i++)
+        histogram_init(&histograms[i]);
+    metrics_collect(counters, histograms);
+#endif
+    histogram_init(&lateness);
+    for(i = 0; i < shard_count; i++){
+        for(j = 0; j < shards[i].workers; j++)
+            histogram_merge(&lateness, &shards[i].jitter[j]);
+        depth += cmd_queue_depth(&shards[i].queue);
+    }
+
+    //The last shard to get to a Stats request reports it, whichever that is
+    pthread_mutex_lock(&report_mutex);
+    length = snprintf(line, sizeof(line), "time=%d", (int) engine_wall());
+#ifdef ALARM_METRICS
+    if(previous_at[series] == 0)
+        previous_at[series] = start_time;
+    elapsed = (double) (now - previous_at[series]) / NSEC_PER_SEC;
+    previous_at[series] = now;
+    for(i = 0; i < METRIC_COUNTERS; i++){
+        length += snprintf(line + length, sizeof(line) - length, " %s=%llu %s_per_s=%.1f",
+                           names[i], (unsigned long long) counters[i], names[i],
+                           elapsed > 0 ? (double) (counters[i] - previous[series][i]) / elapsed : 0.0);
+        previous[series][i] = counters[i];
+    }
+#endif
+    length += snprintf(line + length, sizeof(line) - length,
+                       " live_alarms=%zu scheduled=%zu memory_bytes=%zu queue_depth=%zu",
+                       live, scheduled, memory, depth);
+#ifdef ALARM_METRICS
+    length += snprintf(line + length, sizeof(line) - length,
+                       " lock_wait_p50_us=%.1f lock_wait_p99_us=%.1f"
+                       " enqueue_wait_p50_us=%.1f enqueue_wait_p99_us=%.1f",
+                       histogram_percentile(&histograms[METRIC_LOCK_WAIT], 50) / 1000.0,
+                       histogram_percentile(&histograms[METRIC_LOCK_WAIT], 99) / 1000.0,
+                       histogram_percentile(&histograms[METRIC_ENQUEUE_WAIT], 50) / 1000.0,
+                       histogram_percentile(&histograms[METRIC_ENQUEUE_WAIT], 99) / 1000.0);
+#endif
+    length += snprintf(line + length, sizeof(line) - length,
+                       " lateness_p50_us=%.1f lateness_p99_us=%.1f lateness_max_us=%.1f",
+                       histogram_percentile(&lateness, 50) / 1000.0,
+                       histogram_percentile(&lateness, 99) / 1000.0,
+                       atomic_load(&lateness.max) / 1000.0);
+    //Objects in use, kept for reuse, and the most ever in use, per slab cache
+    for(i = 0; i < (int) (sizeof(caches) / sizeof(caches[0])); i++){
+        slab_get_stats(caches[i], &slab);
+        length += snprintf(line + length, sizeof(line) - length,
+                           " slab_%s_live=%zu slab_%s_free=%zu slab_%s_high_water=%zu",
+                           caches[i]->name, slab.live, caches[i]->name, slab.free,
+                           caches[i]->name, slab.high_water);
+    }
+
+    event.type = ALARM_EVENT_STATS;
+    event.client = client;
+    event.alarm_number = series;
+    event.message = line;
+    event.message_length = strlen(line);
+    event.time = received;
+    callback(&event, callback_context);
+    pthread_mutex_unlock(&report_mutex);
+}
+
+/*
+ * Cancels every alarm numbered from `first` to `last` in one pass over the
+ * table, and returns how many there were. Their display data goes away
+ * without a line each, and the display workers are woken once for the lot.
+ * Unless `owner` is ANY_OWNER, only that client's alarms are cancelled.
+ */
+static size_t cancel_range(shard_t * shard, int first, int last, uint32_t owner){
+    thread_alarm * display;
+    size_t row, cancelled = 0;
+
+    METRIC_LOCK(&shard->wheel_mutex);
+    //From the last row down, so the rows moved into gaps were looked at already
+    for(row = shard->table.count; row-- > 0; ){
+        if(shard->table.numbers[row] < first || shard->table.numbers[row] > last
+           || (owner != ANY_OWNER && shard->table.owners[row] != owner))
+            continue;
+        if(state_directory != NULL)
+            journal_append(JOURNAL_CANCEL, shard->table.numbers[row], 0, 0, NULL, 0);
+        list_touch(shard, row, 1);
+        list_touch(shard, shard->table.count - 1, 1);
+        display = (thread_alarm *) shard->table.displays[row];
+        if(display != NULL){
+            display->removed = DISPLAY_REMOVED_QUIETLY;
+            make_due(display);
+        }
+        alarm_table_remove(&shard->table, row);
+        cancelled++;
+    }
+    if(cancelled > 0)
+        pthread_cond_broadcast(&shard->wheel_cond);
+    pthread_mutex_unlock(&shard->wheel_mutex);
+    return cancelled;
+}
+
+/*
+ * Gives every alarm numbered from `first` to `last` a new interval, keeping
+ * its message, in one pass over the table. Returns how many there were.
+ */
+static size_t replace_interval_range(shard_t * shard, int first, int last, int interval, int unit){
+    thread_alarm * display;
+    size_t row, replaced = 0;
+
+    METRIC_LOCK(&shard->wheel_mutex);
+    for(row = 0; row < shard->table.count; row++){
+        if(shard->table.numbers[row] < first || shard->table.numbers[row] > last)
+            continue;
+        list_touch(shard, row, 1);
+        shard->table.intervals[row] = interval;
+        shard->table.units[row] = (uint8_t) unit;
+        shard->table.periods[row] = parse_interval_ns(interval, unit);
+        //Published right here, along with any earlier replacement
+        shard->table.flags[row] = (uint8_t) ((shard->table.flags[row] | ALARM_CHANGED)
+                                             & ~ALARM_UNPUBLISHED);
+        if(state_directory != NULL)
+            journal_append(JOURNAL_REPLACE, shard->table.numbers[row], interval, unit,
+                           alarm_table_message(&shard->table, row),
+                           message_length(&shard->table.arena, shard->table.messages[row]));
+        display = publish_body(shard, row);
+        if(display != NULL){
+            display->published = atomic_load_explicit(&display->body,
+                                                      memory_order_relaxed)->version;
+            make_due(display);
+        }
+        replaced++;
+    }
+    if(replaced > 0)
+        pthread_cond_broadcast(&shard->wheel_cond);
+    pthread_mutex_unlock(&shard->wheel_mutex);
+    return replaced;
+}
+
+/*
+ * Counts the alarms numbered from `first` to `last`.
+ */
+static size_t count_range(shard_t * shard, int first, int last){
+    size_t row, count = 0;
+
+    if(first == INT_MIN && last == INT_MAX)
+        return shard->table.count;
+    for(row = 0; row < shard->table.count; row++)
+        count += shard->table.numbers[row] >= first && shard->table.numbers[row] <= last;
+    return count;
+}
+
+/*
+ * When an alarm is next displayed, on the engine's monotonic clock. An
+ * alarm a display worker holds is displayed now, and then an interval
+ * later. The caller holds wheel_mutex.
+ */
+static uint64_t next_display(shard_t * shard, size_t row, uint64_t now){
+    thread_alarm * display = (thread_alarm *) shard->table.displays[row];
+    uint64_t period = shard->table.periods[row] != 0 ? shard->table.periods[row] : NSEC_PER_SEC;
+    uint64_t deadline;
+
+    if(display == NULL || display->removed)
+        return now;
+    if(sweep_mode)
+        deadline = shard->sweep.deadlines[display->slot];
+    else if(display->in_flight)
+        deadline = now + period;
+    else if(display->published > display->version)
+        deadline = now;
+    else
+        deadline = display->deadline;
+    return deadline > now ? deadline : now;
+}
+
+/*
+ * Copies a row into the part of the list the shard is copying, if the
+ * alarm is in the list's range, and marks the row copied. The caller holds
+ * wheel_mutex.
+ */
+static void list_copy_row(shard_t * shard, size_t row, uint64_t now, uint64_t wall){
+    alarm_list_t * list = atomic_load_explicit(&shard->copying, memory_order_relaxed);
+    alarm_table_t * table = &shard->table;
+    alarm_entry_t * entry;
+    int i = shard->index;
+
+    table->flags[row] = (uint8_t) ((table->flags[row] & ~ALARM_LISTED) | shard->list_mark);
+    if(table->numbers[row] < list->first || table->numbers[row] > list->last)
+        return;
+    if(list->counts[i] == list->capacities[i]){
+        list->capacities[i] = list->capacities[i] > 0 ? list->capacities[i] * 2 : LIST_CHUNK;
+        list->parts[i] = (alarm_entry_t *) realloc(list->parts[i],
+                                                   list->capacities[i] * sizeof(alarm_entry_t));
+        if(list->parts[i] == NULL)
+            errno_abort("Grow list part");
+    }
+    entry = &list->parts[i][list->counts[i]++];
+    entry->alarm_number = table->numbers[row];
+    entry->interval = table->intervals[row];
+    entry->unit = table->units[row];
+    entry->state = table->flags[row] & ALARM_CANCELLING ? ALARM_ENTRY_CANCELLING
+                   : table->flags[row] & ALARM_UNPUBLISHED ? ALARM_ENTRY_REPLACING
+                   : table->flags[row] & ALARM_CHANGED ? ALARM_ENTRY_REPLACED
+                   : ALARM_ENTRY_SET;
+    entry->next = wall + (next_display(shard, row, now) - now);
+}
+
+/*
+ * Copies a row the alarm thread is about to change or move into the list
+ * being copied, unless it was copied already. The caller holds wheel_mutex
+ * if `locked`.
+ */
+static void list_touch(shard_t * shard, size_t row, int locked){
+    if(atomic_load_explicit(&shard->copying, memory_order_relaxed) == NULL
+       || (shard->table.flags[row] & ALARM_LISTED) == shard->list_mark)
+        return;
+    if(!locked)
+        METRIC_LOCK(&shard->wheel_mutex);
+    list_copy_row(shard, row, engine_now(), engine_wall_ns());
+    if(!locked)
+        pthread_mutex_unlock(&shard->wheel_mutex);
+}
+
+/*
+ * Copies the next LIST_CHUNK rows not copied yet into the list being
+ * copied, and is done with the list once past the last row. The caller
+ * holds copy_mutex.
+ */
+static void list_copy(shard_t * shard){
+    uint64_t now = engine_now(), wall = engine_wall_ns();
+    size_t row, end = shard->table.count;
+
+    if(shard->copy_cursor < end && end - shard->copy_cursor > LIST_CHUNK)
+        end = shard->copy_cursor + LIST_CHUNK;
+    METRIC_LOCK(&shard->wheel_mutex);
+    for(row = shard->copy_cursor; row < end; row++)
+        if((shard->table.flags[row] & ALARM_LISTED) != shard->list_mark)
+            list_copy_row(shard, row, now, wall);
+    pthread_mutex_unlock(&shard->wheel_mutex);
+    shard->copy_cursor = end;
+    if(end >= shard->table.count)
+        atomic_store(&shard->copying, NULL);
+}
+
+/*
+ * Starts the shard's part of a list, as its alarms are now, without
+ * copying any: flipping `list_mark` marks every row as not copied yet.
+ * The list thread then copies the rows a chunk at a time, and the alarm
+ * thread any row before it changes it, so the part comes out as if it was
+ * copied here. A part still being copied when the next list comes is
+ * finished here first. The caller holds copy_mutex.
+ */
+static void list_start(shard_t * shard, alarm_list_t * list){
+    while(atomic_load(&shard->copying) != NULL)
+        list_copy(shard);
+    shard->list_mark ^= ALARM_LISTED;
+    shard->copy_cursor = 0;
+    if(shard->table.count > 0)
+        atomic_store(&shard->copying, list);
+}
+
+/*
+ * Finishes copying every shard's part of a list. Each chunk takes turns
+ * with the shard's alarm thread, which copies what it gets to first.
+ */
+static void list_collect(alarm_list_t * list){
+    shard_t * shard;
+    int i, copying;
+
+    for(i = 0; i < shard_count; i++){
+        shard = &shards[i];
+        do {
+            //With the virtual clock, the caller has every shard to itself
+            if(!virtual_clock){
+                atomic_store(&shard->list_wants, 1);
+                pthread_mutex_lock(&shard->copy_mutex);
+                atomic_store(&shard->list_wants, 0);
+            }
+            copying = atomic_load(&shard->copying) == list;
+            if(copying)
+                list_copy(shard);
+            if(!virtual_clock)
+                pthread_mutex_unlock(&shard->copy_mutex);
+        } while(copying);
+    }
+}
+
+static int by_number(const void *a, const void *b){
+    int x = ((const alarm_entry_t *) a)->alarm_number, y = ((const alarm_entry_t *) b)->alarm_number;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * Replies to a list, with how many alarms it has, then hands it to the
+ * callback in alarm number order, ALARM_LIST_PAGE entries at a time. Each
+ * shard's part is sorted, and the parts merged as the pages are filled.
+ * Frees the list.
+ */
+static void list_emit(alarm_list_t * list){
+    alarm_entry_t page[ALARM_LIST_PAGE];
+    size_t next[ALARM_MAX_SHARDS] = {0};
+    alarm_event_t event = {0};
+    int i, lowest;
+
+    event.type = ALARM_EVENT_LIST;
+    event.client = list->client;
+    event.alarm_number = list->first;
+    event.last_number = list->last;
+    event.time = list->received;
+    for(i = 0; i < shard_count; i++){
+        qsort(list->parts[i], list->counts[i], sizeof(alarm_entry_t), by_number);
+        event.count += list->counts[i];
+    }
+    callback(&event, callback_context);
+
+    event.type = ALARM_EVENT_LIST_PAGE;
+    event.count = 0;
+    event.entries = page;
+    while(1){
+        lowest = -1;
+        for(i = 0; i < shard_count; i++)
+            if(next[i] < list->counts[i]
+               && (lowest < 0 || list->parts[i][next[i]].alarm_number
+                                 < list->parts[lowest][next[lowest]].alarm_number))
+                lowest = i;
+        if(lowest >= 0)
+            page[event.count++] = list->parts[lowest][next[lowest]++];
+        if(event.count == ALARM_LIST_PAGE || (lowest < 0 && event.count > 0)){
+            callback(&event, callback_context);
+            event.count = 0;
+        }
+        if(lowest < 0)
+            break;
+    }
+
+    for(i = 0; i < shard_count; i++)
+        free(list->parts[i]);
+    free(list);
+}
+
+/*
+ * The list thread's start routine. Finishes the lists queued for it and
+ * hands them over, one at a time, in the order they were queued.
+ */
+static void * list_thread(void * arg){
+    alarm_list_t * list;
+
+    (void) arg;
+    while(1){
+        pthread_mutex_lock(&list_mutex);
+        while(list_jobs == NULL)
+            pthread_cond_wait(&list_ready, &list_mutex);
+        list = list_jobs;
+        list_jobs = list->next;
+        if(list_jobs == NULL)
+            list_jobs_last = NULL;
+        pthread_mutex_unlock(&list_mutex);
+
+        list_collect(list);
+        list_emit(list);
+
+        pthread_mutex_lock(&list_mutex);
+        if(--listing == 0)
+            pthread_cond_broadcast(&list_cond);
+        pthread_mutex_unlock(&list_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * Queues a list every shard has started its part of for the list thread,
+ * so that the alarm thread gets back to its requests. With the virtual
+ * clock, the list is finished and handed over right away.
+ */
+static void hand_over_list(alarm_list_t * list){
+    if(virtual_clock){
+        list_collect(list);
+        list_emit(list);
+        return;
+    }
+    pthread_mutex_lock(&list_mutex);
+    list->next = NULL;
+    if(list_jobs == NULL)
+        list_jobs = list;
+    else
+        list_jobs_last->next = list;
+    list_jobs_last = list;
+    listing++;
+    pthread_cond_signal(&list_ready);
+    pthread_mutex_unlock(&list_mutex);
+}
+
+/*
+ * Adds a shard's alarms to the snapshot in the making, at the point the
+ * shard got to in its requests. Records appended up to here are in the
+ * snapshot, and may go in the old journal; those appended after are held
+ * back until the snapshot is handed to the journal writer, so that they go
+ * in the new one. The last shard to add its alarms hands it over, and wakes
+ * the other shards to commit what they held back.
+ */
+static void snapshot_part(shard_t * shard, fan_out_t * shared){
+    snapshot_part_t parts[ALARM_MAX_SHARDS];
+    alarm_t *wake;
+    size_t row;
+    int i;
+
+    journal_commit();
+    shard->holding = (int) atomic_load(&snapshots_taken) + 1;
+    for(row = 0; row < shard->table.count; row++)
+        journal_snapshot_add(&shard->snapshot, shard->table.numbers[row],
+                             shard->table.intervals[row], shard->table.units[row],
+                             alarm_table_message(&shard->table, row),
+                             message_length(&shard->table.arena, shard->table.messages[row]));
+    if(atomic_fetch_sub(&shared->pending, 1) != 1)
+        return;
+
+    for(i = 0; i < shard_count; i++){
+        parts[i] = shards[i].snapshot;
+        memset(&shards[i].snapshot, 0, sizeof(snapshot_part_t));
+    }
+    journal_snapshot_commit(parts, shard_count);
+    free(shared);
+    atomic_fetch_add(&snapshots_taken, 1);
+    for(i = 0; i < shard_count; i++){
+        if(&shards[i] == shard)
+            continue;
+        wake = (alarm_t *) slab_alloc(&alarm_cache);
+        wake->request_type = TYPE_WAKE;
+        wake->fan_out = NULL;
+        wake->message = NULL;
+        cmd_queue_push(&shards[i].queue, wake);
+    }
+    atomic_store(&snapshotting, 0);
+}
+
+/*
+ * Applies a shard's copy of a request sent to every shard. The last shard
+ * to get to its copy reports the outcome for all of them, on one line.
+ */
+static void process_bulk(shard_t * shard, alarm_t *alarm){
+    fan_out_t * shared = alarm->fan_out;
+    alarm_event_t event = {0};
+    size_t count = 0;
+
+    //Whatever came before the request applies first
+    if(shard->list_to_append != NULL)
+        create_display_alarms(shard);
+    if(shard->cancel_list != NULL)
+        alarm_delete(shard);
+
+    switch(alarm->request_type){
+        case TYPE_CANCEL_RANGE:
+        case TYPE_CANCEL_ALL:
+            count = cancel_range(shard, alarm->alarm_number, alarm->last_number, ANY_OWNER);
+            METRIC_ADD(METRIC_CANCELS, count);
+            break;
+        case TYPE_INTERVAL_RANGE:
+            count = replace_interval_range(shard, alarm->alarm_number, alarm->last_number,
+                                           alarm->interval, alarm->unit);
+            METRIC_ADD(METRIC_REPLACEMENTS, count);
+            break;
+        case TYPE_DISCONNECT:
+            //Nobody is left to see them
+            count = cancel_range(shard, INT_MIN, INT_MAX, alarm->client);
+            METRIC_ADD(METRIC_CANCELS, count);
+            break;
+        case TYPE_STATS:
+            count = shard->table.count;
+            METRIC_LOCK(&shard->wheel_mutex);
+            atomic_fetch_add(&shared->scheduled, sweep_mode ? shard->sweep.count : shard->wheel.count);
+            pthread_mutex_unlock(&shard->wheel_mutex);
+            atomic_fetch_add(&shared->memory, shard_memory(shard));
+            break;
+        case TYPE_LIST:
+            list_start(shard, shared->list);
+            break;
+        case TYPE_COUNT:
+            count = count_range(shard, alarm->alarm_number, alarm->last_number);
+            break;
+        case TYPE_SNAPSHOT:
+            snapshot_part(shard, shared);
+            return;
+    }
+    atomic_fetch_add(&shared->count, count);
+    if(atomic_fetch_sub(&shared->pending, 1) != 1)
+        return;
+
+    count = atomic_load(&shared->count);
+    if(alarm->request_type == TYPE_STATS){
+        report_stats(alarm->alarm_number, alarm->client, alarm->received, count,
+                     atomic_load(&shared->scheduled), atomic_load(&shared->memory));
+    } else if(alarm->request_type == TYPE_LIST){
+        hand_over_list(shared->list);
+    } else {
+        event.type = alarm->request_type == TYPE_CANCEL_RANGE ? ALARM_EVENT_CANCEL_RANGE
+                     : alarm->request_type == TYPE_CANCEL_ALL ? ALARM_EVENT_CANCEL_ALL
+                     : alarm->request_type == TYPE_INTERVAL_RANGE ? ALARM_EVENT_INTERVAL_RANGE
+                     : alarm->request_type == TYPE_COUNT ? ALARM_EVENT_COUNT
+                     : ALARM_EVENT_RELEASE;
+        event.client = alarm->client;
+        if(event.type == ALARM_EVENT_CANCEL_RANGE || event.type == ALARM_EVENT_INTERVAL_RANGE
+           || event.type == ALARM_EVENT_COUNT){
+            event.alarm_number = alarm->alarm_number;
+            event.last_number = alarm->last_number;
+        }
+        if(event.type == ALARM_EVENT_INTERVAL_RANGE){
+            event.interval = alarm->interval;
+            event.unit = alarm->unit;
+        }
+        event.count = count;
+        event.time = alarm->received;
+        callback(&event, callback_context);
+    }
+    free(shared);
+}
+
+/*
+ * Applies a request to the alarm store and reports the outcome, the
+ * way main used to when it inserted requests itself.
+ */
+static void process_request(shard_t * shard, alarm_t *alarm){
+    alarm_event_t event = {0};
+
+    if(alarm->fan_out != NULL){
+        process_bulk(shard, alarm);
+        request_free(alarm);
+        return;
+    }
+    //Only there to get the alarm thread to commit held back records
+    if(alarm->request_type == TYPE_WAKE){
+        request_free(alarm);
+        return;
+    }
+
+    event.client = alarm->client;
+    event.alarm_number = alarm->alarm_number;
+    event.time = alarm->received;
+    //Check the return type of the function. Cancels still queued are not freed.
+    switch (alarm_insert(shard, alarm)) {
+        case FIRST_ALARM:
+            METRIC_ADD(METRIC_INSERTS, 1);
+            event.type = ALARM_EVENT_SET;
+            if(state_directory != NULL)
+                journal_append(JOURNAL_SET, alarm->alarm_number, alarm->interval, alarm->unit,
+                               alarm->message, alarm->message_length);
+            //Add the element to the append list
+            queue_for_display(shard, alarm->alarm_number);
+            break;
+        case REPLACEMENT:
+            METRIC_ADD(METRIC_REPLACEMENTS, 1);
+            event.type = ALARM_EVENT_REPLACE;
+            if(state_directory != NULL)
+                journal_append(JOURNAL_REPLACE, alarm->alarm_number, alarm->interval, alarm->unit,
+                               alarm->message, alarm->message_length);
+            break;
+        case NO_MATCHING_ALARM:
+            METRIC_ADD(METRIC_ERRORS, 1);
+            event.type = ALARM_EVENT_NO_SUCH_ALARM;
+            callback(&event, callback_context);
+            return;
+        case MULTIPLE_CANCEL:
+            METRIC_ADD(METRIC_ERRORS, 1);
+            event.type = ALARM_EVENT_ALREADY_CANCELLING;
+            callback(&event, callback_context);
+            return;
+        case TOO_MANY_ALARMS:
+            METRIC_ADD(METRIC_REJECTS, 1);
+            event.type = ALARM_EVENT_TOO_MANY_ALARMS;
+            break;
+        case OUT_OF_MEMORY:
+            METRIC_ADD(METRIC_REJECTS, 1);
+            event.type = ALARM_EVENT_OUT_OF_MEMORY;
+            break;
+        case CANCEL_REQ:
+            METRIC_ADD(METRIC_CANCELS, 1);
+            event.type = ALARM_EVENT_CANCEL;
+            callback(&event, callback_context);
+            return;
+        default:
+            err_abort(1, "Alarm added an incorrect type");
+            break;
+    }
+    if(event.type == ALARM_EVENT_SET || event.type == ALARM_EVENT_REPLACE){
+        event.interval = alarm->interval;
+        event.unit = alarm->unit;
+        event.message = alarm->message;
+        event.message_length = alarm->message_length;
+    }
+    callback(&event, callback_context);
+    request_free(alarm);
+}
+
+/*
+ * Rebuilds the alarm tables from the state directory. Called for every
+ * snapshot entry and journal record, before any other thread starts.
+ */
+static void restore_alarm(int type, int alarm_number, int interval, int unit,
+                   const char *message, size_t length){
+    shard_t * shard = shard_of(alarm_number);
+    size_t row = alarm_table_find(&shard->table, alarm_number);
+
+    if(type == JOURNAL_CANCEL){
+        if(row != ALARM_NONE)
+            alarm_table_remove(&shard->table, row);
+        return;
+    }
+    if(row == ALARM_NONE)
+        row = alarm_table_add(&shard->table, alarm_number);
+    shard->table.intervals[row] = interval;
+    shard->table.units[row] = (uint8_t) unit;
+    shard->table.periods[row] = parse_interval_ns(interval, unit);
+    alarm_table_set_message(&shard->table, row, message, length);
+}
+
+/*
+ * Loads the alarms kept in the state directory, and schedules them.
+ */
+static void recover_state(){
+    size_t row, applied, recovered = 0;
+    uint64_t start = mono_now();
+    shard_t * shard;
+    int i;
+
+    applied = journal_open(state_directory, restore_alarm);
+    for(i = 0; i < shard_count; i++){
+        shard = &shards[i];
+        for(row = 0; row < shard->table.count; row++)
+            queue_for_display(shard, shard->table.numbers[row]);
+        create_display_alarms(shard);
+        recovered += shard->table.count;
+    }
+    if(applied > 0)
+        fprintf(stderr, "Recovered %zu alarms from %zu records in %.1f ms\n",
+                recovered, applied, (mono_now() - start) / 1e6);
+}
+
+/*
+ * Applies a batch of requests taken off a shard's queue, and whatever
+ * follows from them. An empty batch publishes the replacements whose
+ * window is over.
+ */
+static void apply_batch(shard_t * shard, void ** batch, size_t count){
+    alarm_t *request;
+    size_t i;
+
+    //A list being copied gets its turn between batches, see list_collect()
+    while(atomic_load(&shard->list_wants))
+        sched_yield();
+    pthread_mutex_lock(&shard->copy_mutex);
+    for(i = 0; i < count; i++)
+        process_request(shard, (alarm_t *) batch[i]);
+
+    //Schedule the new alarms for display
+    if(shard->list_to_append != NULL)
+        create_display_alarms(shard);
+
+    if(shard->cancel_list != NULL)
+        alarm_delete(shard);
+
+    if(shard->replaced_count > 0
+       && (coalesce_window == 0 || engine_now() >= shard->replaced_since + coalesce_window))
+        publish_replacements(shard);
+
+    //Hand the batch's records to the journal writer, one group at a time,
+    //unless they have to wait for a snapshot in the making
+    if(state_directory != NULL){
+        if(shard->holding != 0 && (int) atomic_load(&snapshots_taken) >= shard->holding)
+            shard->holding = 0;
+        if(shard->holding == 0)
+            journal_commit();
+        if(journal_records() >= snapshot_every && atomic_exchange(&snapshotting, 1) == 0){
+            request = (alarm_t *) slab_alloc(&alarm_cache);
+            request->request_type = TYPE_SNAPSHOT;
+            request->message = NULL;
+            fan_out(request, shard);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->copy_mutex);
+
+    //Free the bodies replaced in earlier batches
+    epoch_reclaim();
+    cmd_queue_complete(&shard->queue, count);
+}
+
+/*
+ * The alarm thread's start routine. `arg` is the thread's shard.
+ */
+static void *alarm_thread (void *arg) {
+    shard_t * shard = (shard_t *) arg;
+    void *batch[CMD_BATCH];
+    size_t count;
+
+    pin_to_shard(shard);
+    /*
+     * Loop forever, processing commands. The alarm thread will
+     * be disintegrated when the process exits.
+     * The thread blocks on the command queue until there are tasks for it,
+     * then applies everything queued so far.
+     *
+     */
+    while (1) {
+
+        //Wake up to publish replacements once their window is over
+        if(shard->replaced_count > 0)
+            count = cmd_queue_pop_batch_until(&shard->queue, batch, CMD_BATCH,
+                                              shard->replaced_since + coalesce_window);
+        else
+            count = cmd_queue_pop_batch(&shard->queue, batch, CMD_BATCH);
+        apply_batch(shard, batch, count);
+    }
+}
+
+/*
+ * With the virtual clock, applies everything queued for every shard, at
+ * the current time, on the calling thread. Snapshots queue more requests
+ * for the other shards, so it goes round until every queue is empty.
+ */
+static void apply_queued(void){
+    void *batch[CMD_BATCH];
+    size_t count;
+    int i, applied;
+
+    do {
+        applied = 0;
+        for(i = 0; i < shard_count; i++){
+            while(cmd_queue_depth(&shards[i].queue) > 0){
+                count = cmd_queue_pop_batch(&shards[i].queue, batch, CMD_BATCH);
+                apply_batch(&shards[i], batch, count);
+                applied = 1;
+            }
+        }
+    } while(applied);
+}
+
+/*
+ * With the virtual clock, displays every alarm of a shard due by now, as
+ * the display workers would.
+ */
+static void fire_due(shard_t * shard){
+    thread_alarm * batch[DISPLAY_BATCH];
+    int removed[DISPLAY_BATCH];
+    uint64_t next[DISPLAY_BATCH];
+    time_t wall = engine_wall();
+    int count, i;
+
+    METRIC_LOCK(&shard->wheel_mutex);
+    wheel_advance(&shard->wheel, virtual_now / WHEEL_TICK_NS);
+    while((count = take_due(shard, batch, removed)) > 0){
+        epoch_enter();
+        for(i = 0; i < count; i++)
+            next[i] = display_alarm(batch[i], removed[i], virtual_now, wall, &shard->jitter[0]);
+        epoch_exit();
+        rearm(shard, batch, next, count);
+    }
+    pthread_mutex_unlock(&shard->wheel_mutex);
+}
+
+/*
+ * Requests a thread has collected for each shard, but not posted yet.
+ * Each thread gets its own on its first request, with a row per shard,
+ * and whatever is left in them is posted when the thread exits.
+ */
+typedef struct pending {
+    size_t      count[ALARM_MAX_SHARDS];
+    void *      requests[][CMD_BATCH];
+} pending_t;
+
+static __thread pending_t *pending = NULL;
+static pthread_key_t pending_key;
+
+/*
+ * Posts the requests collected for each shard.
+ */
+static void post_pending(pending_t * batches){
+    int i;
+
+    for(i = 0; i < shard_count; i++){
+        if(batches->count[i] == 0)
+            continue;
+        METRIC_TIMED(METRIC_ENQUEUE_WAIT,
+                     cmd_queue_push_batch(&shards[i].queue, batches->requests[i], batches->count[i]));
+        batches->count[i] = 0;
+    }
+}
+
+static void pending_exit(void * batches){
+    post_pending((pending_t *) batches);
+    free(batches);
+}
+
+/*
+ * Hands a request to the shard owning its alarm, in batches, or a copy of
+ * it to every shard if it is not about one alarm. With the virtual clock,
+ * whatever gets posted is applied right away, so the queues never fill up
+ * with nobody to empty them.
+ */
+static void post(alarm_t * alarm){
+    int i;
+
+    if(alarm->request_type != TYPE_A && alarm->request_type != TYPE_B){
+        //Whatever was collected before goes first
+        if(pending != NULL)
+            post_pending(pending);
+        fan_out(alarm, NULL);
+        if(virtual_clock)
+            apply_queued();
+        return;
+    }
+    if(pending == NULL){
+        pending = (pending_t *) calloc(1, sizeof(pending_t) + shard_count * sizeof(pending->requests[0]));
+        if(pending == NULL)
+            errno_abort("Allocate pending requests");
+        pthread_setspecific(pending_key, pending);
+    }
+    i = shard_of(alarm->alarm_number)->index;
+    pending->requests[i][pending->count[i]++] = alarm;
+    if(pending->count[i] == CMD_BATCH){
+        METRIC_TIMED(METRIC_ENQUEUE_WAIT,
+                     cmd_queue_push_batch(&shards[i].queue, pending->requests[i], CMD_BATCH));
+        pending->count[i] = 0;
+        if(virtual_clock)
+            apply_queued();
+    }
+}
+
+static alarm_t * new_request(int type, uint32_t client){
+    alarm_t * alarm = (alarm_t *) slab_alloc(&alarm_cache);
+
+    if(alarm == NULL)
+        errno_abort("Allocate alarm");
+    alarm->request_type = type;
+    alarm->received = engine_wall();
+    alarm->link = NULL;
+    alarm->client = client;
+    alarm->fan_out = NULL;
+    alarm->message = NULL;
+    return alarm;
+}
+
+/*
+ * Sets alarm `alarm_number`, or replaces it if there is one, to fire
+ * every `interval` with `message`, which is copied.
+ */
+void alarm_engine_set(uint32_t client, int alarm_number, int interval, int unit,
+                      const char *message, size_t length){
+    alarm_t * alarm = new_request(TYPE_A, client);
+
+    alarm->alarm_number = alarm_number;
+    alarm->interval = interval;
+    alarm->unit = unit;
+    alarm->message = alarm->inline_message;
+    if(length >= REQUEST_INLINE_MESSAGE){
+        alarm->message = (char *) malloc(length + 1);
+        if(alarm->message == NULL)
+            errno_abort("Allocate message");
+    }
+    //An empty message may come with no text at all
+    if(length > 0)
+        memcpy(alarm->message, message, length);
+    alarm->message[length] = '\0';
+    alarm->message_length = length;
+    post(alarm);
+}
+
+void alarm_engine_cancel(uint32_t client, int alarm_number){
+    alarm_t * alarm = new_request(TYPE_B, client);
+
+    alarm->alarm_number = alarm_number;
+    post(alarm);
+}
+
+/*
+ * Cancels the alarms numbered from `first` to `last`, both included.
+ */
+void alarm_engine_cancel_range(uint32_t client, int first, int last){
+    alarm_t * alarm = new_request(TYPE_CANCEL_RANGE, client);
+
+    alarm->alarm_number = first;
+    alarm->last_number = last;
+    post(alarm);
+}
+
+void alarm_engine_cancel_all(uint32_t client){
+    alarm_t * alarm = new_request(TYPE_CANCEL_ALL, client);
+
+    alarm->alarm_number = INT_MIN;
+    alarm->last_number = INT_MAX;
+    post(alarm);
+}
+
+/*
+ * Gives the alarms numbered from `first` to `last` a new interval, keeping
+ * their messages.
+ */
+void alarm_engine_interval_range(uint32_t client, int first, int last, int interval, int unit){
+    alarm_t * alarm = new_request(TYPE_INTERVAL_RANGE, client);
+
+    alarm->alarm_number = first;
+    alarm->last_number = last;
+    alarm->interval = interval;
+    alarm->unit = unit;
+    post(alarm);
+}
+
+/*
+ * Asks for a report of the engine's metrics. Each of the
+ * ALARM_STATS_SERIES series has its rates counted since its own last
+ * report, so that reports made for different readers do not disturb
+ * each other.
+ */
+void alarm_engine_stats(uint32_t client, int series){
+    alarm_t * alarm = new_request(TYPE_STATS, client);
+
+    alarm->alarm_number = series >= 0 && series < ALARM_STATS_SERIES ? series : 0;
+    post(alarm);
+}
+
+/*
+ * Cancels every alarm set last by `client`, without a CANCELLED event
+ * each, and replies with a RELEASE event once they are gone. Nothing is
+ * reported to the client after that.
+ */
+void alarm_engine_release(uint32_t client){
+    post(new_request(TYPE_DISCONNECT, client));
+}
+
+/*
+ * Lists the alarms numbered from `first` to `last`, both included, with a
+ * LIST event and then LIST_PAGE events.
+ */
+void alarm_engine_list(uint32_t client, int first, int last){
+    alarm_t * alarm = new_request(TYPE_LIST, client);
+
+    alarm->alarm_number = first;
+    alarm->last_number = last;
+    post(alarm);
+}
+
+/*
+ * Counts the alarms numbered from `first` to `last`, both included.
+ */
+void alarm_engine_count(uint32_t client, int first, int last){
+    alarm_t * alarm = new_request(TYPE_COUNT, client);
+
+    alarm->alarm_number = first;
+    alarm->last_number = last;
+    post(alarm);
+}
+
+/*
+ * Posts the requests the calling thread has collected.
+ */
+void alarm_engine_flush(void){
+    if(pending != NULL)
+        post_pending(pending);
+    if(virtual_clock)
+        apply_queued();
+}
+
+/*
+ * Moves the virtual clock forward to `until`, in nanoseconds since the
+ * epoch, displaying every alarm due by then and publishing replacements
+ * whose window is over, in the order they come due. Whatever was posted
+ * before is applied first, at the time it was posted. The clock never
+ * goes back. Does nothing but flush on the real clock.
+ */
+void alarm_engine_advance(uint64_t until){
+    uint64_t next, expires;
+    int i;
+
+    alarm_engine_flush();
+    if(!virtual_clock)
+        return;
+    while(1){
+        //The earliest tick anything is due on, over every shard
+        next = UINT64_MAX;
+        for(i = 0; i < shard_count; i++){
+            if(wheel_next_expiry(&shards[i].wheel, &expires) && expires * WHEEL_TICK_NS < next)
+                next = expires * WHEEL_TICK_NS;
+            if(shards[i].replaced_count > 0 && shards[i].replaced_since + coalesce_window < next)
+                next = shards[i].replaced_since + coalesce_window;
+        }
+        if(next > until)
+            break;
+        if(next > virtual_now)
+            virtual_now = next;
+        for(i = 0; i < shard_count; i++){
+            if(shards[i].replaced_count > 0
+               && shards[i].replaced_since + coalesce_window <= virtual_now)
+                apply_batch(&shards[i], NULL, 0);
+            fire_due(&shards[i]);
+        }
+    }
+    if(until > virtual_now)
+        virtual_now = until;
+}
+
+/*
+ * Waits until every request posted so far has been applied and replied
+ * to, lists handed over in full, and its records have reached the disk. Displays go on meanwhile.
+ */
+void alarm_engine_drain(void){
+    size_t taken;
+    int i;
+
+    alarm_engine_flush();
+    //A snapshot finishing meanwhile posts more requests, to wake the shards
+    //holding back records, so drain again until none did
+    do {
+        taken = atomic_load(&snapshots_taken);
+        for(i = 0; i < shard_count; i++)
+            cmd_queue_drain(&shards[i].queue);
+    } while(atomic_load(&snapshotting) || atomic_load(&snapshots_taken) != taken);
+    //Lists are replied to before they are through
+    pthread_mutex_lock(&list_mutex);
+    while(listing > 0)
+        pthread_cond_wait(&list_cond, &list_mutex);
+    pthread_mutex_unlock(&list_mutex);
+    if(state_directory != NULL)
+        journal_flush();
+}
+
+/*
+ * Adds up how late alarms were displayed, over all the display workers.
+ */
+void alarm_engine_jitter(histogram_t *total){
+    int i, j;
+
+    histogram_init(total);
+    for(i = 0; i < shard_count; i++)
+        for(j = 0; j < shards[i].workers; j++)
+            histogram_merge(total, &shards[i].jitter[j]);
+}
+
+void alarm_engine_default_config(alarm_engine_config_t *config){
+    memset(config, 0, sizeof(alarm_engine_config_t));
+    config->workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(config->workers > ALARM_MAX_WORKERS)
+        config->workers = ALARM_MAX_WORKERS;
+    config->shards = 1;
+    config->max_pending = CMD_QUEUE_SIZE;
+    config->snapshot_every = 1000000;
+}
+
+/*
+ * Starts the engine: recovers the alarms kept in the state directory, if
+ * there is one, and starts the alarm threads and display workers. Events
+ * go to `event_callback`, along with `context`, from then on.
+ */
+void alarm_engine_create(const alarm_engine_config_t *config, alarm_callback_t event_callback,
+                         void *context){
+    pthread_condattr_t cond_attr;
+    display_worker_arg_t *worker;
+    size_t queue_size;
+    shard_t *shard;
+    pthread_t thread;
+    int status, workers, i, j;
+
+    if(config->shards < 1 || config->shards > ALARM_MAX_SHARDS)
+        err_abort(EINVAL, "Shard count");
+    if(config->workers > ALARM_MAX_WORKERS)
+        err_abort(EINVAL, "Worker count");
+    callback = event_callback;
+    callback_context = context;
+    shard_count = config->shards;
+    sweep_mode = config->sweep;
+    coalesce_window = config->coalesce_ns;
+    max_alarms = config->max_alarms;
+    max_memory = config->max_memory;
+    state_directory = config->state_directory;
+    virtual_clock = config->virtual_clock;
+    virtual_now = config->virtual_start;
+    if(virtual_clock)
+        sweep_mode = 0;
+    snapshot_every = config->snapshot_every > 0 ? config->snapshot_every : 1;
+    queue_size = config->max_pending > CMD_BATCH ? config->max_pending : CMD_BATCH;
+    //The workers are split among the shards, and a sweeper is a shard's only one
+    workers = config->workers;
+    if(workers < shard_count || sweep_mode)
+        workers = shard_count;
+
+    shards = (shard_t *) aligned_alloc(CACHE_LINE, shard_count * sizeof(shard_t));
+    if(shards == NULL)
+        errno_abort("Allocate shards");
+    memset(shards, 0, shard_count * sizeof(shard_t));
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    for(i = 0; i < shard_count; i++){
+        shard = &shards[i];
+        shard->index = i;
+        pthread_mutex_init(&shard->wheel_mutex, NULL);
+        pthread_cond_init(&shard->wheel_cond, &cond_attr);
+        pthread_mutex_init(&shard->copy_mutex, NULL);
+        wheel_init(&shard->wheel, WHEEL_TICK(engine_now()));
+        sweep_init(&shard->sweep, 1024);
+        alarm_table_init(&shard->table, 1024);
+        cmd_queue_init(&shard->queue, queue_size);
+        //Limits are split evenly, rounding up
+        shard->alarm_limit = (max_alarms + shard_count - 1) / shard_count;
+        shard->memory_limit = (max_memory + shard_count - 1) / shard_count;
+        //Shards earlier on get the workers left over
+        shard->workers = workers / shard_count + (i < workers % shard_count);
+        shard->jitter = (histogram_t *) malloc(shard->workers * sizeof(histogram_t));
+        if(shard->jitter == NULL)
+            errno_abort("Allocate jitter histograms");
+        for(j = 0; j < shard->workers; j++)
+            histogram_init(&shard->jitter[j]);
+    }
+    pthread_condattr_destroy(&cond_attr);
+    slab_init(&alarm_cache, "alarm", sizeof(alarm_t));
+    slab_init(&append_cache, "append_list", sizeof(append_list));
+    slab_init(&thread_alarm_cache, "thread_alarm", sizeof(thread_alarm));
+    slab_init(&body_cache, "alarm_body", sizeof(alarm_body_t));
+    status = pthread_key_create(&pending_key, pending_exit);
+    if(status != 0)
+        err_abort(status, "Create pending key");
+    if(state_directory != NULL)
+        recover_state();
+    start_time = engine_now();
+    //Everything runs on the thread advancing the virtual clock
+    if(virtual_clock)
+        return;
+
+    status = pthread_create(&thread, NULL, list_thread, NULL);
+    if(status != 0)
+        err_abort(status, "Create list thread");
+
+    for(i = 0; i < shard_count; i++){
+        shard = &shards[i];
+        //Create the shard's alarm thread
+        status = pthread_create (
+                &thread, NULL, alarm_thread, shard);
+        if (status != 0)
+            err_abort (status, "Create alarm thread");
+
+        //Create the display workers sharing the shard's timing wheel, or the sweeper
+        for(j = 0; j < shard->workers; j++){
+            worker = (display_worker_arg_t *) malloc(sizeof(display_worker_arg_t));
+            if(worker == NULL)
+                errno_abort("Allocate display worker");
+            worker->shard = shard;
+            worker->index = j;
+            status = pthread_create (
+                    &thread, NULL, sweep_mode ? sweep_worker : display_worker, worker);
+            if (status != 0)
+                err_abort (status, "Create display worker");
+        }
+    }
+}
@@ -0,0 +1,198 @@
+#ifndef __alarm_engine_h
+#define __alarm_engine_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "histogram.h"
+#include "parse.h"
+
+/*
+ * The alarm engine, as a library.
+ *
+ * The engine keeps alarms, each named by a number, and fires them every
+ * interval on its own threads. There is one engine per process, started
+ * with alarm_engine_create(). Nothing it does is reported as text: every
+ * outcome is an alarm_event_t handed to the callback given at creation.
+ *
+ * Requests come from any thread, and name a `client`, which is whatever
+ * the caller uses to tell its users apart; the engine only passes it back
+ * in events. UINT32_MAX is reserved. Intervals are counted in `unit`, one
+ * of the PARSE_UNIT_ constants.
+ *
+ * Sets and cancels are collected per calling thread, and posted to the
+ * engine once a batch of them is collected for a shard, or when the
+ * thread calls alarm_engine_flush(). Every other request first posts what
+ * the thread collected, then goes to every shard right away. Requests
+ * posted by one thread are applied in order for each alarm, and the other
+ * requests see everything posted before them. Once --max-pending requests
+ * (`max_pending`) wait for a shard, posting blocks until there is room.
+ *
+ * The callback runs on the engine's threads, and must not block for long,
+ * nor make requests of its own. Replies to requests come from the alarm
+ * thread of the shard owning the alarm, or, for requests that go to every
+ * shard, from the last shard to get to its copy. Fired, replaced and
+ * cancelled alarms come from the display workers. Replies and displays of
+ * one shard come in the order they happen. `message` and `entries` are
+ * only valid during the call. See the ALARM_EVENT_ constants for which fields each event
+ * fills in; the others are 0.
+ *
+ * With `virtual_clock` set, the engine runs on a clock of its own instead,
+ * starting at `virtual_start`, in nanoseconds since the epoch, and starts
+ * no threads. Requests are applied as soon as they are posted, and time
+ * only moves when alarm_engine_advance() moves it, which fires every alarm
+ * due on the way, in deadline order, on the calling thread. The events are
+ * those the real engine would deliver if it were never late, as fast as
+ * they can be produced, and the same every run. Only one thread may make
+ * requests then, and the callback runs on that thread. The timing wheel
+ * is used whatever `sweep` says.
+ *
+ * alarm_engine_list() and alarm_engine_count() look at the alarms as they
+ * are at the point each shard gets to the request, like the other
+ * requests going to every shard. Starting a list takes a shard no time,
+ * however many alarms it has: the list thread copies them a few thousand
+ * at a time, taking turns with the shard's alarm thread, which copies an
+ * alarm itself before changing it. The list thread then sorts the list and
+ * hands it to the callback, the LIST reply first and then ALARM_LIST_PAGE
+ * entries at a time, as fast as the callback takes them; replies to later
+ * requests may come before it.
+ */
+#define ALARM_MAX_SHARDS 64
+/*
+ * Display workers, at most. Each thread that reads alarms or prints keeps
+ * an epoch record and an output ring for the life of the process, and
+ * there are only EPOCH_MAX_THREADS and OUTPUT_MAX_RINGS of them: this
+ * leaves room for the alarm threads of ALARM_MAX_SHARDS shards, the list
+ * thread and the program's own threads.
+ */
+#define ALARM_MAX_WORKERS 128
+//Stats reports keeping their own rates, see alarm_engine_stats()
+#define ALARM_STATS_SERIES 2
+//Entries per LIST_PAGE event
+#define ALARM_LIST_PAGE 1024
+
+//Replies to alarm_engine_set(), to the client making the request
+#define ALARM_EVENT_SET 0
+#define ALARM_EVENT_REPLACE 1
+#define ALARM_EVENT_TOO_MANY_ALARMS 2
+#define ALARM_EVENT_OUT_OF_MEMORY 3
+//Replies to alarm_engine_cancel()
+#define ALARM_EVENT_CANCEL 4
+#define ALARM_EVENT_NO_SUCH_ALARM 5
+#define ALARM_EVENT_ALREADY_CANCELLING 6
+//Replies to the requests that go to every shard, with `count` alarms done
+#define ALARM_EVENT_CANCEL_RANGE 7
+#define ALARM_EVENT_CANCEL_ALL 8
+#define ALARM_EVENT_INTERVAL_RANGE 9
+#define ALARM_EVENT_STATS 10
+#define ALARM_EVENT_RELEASE 11
+//Displays, to the client that set the alarm last
+#define ALARM_EVENT_FIRED 12
+#define ALARM_EVENT_REPLACED 13
+#define ALARM_EVENT_CANCELLED 14
+//Replies to alarm_engine_list(): LIST, then LIST_PAGE events until `count`
+//entries are through. Replies to alarm_engine_count()
+#define ALARM_EVENT_LIST 15
+#define ALARM_EVENT_LIST_PAGE 16
+#define ALARM_EVENT_COUNT 17
+
+//What state a listed alarm is in
+#define ALARM_ENTRY_SET 0
+//Replaced since it was set
+#define ALARM_ENTRY_REPLACED 1
+//Replaced, but the display workers have not been told yet, see `coalesce_ns`
+#define ALARM_ENTRY_REPLACING 2
+#define ALARM_ENTRY_CANCELLING 3
+
+/*
+ * An event. `time` is when the request was made, for replies, and when
+ * the alarm was displayed, for displays.
+ *
+ *  - SET, REPLACE:      alarm_number, interval, unit, message
+ *  - TOO_MANY_ALARMS, OUT_OF_MEMORY, NO_SUCH_ALARM, ALREADY_CANCELLING,
+ *    CANCEL:            alarm_number
+ *  - CANCEL_RANGE:      alarm_number to last_number, count
+ *  - CANCEL_ALL:        count
+ *  - INTERVAL_RANGE:    alarm_number to last_number, interval, unit, count
+ *  - STATS:             alarm_number is the series, message the report on
+ *                       one line of key=value pairs
+ *  - RELEASE:           count, the client's alarms cancelled
+ *  - LIST, COUNT:       alarm_number to last_number, count
+ *  - LIST_PAGE:         alarm_number to last_number, and `count` of the
+ *                       entries, in alarm number order
+ *  - FIRED:             alarm_number, interval, unit, message, and
+ *                       `replaced` if it was replaced since it was set
+ *  - REPLACED:          alarm_number and its new interval, unit and message
+ *  - CANCELLED:         alarm_number, and the interval, unit and message
+ *                       it had. Alarms cancelled by the requests going to
+ *                       every shard go without one each.
+ */
+/*
+ * An alarm in a list. `next` is when it is next displayed, in nanoseconds
+ * since the epoch, as of when the alarm was copied; an alarm being
+ * displayed then shows the display after, an interval from then.
+ */
+typedef struct alarm_entry {
+    int             alarm_number;
+    int             interval;
+    int             unit;
+    int             state;
+    uint64_t        next;
+} alarm_entry_t;
+
+typedef struct alarm_event {
+    int             type;
+    uint32_t        client;
+    int             alarm_number;
+    int             last_number;
+    int             interval;
+    int             unit;
+    int             replaced;
+    const char *    message;
+    size_t          message_length;
+    size_t          count;
+    time_t          time;
+    const alarm_entry_t * entries;
+} alarm_event_t;
+
+typedef void (*alarm_callback_t)(const alarm_event_t *event, void *context);
+
+/*
+ * How the engine is set up, see the matching options in the README.
+ * alarm_engine_default_config() fills in the defaults: one display worker
+ * per core, a single shard, the timing wheel, no coalescing, no limits,
+ * no state directory, the real clock.
+ */
+typedef struct alarm_engine_config {
+    int             workers;
+    int             shards;
+    int             sweep;
+    uint64_t        coalesce_ns;
+    size_t          max_alarms;
+    size_t          max_memory;
+    size_t          max_pending;
+    const char *    state_directory;
+    size_t          snapshot_every;
+    int             virtual_clock;
+    uint64_t        virtual_start;
+} alarm_engine_config_t;
+
+void alarm_engine_default_config(alarm_engine_config_t *config);
+void alarm_engine_create(const alarm_engine_config_t *config, alarm_callback_t callback,
+                         void *context);
+void alarm_engine_set(uint32_t client, int alarm_number, int interval, int unit,
+                      const char *message, size_t length);
+void alarm_engine_cancel(uint32_t client, int alarm_number);
+void alarm_engine_cancel_range(uint32_t client, int first, int last);
+void alarm_engine_cancel_all(uint32_t client);
+void alarm_engine_interval_range(uint32_t client, int first, int last, int interval, int unit);
+void alarm_engine_stats(uint32_t client, int series);
+void alarm_engine_release(uint32_t client);
+void alarm_engine_list(uint32_t client, int first, int last);
+void alarm_engine_count(uint32_t client, int first, int last);
+void alarm_engine_flush(void);
+void alarm_engine_drain(void);
+void alarm_engine_advance(uint64_t until);
+void alarm_engine_jitter(histogram_t *total);
+
+#endif
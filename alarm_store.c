@@ -0,0 +1,118 @@
+/*
+ * alarm_store.c
+ *
+ * Hash index of live alarms. See alarm_store.h for an overview.
+ */
+#include "alarm_store.h"
+#include "errors.h"
+
+/*
+ * Fibonacci hashing, spreads consecutive alarm numbers over the table. The
+ * slot is the top bits of the product, which every bit of the key goes
+ * into; the low bits only see the key's low bits, so numbers a large power
+ * of two apart would all land on the same slot.
+ */
+static size_t slot_of(alarm_store_t *store, int key){
+    return (size_t) (((uint64_t) (uint32_t) key * 11400714819323198485ull) >> store->shift);
+}
+
+static void alarm_store_grow(alarm_store_t *store){
+    alarm_store_slot *old = store->slots;
+    size_t old_capacity = store->capacity, i;
+
+    alarm_store_init(store, old_capacity * 2);
+    for(i = 0; i < old_capacity; i++){
+        if(old[i].value != NULL)
+            alarm_store_insert(store, old[i].key, old[i].value);
+    }
+    free(old);
+}
+
+/*
+ * Capacity is rounded up to a power of two.
+ */
+void alarm_store_init(alarm_store_t *store, size_t capacity){
+    size_t size = 16;
+    unsigned shift = 64 - 4;
+
+    while(size < capacity){
+        size *= 2;
+        shift--;
+    }
+    store->slots = (alarm_store_slot *) calloc(size, sizeof(alarm_store_slot));
+    if(store->slots == NULL)
+        errno_abort("Allocate alarm store");
+    store->capacity = size;
+    store->shift = shift;
+    store->count = 0;
+}
+
+void * alarm_store_find(alarm_store_t *store, int key){
+    size_t i = slot_of(store, key);
+
+    while(store->slots[i].value != NULL){
+        if(store->slots[i].key == key)
+            return store->slots[i].value;
+        i = (i + 1) & (store->capacity - 1);
+    }
+    return NULL;
+}
+
+/*
+ * Inserts a value under a key that is not in the store yet.
+ */
+void alarm_store_insert(alarm_store_t *store, int key, void *value){
+    size_t i;
+
+    if((store->count + 1) * 2 > store->capacity)
+        alarm_store_grow(store);
+
+    i = slot_of(store, key);
+    while(store->slots[i].value != NULL)
+        i = (i + 1) & (store->capacity - 1);
+    store->slots[i].key = key;
+    store->slots[i].value = value;
+    store->count++;
+}
+
+/*
+ * Changes the value of a key that is in the store.
+ */
+void alarm_store_set(alarm_store_t *store, int key, void *value){
+    size_t i = slot_of(store, key);
+
+    while(store->slots[i].key != key || store->slots[i].value == NULL)
+        i = (i + 1) & (store->capacity - 1);
+    store->slots[i].value = value;
+}
+
+/*
+ * Removes a key and returns its value, or NULL if it was not there.
+ */
+void * alarm_store_remove(alarm_store_t *store, int key){
+    size_t mask = store->capacity - 1, i, j, home;
+    void *value;
+
+    i = slot_of(store, key);
+    while(store->slots[i].value != NULL && store->slots[i].key != key)
+        i = (i + 1) & mask;
+    if(store->slots[i].value == NULL)
+        return NULL;
+
+    value = store->slots[i].value;
+    store->count--;
+
+    //Shift back any entry of the probe run that would no longer be reachable
+    j = i;
+    while(1){
+        store->slots[i].value = NULL;
+        do {
+            j = (j + 1) & mask;
+            if(store->slots[j].value == NULL)
+                return value;
+            home = slot_of(store, store->slots[j].key);
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        store->slots[i] = store->slots[j];
+        i = j;
+    }
+}
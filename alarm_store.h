@@ -0,0 +1,35 @@
+#ifndef __alarm_store_h
+#define __alarm_store_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Index of live alarms keyed on alarm number.
+ *
+ * An open addressing hash table with linear probing. Deletion shifts the
+ * following entries back, so there are no tombstones and lookups stay short
+ * under churn. The table doubles once it is half full.
+ *
+ * The store does no locking of its own; the caller must serialize access.
+ */
+typedef struct alarm_store_slot {
+    void *          value;
+    int             key;
+} alarm_store_slot;
+
+typedef struct alarm_store {
+    alarm_store_slot *  slots;
+    size_t              capacity;
+    //64 less log2 of capacity, the shift that leaves a slot's bits
+    unsigned            shift;
+    size_t              count;
+} alarm_store_t;
+
+void alarm_store_init(alarm_store_t *store, size_t capacity);
+void * alarm_store_find(alarm_store_t *store, int key);
+void alarm_store_insert(alarm_store_t *store, int key, void *value);
+void alarm_store_set(alarm_store_t *store, int key, void *value);
+void * alarm_store_remove(alarm_store_t *store, int key);
+
+#endif
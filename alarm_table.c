@@ -0,0 +1,100 @@
+/*
+ * alarm_table.c
+ *
+ * Live alarms in structure of arrays form. See alarm_table.h for an
+ * overview.
+ */
+#include "alarm_table.h"
+#include "errors.h"
+
+//alarm_store values are rows plus one, so that row 0 is not taken for NULL
+#define ROW_VALUE(row) ((void *) (uintptr_t) ((row) + 1))
+#define VALUE_ROW(value) ((size_t) (uintptr_t) (value) - 1)
+
+static void * grow_column(void *column, size_t capacity, size_t size){
+    column = realloc(column, capacity * size);
+    if(column == NULL)
+        errno_abort("Grow alarm table");
+    return column;
+}
+
+static void alarm_table_grow(alarm_table_t *table, size_t capacity){
+    table->numbers = (int32_t *) grow_column(table->numbers, capacity, sizeof(int32_t));
+    table->periods = (uint64_t *) grow_column(table->periods, capacity, sizeof(uint64_t));
+    table->flags = (uint8_t *) grow_column(table->flags, capacity, sizeof(uint8_t));
+    table->intervals = (int32_t *) grow_column(table->intervals, capacity, sizeof(int32_t));
+    table->units = (uint8_t *) grow_column(table->units, capacity, sizeof(uint8_t));
+    table->messages = (uint32_t *) grow_column(table->messages, capacity, sizeof(uint32_t));
+    table->displays = (void **) grow_column(table->displays, capacity, sizeof(void *));
+    table->owners = (uint32_t *) grow_column(table->owners, capacity, sizeof(uint32_t));
+    table->capacity = capacity;
+}
+
+void alarm_table_init(alarm_table_t *table, size_t capacity){
+    memset(table, 0, sizeof(*table));
+    alarm_table_grow(table, capacity < 16 ? 16 : capacity);
+    alarm_store_init(&table->index, capacity);
+    message_arena_init(&table->arena);
+}
+
+/*
+ * Returns the row of an alarm number, or ALARM_NONE.
+ */
+size_t alarm_table_find(alarm_table_t *table, int number){
+    void *value = alarm_store_find(&table->index, number);
+
+    return value != NULL ? VALUE_ROW(value) : ALARM_NONE;
+}
+
+/*
+ * Adds a row for an alarm number that is not in the table yet, and
+ * returns it. Only the number is filled in, and the flags cleared.
+ */
+size_t alarm_table_add(alarm_table_t *table, int number){
+    size_t row = table->count;
+
+    if(row == table->capacity)
+        alarm_table_grow(table, table->capacity * 2);
+    table->numbers[row] = number;
+    table->periods[row] = 0;
+    table->flags[row] = 0;
+    table->intervals[row] = 0;
+    table->units[row] = 0;
+    table->messages[row] = 0;
+    table->displays[row] = NULL;
+    table->owners[row] = 0;
+    alarm_store_insert(&table->index, number, ROW_VALUE(row));
+    table->count++;
+    return row;
+}
+
+/*
+ * Removes a row, releasing its message. The last row takes its place.
+ */
+void alarm_table_remove(alarm_table_t *table, size_t row){
+    size_t last = table->count - 1;
+
+    alarm_store_remove(&table->index, table->numbers[row]);
+    message_release(&table->arena, table->messages[row]);
+    if(row != last){
+        table->numbers[row] = table->numbers[last];
+        table->periods[row] = table->periods[last];
+        table->flags[row] = table->flags[last];
+        table->intervals[row] = table->intervals[last];
+        table->units[row] = table->units[last];
+        table->messages[row] = table->messages[last];
+        table->displays[row] = table->displays[last];
+        table->owners[row] = table->owners[last];
+        //Point the moved alarm's index entry at its new row
+        alarm_store_set(&table->index, table->numbers[row], ROW_VALUE(row));
+    }
+    table->count--;
+}
+
+void alarm_table_set_message(alarm_table_t *table, size_t row, const char *text, size_t length){
+    uint32_t old = table->messages[row];
+
+    //Intern first, so a message set to itself is not freed on the way
+    table->messages[row] = message_intern(&table->arena, text, length);
+    message_release(&table->arena, old);
+}
@@ -0,0 +1,63 @@
+#ifndef __alarm_table_h
+#define __alarm_table_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "alarm_store.h"
+#include "message_arena.h"
+
+/*
+ * Live alarms, as the alarm thread keeps them.
+ *
+ * A structure of arrays: row i of every column describes the same alarm,
+ * and rows are kept dense, a removal moving the last row into the gap. The
+ * hot columns hold what scans and sweeps look at, so that going over the
+ * alarm numbers of every alarm reads 4 bytes per alarm instead of a whole
+ * alarm record, and the columns can be compared a vector at a time.
+ * Messages are interned in `arena` and referenced by handle. `index` maps
+ * alarm numbers to rows.
+ *
+ * `displays` is cold: it is only followed to pass a change on to the
+ * display workers. `owners` is the output destination of the client that
+ * last set the alarm, where its displays go. An alarm replaced since its
+ * change was last passed on is flagged ALARM_UNPUBLISHED. ALARM_LISTED is
+ * left to the table's user, which marks the rows copied into a list with it.
+ *
+ * The table does no locking of its own; the caller must serialize access.
+ */
+#define ALARM_CHANGED 1
+#define ALARM_CANCELLING 2
+#define ALARM_UNPUBLISHED 4
+#define ALARM_LISTED 8
+
+typedef struct alarm_table {
+    //Hot columns
+    int32_t *       numbers;
+    uint64_t *      periods;
+    uint8_t *       flags;
+    //Cold columns
+    int32_t *       intervals;
+    uint8_t *       units;
+    uint32_t *      messages;
+    void **         displays;
+    uint32_t *      owners;
+
+    size_t          count;
+    size_t          capacity;
+    alarm_store_t   index;
+    message_arena_t arena;
+} alarm_table_t;
+
+#define ALARM_NONE ((size_t) -1)
+
+void alarm_table_init(alarm_table_t *table, size_t capacity);
+size_t alarm_table_find(alarm_table_t *table, int number);
+size_t alarm_table_add(alarm_table_t *table, int number);
+void alarm_table_remove(alarm_table_t *table, size_t row);
+void alarm_table_set_message(alarm_table_t *table, size_t row, const char *text, size_t length);
+
+static inline const char * alarm_table_message(alarm_table_t *table, size_t row){
+    return message_text(&table->arena, table->messages[row]);
+}
+
+#endif
@@ -0,0 +1,411 @@
+/*
+ * alarm_bench.c
+ *
+ * Drives the alarm program with a synthetic workload and measures it.
+ *
+ * The workload sets up a number of alarms, with intervals drawn from a
+ * distribution, followed by a shuffled mix of replacements and cancels.
+ * The harness times how long the program takes to report on every request
+ * (the ingest rate), then lets the alarms fire for a while, sampling the
+ * program's CPU time, memory and thread count from /proc. Firing latency
+ * comes from the report the program prints with -j when its input ends.
+ *
+ * Usage: alarm_bench [-p program] [-n alarms] [-r replace %] [-c cancel %]
+ *                    [-i intervals] [-d seconds] [-w workers] [-s seed]
+ *                    [-t timeout] [-- program options]
+ *
+ * Intervals are one of
+ *     fixed:V         every alarm gets V
+ *     uniform:A-B     uniformly between A and B
+ *     exp:M           exponentially distributed, with mean M
+ * where values take an optional s, ms or us unit, seconds by default.
+ *
+ * Output is a single line of key=value pairs, so that runs of different
+ * builds can be collected and compared.
+ */
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <getopt.h>
+#include "../errors.h"
+
+#define DIST_FIXED 0
+#define DIST_UNIFORM 1
+#define DIST_EXP 2
+
+typedef struct distribution {
+    int         kind;
+    uint64_t    a;
+    uint64_t    b;
+} distribution_t;
+
+/*
+ * What the reader thread has seen on the program's standard output.
+ * A response is any line about a request, everything else is a display.
+ */
+static atomic_ulong responses = 0;
+static atomic_ulong displays = 0;
+static atomic_ulong expected = 0;
+static atomic_ullong ingest_done = 0;
+
+static uint64_t random_state;
+
+static uint64_t now_ns(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static uint64_t next_random(void){
+    //xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 2685821657736338717ull;
+}
+
+/*
+ * Parses a duration with an optional unit into microseconds.
+ * Returns NULL on error, otherwise a pointer past it.
+ */
+static const char * parse_us(const char *text, uint64_t *us){
+    char *end;
+    double value = strtod(text, &end);
+
+    if(end == text || value < 0)
+        return NULL;
+    if(strncmp(end, "ms", 2) == 0){
+        value *= 1e3;
+        end += 2;
+    } else if(strncmp(end, "us", 2) == 0){
+        end += 2;
+    } else {
+        if(*end == 's')
+            end++;
+        value *= 1e6;
+    }
+    *us = (uint64_t) value;
+    return end;
+}
+
+static int parse_distribution(const char *text, distribution_t *dist){
+    const char *p;
+
+    if(strncmp(text, "fixed:", 6) == 0){
+        dist->kind = DIST_FIXED;
+        p = parse_us(text + 6, &dist->a);
+        return p != NULL && *p == '\0';
+    }
+    if(strncmp(text, "uniform:", 8) == 0){
+        dist->kind = DIST_UNIFORM;
+        p = parse_us(text + 8, &dist->a);
+        if(p == NULL || *p != '-')
+            return 0;
+        p = parse_us(p + 1, &dist->b);
+        return p != NULL && *p == '\0' && dist->b >= dist->a;
+    }
+    if(strncmp(text, "exp:", 4) == 0){
+        dist->kind = DIST_EXP;
+        p = parse_us(text + 4, &dist->a);
+        return p != NULL && *p == '\0';
+    }
+    return 0;
+}
+
+static uint64_t draw_us(distribution_t *dist){
+    double u;
+
+    switch(dist->kind){
+        case DIST_UNIFORM:
+            return dist->a + next_random() % (dist->b - dist->a + 1);
+        case DIST_EXP:
+            u = (double) (next_random() >> 11) / (double) (1ull << 53);
+            return (uint64_t) (-log(1.0 - u) * (double) dist->a);
+    }
+    return dist->a;
+}
+
+/*
+ * Writes an interval in the largest unit that represents it exactly.
+ */
+static void write_interval(FILE *out, uint64_t us){
+    if(us == 0)
+        us = 1;
+    if(us % 1000000 == 0 && us / 1000000 <= 0x7fffffff)
+        fprintf(out, "%d", (int) (us / 1000000));
+    else if(us % 1000 == 0 && us / 1000 <= 0x7fffffff)
+        fprintf(out, "%dms", (int) (us / 1000));
+    else
+        fprintf(out, "%dus", (int) (us > 0x7fffffff ? 0x7fffffff : us));
+}
+
+/*
+ * Counts the lines the program writes. Lines can straddle reads, so the
+ * start of the current line is kept aside until its newline shows up.
+ */
+static void * read_output(void *arg){
+    int fd = (int) (intptr_t) arg;
+    char buffer[1 << 16], head[32];
+    size_t head_length = 0;
+    unsigned long seen;
+    ssize_t bytes, i;
+
+    while((bytes = read(fd, buffer, sizeof(buffer))) != 0){
+        if(bytes < 0){
+            if(errno == EINTR)
+                continue;
+            break;
+        }
+        for(i = 0; i < bytes; i++){
+            if(buffer[i] != '\n'){
+                if(head_length < sizeof(head) - 1)
+                    head[head_length++] = buffer[i];
+                continue;
+            }
+            head[head_length] = '\0';
+            //The prompt is never printed in batch mode, so every line is one of these
+            if(strncmp(head, "Error", 5) == 0 || strstr(head, "Request") != NULL){
+                seen = atomic_fetch_add(&responses, 1) + 1;
+                if(seen == atomic_load(&expected))
+                    atomic_store(&ingest_done, now_ns());
+            } else {
+                atomic_fetch_add(&displays, 1);
+            }
+            head_length = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Reads utime + stime of a process, in clock ticks.
+ */
+static long process_cpu_ticks(pid_t pid){
+    char path[64], buffer[1024], *fields;
+    unsigned long utime, stime;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    file = fopen(path, "r");
+    if(file == NULL)
+        errno_abort("Open stat");
+    if(fgets(buffer, sizeof(buffer), file) == NULL)
+        errno_abort("Read stat");
+    fclose(file);
+
+    //Skip past the command name, which may contain spaces
+    fields = strrchr(buffer, ')');
+    if(fields == NULL || sscanf(fields + 2,
+            "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2){
+        fprintf(stderr, "Unexpected stat format\n");
+        exit(1);
+    }
+    return (long) (utime + stime);
+}
+
+/*
+ * Reads a field such as "VmRSS:" or "Threads:" from /proc/<pid>/status.
+ */
+static long process_status(pid_t pid, const char *field){
+    char path[64], line[256];
+    size_t length = strlen(field);
+    long value = -1;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    file = fopen(path, "r");
+    if(file == NULL)
+        errno_abort("Open status");
+    while(fgets(line, sizeof(line), file) != NULL){
+        if(strncmp(line, field, length) == 0){
+            value = atol(line + length);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+static void usage(const char *name){
+    fprintf(stderr, "Usage: %s [-p program] [-n alarms] [-r replace %%] [-c cancel %%]\n"
+                    "       [-i fixed:V|uniform:A-B|exp:M] [-d seconds] [-w workers] [-s seed]\n"
+                    "       [-t timeout] [-- program options]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]){
+    const char *program = "./New_Alarm_Cond", *intervals = "uniform:100ms-2s", *workers = "4";
+    int alarms = 100000, replace_pct = 20, cancel_pct = 20, window = 5, timeout = 60;
+    int to_child[2], from_child[2], errors_child[2], option, status, i, extra, argi;
+    unsigned long replaces, cancels, left_replaces, left_cancels, pool, pick;
+    unsigned long displays_before, displays_after, requests, *order;
+    long cpu_start, cpu_ingested, cpu_before, cpu_after, ticks_per_sec, rss, hwm, threads;
+    double ingest_s, p50 = -1, p99 = -1, max = -1;
+    char report[256], **child_argv, *line;
+    uint64_t start;
+    distribution_t dist;
+    pthread_t reader;
+    ssize_t bytes, got;
+    FILE *input;
+    pid_t pid;
+
+    random_state = 88172645463325252ull;
+    while((option = getopt(argc, argv, "p:n:r:c:i:d:w:s:t:")) != -1){
+        switch(option){
+            case 'p': program = optarg; break;
+            case 'n': alarms = atoi(optarg); break;
+            case 'r': replace_pct = atoi(optarg); break;
+            case 'c': cancel_pct = atoi(optarg); break;
+            case 'i': intervals = optarg; break;
+            case 'd': window = atoi(optarg); break;
+            case 'w': workers = optarg; break;
+            case 's': random_state = strtoull(optarg, NULL, 10) | 1; break;
+            case 't': timeout = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if(alarms < 1 || replace_pct < 0 || cancel_pct < 0 || cancel_pct > 100
+       || !parse_distribution(intervals, &dist))
+        usage(argv[0]);
+    replaces = (unsigned long) alarms * (unsigned long) replace_pct / 100;
+    cancels = (unsigned long) alarms * (unsigned long) cancel_pct / 100;
+    requests = (unsigned long) alarms + replaces + cancels;
+    atomic_store(&expected, requests);
+
+    //program -b -j -w workers [options after --]
+    extra = argc - optind;
+    child_argv = (char **) malloc((size_t) (extra + 6) * sizeof(char *));
+    if(child_argv == NULL)
+        errno_abort("Allocate arguments");
+    argi = 0;
+    child_argv[argi++] = (char *) program;
+    child_argv[argi++] = "-b";
+    child_argv[argi++] = "-j";
+    child_argv[argi++] = "-w";
+    child_argv[argi++] = (char *) workers;
+    for(i = 0; i < extra; i++)
+        child_argv[argi++] = argv[optind + i];
+    child_argv[argi] = NULL;
+
+    if(pipe(to_child) < 0 || pipe(from_child) < 0 || pipe(errors_child) < 0)
+        errno_abort("Create pipe");
+    pid = fork();
+    if(pid < 0)
+        errno_abort("Fork");
+    if(pid == 0){
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        dup2(errors_child[1], STDERR_FILENO);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(errors_child[0]);
+        execv(program, child_argv);
+        _exit(127);
+    }
+    close(to_child[0]);
+    close(from_child[1]);
+    close(errors_child[1]);
+
+    status = pthread_create(&reader, NULL, read_output, (void *) (intptr_t) from_child[0]);
+    if(status != 0)
+        err_abort(status, "Create reader");
+
+    //Shuffle which alarms get replaced and cancelled
+    order = (unsigned long *) malloc((size_t) alarms * sizeof(unsigned long));
+    if(order == NULL)
+        errno_abort("Allocate order");
+    for(i = 0; i < alarms; i++)
+        order[i] = (unsigned long) i + 1;
+
+    input = fdopen(to_child[1], "w");
+    if(input == NULL)
+        errno_abort("Open input");
+    setvbuf(input, NULL, _IOFBF, 1 << 16);
+
+    cpu_start = process_cpu_ticks(pid);
+    start = now_ns();
+    for(i = 0; i < alarms; i++){
+        write_interval(input, draw_us(&dist));
+        fprintf(input, " Message(%d) bench alarm %d\n", i + 1, i + 1);
+    }
+    //Cancels go to distinct alarms, replacements to any
+    left_replaces = replaces;
+    left_cancels = cancels;
+    pool = (unsigned long) alarms;
+    while(left_replaces + left_cancels > 0){
+        if(next_random() % (left_replaces + left_cancels) < left_replaces){
+            left_replaces--;
+            write_interval(input, draw_us(&dist));
+            fprintf(input, " Message(%lu) bench replacement\n",
+                    1 + next_random() % (unsigned long) alarms);
+        } else {
+            left_cancels--;
+            pick = next_random() % pool;
+            fprintf(input, "Cancel: Message(%lu)\n", order[pick]);
+            order[pick] = order[--pool];
+        }
+    }
+    fflush(input);
+
+    while(atomic_load(&ingest_done) == 0){
+        if(now_ns() - start > (uint64_t) timeout * 1000000000ull){
+            fprintf(stderr, "Timed out after %lu of %lu responses\n",
+                    atomic_load(&responses), requests);
+            kill(pid, SIGKILL);
+            exit(1);
+        }
+        usleep(1000);
+    }
+    ingest_s = (double) (atomic_load(&ingest_done) - start) / 1e9;
+    cpu_ingested = process_cpu_ticks(pid);
+
+    //Let the alarms fire undisturbed
+    cpu_before = process_cpu_ticks(pid);
+    displays_before = atomic_load(&displays);
+    sleep((unsigned int) window);
+    cpu_after = process_cpu_ticks(pid);
+    displays_after = atomic_load(&displays);
+    rss = process_status(pid, "VmRSS:");
+    hwm = process_status(pid, "VmHWM:");
+    threads = process_status(pid, "Threads:");
+
+    //End of input makes the program report its jitter and exit
+    fclose(input);
+    bytes = 0;
+    while(bytes < (ssize_t) sizeof(report) - 1){
+        got = read(errors_child[0], report + bytes, sizeof(report) - 1 - (size_t) bytes);
+        if(got <= 0)
+            break;
+        bytes += got;
+    }
+    report[bytes] = '\0';
+    waitpid(pid, &status, 0);
+    pthread_join(reader, NULL);
+    line = strstr(report, "Jitter:");
+    if(line != NULL)
+        sscanf(line, "Jitter: %*s displays, p50 %lf us, p99 %lf us, max %lf us", &p50, &p99, &max);
+
+    ticks_per_sec = sysconf(_SC_CLK_TCK);
+    printf("program=%s alarms=%d replaces=%lu cancels=%lu intervals=%s workers=%s "
+           "ingest_s=%.3f ingest_rate=%.0f cpu_us_per_request=%.3f "
+           "window_s=%d displays=%lu cpu_pct=%.2f cpu_us_per_display=%.3f "
+           "jitter_p50_us=%.1f jitter_p99_us=%.1f jitter_max_us=%.1f "
+           "rss_kb=%ld hwm_kb=%ld threads=%ld\n",
+           program, alarms, replaces, cancels, intervals, workers,
+           ingest_s, (double) requests / ingest_s,
+           1e6 * (double) (cpu_ingested - cpu_start) / ticks_per_sec / (double) requests,
+           window, displays_after - displays_before,
+           100.0 * (double) (cpu_after - cpu_before) / ticks_per_sec / window,
+           displays_after > displays_before
+               ? 1e6 * (double) (cpu_after - cpu_before) / ticks_per_sec
+                 / (double) (displays_after - displays_before) : 0.0,
+           p50, p99, max, rss, hwm, threads);
+    return 0;
+}
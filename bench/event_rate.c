@@ -0,0 +1,99 @@
+/*
+ * event_rate.c
+ *
+ * Rate at which the alarm engine delivers events to a program embedding
+ * it, with no text formatted or written anywhere.
+ *
+ * N alarms are set from the main thread, each firing every millisecond,
+ * and the callback counts the events on whichever engine thread delivers
+ * them, in a counter of the thread's own. Two rates are measured:
+ *  - replies: from the first set until every set has been replied to
+ *  - fires:   fired events over the next few seconds, against the
+ *             N per millisecond the alarms are due at
+ *
+ * Usage: event_rate [alarms] [seconds] [workers] [shards]
+ *
+ * Output is one line of key=value pairs.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "../errors.h"
+#include "../alarm_engine.h"
+
+#define MAX_THREADS 256
+
+typedef struct counter {
+    _Alignas(64) atomic_uint_fast64_t   replies;
+    atomic_uint_fast64_t                fires;
+} counter_t;
+
+static counter_t counters[MAX_THREADS];
+static atomic_int counter_count;
+static __thread counter_t *local;
+
+static uint64_t now_ns(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static void count_event(const alarm_event_t *event, void *context){
+    if(local == NULL)
+        local = &counters[atomic_fetch_add(&counter_count, 1) % MAX_THREADS];
+    if(event->type == ALARM_EVENT_FIRED || event->type == ALARM_EVENT_REPLACED)
+        atomic_fetch_add_explicit(&local->fires, 1, memory_order_relaxed);
+    else
+        atomic_fetch_add_explicit(&local->replies, 1, memory_order_relaxed);
+}
+
+static void collect(uint64_t *replies, uint64_t *fires){
+    int i;
+
+    *replies = 0;
+    *fires = 0;
+    for(i = 0; i < MAX_THREADS; i++){
+        *replies += atomic_load_explicit(&counters[i].replies, memory_order_relaxed);
+        *fires += atomic_load_explicit(&counters[i].fires, memory_order_relaxed);
+    }
+}
+
+int main(int argc, char *argv[]){
+    int alarms = argc > 1 ? atoi(argv[1]) : 10000;
+    int seconds = argc > 2 ? atoi(argv[2]) : 5;
+    alarm_engine_config_t config;
+    uint64_t start, replied, replies, fires, first_fires;
+    double elapsed;
+    char message[32];
+    int length, i;
+
+    alarm_engine_default_config(&config);
+    if(argc > 3)
+        config.workers = atoi(argv[3]);
+    if(argc > 4)
+        config.shards = atoi(argv[4]);
+    alarm_engine_create(&config, count_event, NULL);
+
+    start = now_ns();
+    for(i = 0; i < alarms; i++){
+        length = snprintf(message, sizeof(message), "alarm %d", i);
+        alarm_engine_set(0, i, 1, PARSE_UNIT_MS, message, (size_t) length);
+    }
+    //Every reply is delivered before the request counts as done
+    alarm_engine_drain();
+    replied = now_ns();
+
+    collect(&replies, &first_fires);
+    sleep(seconds);
+    collect(&replies, &fires);
+    fires -= first_fires;
+    elapsed = (double) (now_ns() - replied) / 1e9;
+
+    printf("alarms=%d workers=%d shards=%d seconds=%d replies=%llu replies_per_s=%.0f fires=%llu"
+           " fires_per_s=%.0f due_per_s=%.0f\n",
+           alarms, config.workers, config.shards, seconds, (unsigned long long) replies,
+           alarms / ((double) (replied - start) / 1e9), (unsigned long long) fires,
+           (double) fires / elapsed, alarms * 1000.0);
+    return 0;
+}
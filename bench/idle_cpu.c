@@ -0,0 +1,94 @@
+/*
+ * idle_cpu.c
+ *
+ * Measures how much CPU time the alarm program burns per idle alarm.
+ * It starts the program, sets up a number of alarms with an interval long
+ * enough that they never fire during the measurement, then samples the
+ * child's user and system time from /proc over a quiet window.
+ *
+ * Usage: idle_cpu [program] [alarms] [seconds]
+ *
+ * Output is a single line of key=value pairs.
+ */
+#include <signal.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <time.h>
+#include "../errors.h"
+
+/*
+ * Reads utime + stime of a process, in clock ticks.
+ */
+static long process_cpu_ticks(pid_t pid){
+    char path[64], buffer[1024], *fields;
+    unsigned long utime, stime;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    file = fopen(path, "r");
+    if(file == NULL)
+        errno_abort("Open stat");
+    if(fgets(buffer, sizeof(buffer), file) == NULL)
+        errno_abort("Read stat");
+    fclose(file);
+
+    //Skip past the command name, which may contain spaces
+    fields = strrchr(buffer, ')');
+    if(fields == NULL || sscanf(fields + 2,
+            "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2){
+        fprintf(stderr, "Unexpected stat format\n");
+        exit(1);
+    }
+    return (long) (utime + stime);
+}
+
+int main(int argc, char *argv[]){
+    const char *program = argc > 1 ? argv[1] : "./New_Alarm_Cond";
+    int alarms = argc > 2 ? atoi(argv[2]) : 1000;
+    int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    int to_child[2], null_fd, i;
+    long before, after, ticks_per_sec;
+    double cpu;
+    pid_t pid;
+    FILE *input;
+
+    if(pipe(to_child) < 0)
+        errno_abort("Create pipe");
+
+    pid = fork();
+    if(pid < 0)
+        errno_abort("Fork");
+    if(pid == 0){
+        null_fd = open("/dev/null", O_WRONLY);
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(to_child[1]);
+        execl(program, program, (char *) NULL);
+        _exit(127);
+    }
+    close(to_child[0]);
+
+    input = fdopen(to_child[1], "w");
+    for(i = 0; i < alarms; i++)
+        fprintf(input, "86400 Message(%d) idle alarm %d\n", i + 1, i + 1);
+    fflush(input);
+
+    //Let the first displays and the set up settle before measuring
+    sleep(1);
+    before = process_cpu_ticks(pid);
+    sleep(seconds);
+    after = process_cpu_ticks(pid);
+
+    ticks_per_sec = sysconf(_SC_CLK_TCK);
+    cpu = (double) (after - before) / ticks_per_sec;
+    printf("alarms=%d window_s=%d cpu_s=%.3f cpu_pct=%.2f cpu_us_per_alarm_s=%.3f\n",
+           alarms, seconds, cpu, 100.0 * cpu / seconds,
+           alarms > 0 ? 1e6 * cpu / seconds / alarms : 0.0);
+
+    fclose(input);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
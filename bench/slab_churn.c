@@ -0,0 +1,178 @@
+/*
+ * slab_churn.c
+ *
+ * Churn benchmark comparing the slab allocator with malloc.
+ *
+ * Two workloads are run with each allocator:
+ *  - local:   every thread keeps a window of live objects and randomly
+ *             replaces them, like alarms being set and cancelled.
+ *  - handoff: threads are paired up, one allocates and the other frees,
+ *             like main allocating requests the alarm thread frees.
+ *
+ * Usage: slab_churn [threads] [operations per thread]
+ *
+ * Output is one line of key=value pairs per workload and allocator.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "../errors.h"
+#include "../slab.h"
+
+#define OBJECT_SIZE 176
+#define WINDOW 4096
+#define RING 1024
+
+typedef struct bench_arg {
+    int                 use_slab;
+    long                operations;
+    unsigned int        seed;
+    //Handoff ring shared by a producer and a consumer
+    void * _Atomic *    ring;
+    atomic_long *       head;
+    atomic_long *       tail;
+} bench_arg;
+
+static slab_cache_t cache;
+
+static void * object_alloc(int use_slab){
+    void *object = use_slab ? slab_alloc(&cache) : malloc(OBJECT_SIZE);
+    if(object == NULL)
+        errno_abort("Allocate object");
+    //Touch it, as a real request would
+    memset(object, 0, 64);
+    return object;
+}
+
+static void object_free(int use_slab, void *object){
+    if(use_slab)
+        slab_free(&cache, object);
+    else
+        free(object);
+}
+
+static void * local_churn(void *arg){
+    bench_arg *bench = (bench_arg *) arg;
+    void **window = (void **) calloc(WINDOW, sizeof(void *));
+    long i;
+    int slot;
+
+    for(i = 0; i < bench->operations; i++){
+        slot = rand_r(&bench->seed) % WINDOW;
+        if(window[slot] != NULL)
+            object_free(bench->use_slab, window[slot]);
+        window[slot] = object_alloc(bench->use_slab);
+    }
+    for(slot = 0; slot < WINDOW; slot++)
+        if(window[slot] != NULL)
+            object_free(bench->use_slab, window[slot]);
+    free(window);
+    return NULL;
+}
+
+static void * handoff_producer(void *arg){
+    bench_arg *bench = (bench_arg *) arg;
+    long i, head;
+
+    for(i = 0; i < bench->operations; i++){
+        head = atomic_load_explicit(bench->head, memory_order_relaxed);
+        while(head - atomic_load_explicit(bench->tail, memory_order_acquire) >= RING)
+            sched_yield();
+        atomic_store_explicit(&bench->ring[head % RING],
+                              object_alloc(bench->use_slab), memory_order_relaxed);
+        atomic_store_explicit(bench->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void * handoff_consumer(void *arg){
+    bench_arg *bench = (bench_arg *) arg;
+    long i, tail;
+
+    for(i = 0; i < bench->operations; i++){
+        tail = atomic_load_explicit(bench->tail, memory_order_relaxed);
+        while(atomic_load_explicit(bench->head, memory_order_acquire) == tail)
+            sched_yield();
+        object_free(bench->use_slab,
+                    atomic_load_explicit(&bench->ring[tail % RING], memory_order_relaxed));
+        atomic_store_explicit(bench->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static double elapsed(struct timespec *start){
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void run(const char *workload, int use_slab, int threads, long operations){
+    pthread_t *ids = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    bench_arg *args = (bench_arg *) calloc(threads, sizeof(bench_arg));
+    struct timespec start;
+    slab_stats_t stats;
+    double seconds;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 0; i < threads; i++){
+        args[i].use_slab = use_slab;
+        args[i].operations = operations;
+        args[i].seed = (unsigned int) i + 1;
+        if(strcmp(workload, "local") == 0){
+            pthread_create(&ids[i], NULL, local_churn, &args[i]);
+            continue;
+        }
+        //Pairs share the producer's ring
+        if(i % 2 == 0){
+            args[i].ring = (void * _Atomic *) calloc(RING, sizeof(void *));
+            args[i].head = (atomic_long *) calloc(1, sizeof(atomic_long));
+            args[i].tail = (atomic_long *) calloc(1, sizeof(atomic_long));
+            pthread_create(&ids[i], NULL, handoff_producer, &args[i]);
+        } else {
+            args[i].ring = args[i - 1].ring;
+            args[i].head = args[i - 1].head;
+            args[i].tail = args[i - 1].tail;
+            pthread_create(&ids[i], NULL, handoff_consumer, &args[i]);
+        }
+    }
+    for(i = 0; i < threads; i++)
+        pthread_join(ids[i], NULL);
+    seconds = elapsed(&start);
+
+    printf("workload=%s allocator=%s threads=%d ops=%ld seconds=%.3f mops_per_s=%.2f",
+           workload, use_slab ? "slab" : "malloc", threads, operations * threads,
+           seconds, operations * threads / seconds / 1e6);
+    if(use_slab){
+        slab_get_stats(&cache, &stats);
+        printf(" live=%zu free=%zu high_water=%zu", stats.live, stats.free, stats.high_water);
+    }
+    printf("\n");
+
+    for(i = 0; i < threads; i += 2){
+        if(strcmp(workload, "handoff") == 0){
+            free((void *) args[i].ring);
+            free(args[i].head);
+            free(args[i].tail);
+        }
+    }
+    free(ids);
+    free(args);
+}
+
+int main(int argc, char *argv[]){
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    long operations = argc > 2 ? atol(argv[2]) : 2000000;
+
+    if(threads < 2)
+        threads = 2;
+    threads &= ~1;
+    slab_init(&cache, "bench", OBJECT_SIZE);
+
+    run("local", 0, threads, operations);
+    run("local", 1, threads, operations);
+    run("handoff", 0, threads, operations);
+    run("handoff", 1, threads, operations);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * store_scan.c
+ *
+ * Scan throughput of the alarm table's columns, against the linked list of
+ * alarm records the alarm thread used to keep.
+ *
+ * Three scans are run over N alarms with each layout:
+ *  - find:  look for an alarm number by going through every alarm, as
+ *           alarm_insert did for each request
+ *  - range: count the alarms whose number lies in a range
+ *  - sweep: count the alarms whose 64 bit period is under a bound, which
+ *           reads memory the way a sweep over deadlines does
+ *
+ * Nodes are allocated one after the other, so they are as close together
+ * as a list gets; a list built up over time is scattered across the heap.
+ *
+ * Usage: store_scan [alarms] [passes]
+ *
+ * Output is one line of key=value pairs per scan and layout, with the
+ * number of alarms looked at per second.
+ */
+#include <time.h>
+#include "../errors.h"
+#include "../alarm_table.h"
+
+typedef struct node {
+    struct node *   link;
+    int             seconds;
+    int             alarm_number;
+    int             request_type;
+    char            message[128];
+    int             changed;
+    uint64_t        period;
+} node_t;
+
+static uint64_t now_ns(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+static void report(const char *scan, const char *layout, size_t alarms, int passes,
+                   uint64_t elapsed, size_t result){
+    printf("scan=%s layout=%s alarms=%zu passes=%d alarms_per_s=%.0f result=%zu\n",
+           scan, layout, alarms, passes,
+           (double) alarms * passes / ((double) elapsed / 1e9), result);
+}
+
+int main(int argc, char *argv[]){
+    size_t alarms = argc > 1 ? (size_t) atol(argv[1]) : 1000000;
+    int passes = argc > 2 ? atoi(argv[2]) : 20;
+    alarm_table_t table;
+    node_t *head = NULL, **tail = &head, *node;
+    size_t i, row, result;
+    uint64_t start;
+    int pass, low, high, target;
+    uint64_t bound;
+
+    srand(1);
+    alarm_table_init(&table, alarms);
+    for(i = 0; i < alarms; i++){
+        node = (node_t *) calloc(1, sizeof(node_t));
+        if(node == NULL)
+            errno_abort("Allocate node");
+        node->alarm_number = (int) i;
+        node->seconds = 1 + rand() % 3600;
+        node->period = (uint64_t) node->seconds * 1000000000ull;
+        snprintf(node->message, sizeof(node->message), "message %zu", i % 100);
+        *tail = node;
+        tail = &node->link;
+
+        row = alarm_table_add(&table, (int) i);
+        table.intervals[row] = node->seconds;
+        table.periods[row] = node->period;
+        alarm_table_set_message(&table, row, node->message, strlen(node->message));
+    }
+    //Past the last alarm, so every pass goes all the way
+    target = (int) alarms;
+    low = (int) (alarms / 4);
+    high = (int) (alarms / 2);
+    bound = 600 * 1000000000ull;
+
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(node = head; node != NULL; node = node->link)
+            if(node->alarm_number == target)
+                result++;
+    report("find", "list", alarms, passes, now_ns() - start, result);
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(row = 0; row < table.count; row++)
+            result += table.numbers[row] == target;
+    report("find", "columns", alarms, passes, now_ns() - start, result);
+
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(node = head; node != NULL; node = node->link)
+            result += node->alarm_number >= low && node->alarm_number <= high;
+    report("range", "list", alarms, passes, now_ns() - start, result / passes);
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(row = 0; row < table.count; row++)
+            result += table.numbers[row] >= low && table.numbers[row] <= high;
+    report("range", "columns", alarms, passes, now_ns() - start, result / passes);
+
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(node = head; node != NULL; node = node->link)
+            result += node->period < bound;
+    report("sweep", "list", alarms, passes, now_ns() - start, result / passes);
+    start = now_ns();
+    for(pass = 0, result = 0; pass < passes; pass++)
+        for(row = 0; row < table.count; row++)
+            result += table.periods[row] < bound;
+    report("sweep", "columns", alarms, passes, now_ns() - start, result / passes);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ * write_latency.c
+ *
+ * Latency of publishing a replacement while N display readers are active,
+ * for the readers-first semaphore protocol the display threads used, and
+ * for epoch based reads of immutable records.
+ *
+ * Each reader loops reading the current record, as a display worker does.
+ * The writer replaces the record every millisecond and times each write,
+ * from when it starts until the new record is in place. Readers-first
+ * readers can starve the writer indefinitely, so a semaphore write gives up
+ * after WRITE_TIMEOUT_S and is counted as starved.
+ *
+ * Usage: write_latency [readers] [writes]
+ *
+ * Output is one line of key=value pairs per protocol.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "../errors.h"
+#include "../epoch.h"
+
+#define WRITE_TIMEOUT_S 1
+
+typedef struct record {
+    int     seconds;
+    char    message[128];
+} record_t;
+
+static sem_t main_semaphore;
+static sem_t display_sem;
+static int reader_flag = 0;
+static record_t shared_record;
+
+static _Atomic(record_t *) published;
+static atomic_int running;
+static atomic_long reads;
+static int starved;
+
+static uint64_t now_ns(){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ull + (uint64_t) now.tv_nsec;
+}
+
+/*
+ * Stands in for formatting a display line from the record.
+ */
+static int read_record(record_t *record){
+    char line[192];
+
+    return snprintf(line, sizeof(line), "%d Message %s", record->seconds, record->message);
+}
+
+static void * semaphore_reader(void *arg){
+    long count = 0;
+
+    while(atomic_load_explicit(&running, memory_order_relaxed)){
+        //Readers-first synchronization
+        sem_wait(&display_sem);
+        reader_flag++;
+        if(reader_flag == 1)
+            sem_wait(&main_semaphore);
+        sem_post(&display_sem);
+
+        read_record(&shared_record);
+        count++;
+
+        sem_wait(&display_sem);
+        reader_flag--;
+        if(reader_flag == 0)
+            sem_post(&main_semaphore);
+        sem_post(&display_sem);
+    }
+    atomic_fetch_add(&reads, count);
+    return NULL;
+}
+
+static void * epoch_reader(void *arg){
+    long count = 0;
+
+    while(atomic_load_explicit(&running, memory_order_relaxed)){
+        epoch_enter();
+        read_record(atomic_load_explicit(&published, memory_order_acquire));
+        epoch_exit();
+        count++;
+    }
+    atomic_fetch_add(&reads, count);
+    return NULL;
+}
+
+static void semaphore_write(int version){
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += WRITE_TIMEOUT_S;
+    if(sem_timedwait(&main_semaphore, &deadline) != 0){
+        starved++;
+        return;
+    }
+    shared_record.seconds = version;
+    snprintf(shared_record.message, sizeof(shared_record.message), "replacement %d", version);
+    sem_post(&main_semaphore);
+}
+
+static void epoch_write(int version){
+    record_t *record = (record_t *) malloc(sizeof(record_t)), *old;
+
+    record->seconds = version;
+    snprintf(record->message, sizeof(record->message), "replacement %d", version);
+    old = atomic_exchange_explicit(&published, record, memory_order_acq_rel);
+    epoch_retire(old, free);
+    epoch_reclaim();
+}
+
+static int compare_u64(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *protocol, void *(*reader)(void *), void (*write)(int),
+                int readers, int writes){
+    pthread_t *ids = (pthread_t *) calloc(readers, sizeof(pthread_t));
+    uint64_t *latency = (uint64_t *) calloc(writes, sizeof(uint64_t)), start;
+    struct timespec pause = {0, 1000000};
+    int i;
+
+    atomic_store(&running, 1);
+    atomic_store(&reads, 0);
+    starved = 0;
+    for(i = 0; i < readers; i++)
+        pthread_create(&ids[i], NULL, reader, NULL);
+
+    for(i = 0; i < writes; i++){
+        nanosleep(&pause, NULL);
+        start = now_ns();
+        write(i);
+        latency[i] = now_ns() - start;
+    }
+
+    atomic_store(&running, 0);
+    for(i = 0; i < readers; i++)
+        pthread_join(ids[i], NULL);
+
+    qsort(latency, writes, sizeof(uint64_t), compare_u64);
+    printf("protocol=%s readers=%d writes=%d p50_us=%.1f p99_us=%.1f max_us=%.1f starved=%d reads=%ld\n",
+           protocol, readers, writes,
+           latency[writes / 2] / 1e3, latency[writes * 99 / 100] / 1e3,
+           latency[writes - 1] / 1e3, starved, atomic_load(&reads));
+    free(latency);
+    free(ids);
+}
+
+int main(int argc, char *argv[]){
+    int readers = argc > 1 ? atoi(argv[1]) : 8;
+    int writes = argc > 2 ? atoi(argv[2]) : 200;
+    record_t *first = (record_t *) calloc(1, sizeof(record_t));
+
+    if(writes < 1)
+        writes = 1;
+    if(sem_init(&main_semaphore, 0, 1) < 0 || sem_init(&display_sem, 0, 1) < 0)
+        errno_abort("Create semaphore");
+    atomic_init(&published, first);
+
+    run("semaphore", semaphore_reader, semaphore_write, readers, writes);
+    run("epoch", epoch_reader, epoch_write, readers, writes);
+    return 0;
+}
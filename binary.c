@@ -0,0 +1,88 @@
+/*
+ * binary.c
+ *
+ * Binary command and status records. See binary.h for the layout.
+ */
+#include "binary.h"
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Reads the record at `p` into `command`, without copying the message,
+ * and sets `length` to how long the record is. Returns PARSE_SET,
+ * PARSE_CANCEL or PARSE_INCORRECT_FORMAT, BINARY_INCOMPLETE if the record
+ * goes on past `end`, or BINARY_BROKEN if its length cannot be right.
+ */
+int binary_parse(const char *p, const char *end, parsed_command_t *command, size_t *length){
+    uint32_t record_length, message_length;
+    int32_t alarm_number, interval;
+    uint16_t reserved;
+    uint8_t op, unit;
+
+    if(end - p < 4)
+        return BINARY_INCOMPLETE;
+    memcpy(&record_length, p, 4);
+    record_length = le32toh(record_length);
+    if(record_length < BINARY_COMMAND_SIZE || record_length > BINARY_MAX_RECORD)
+        return BINARY_BROKEN;
+    if((size_t) (end - p) < record_length)
+        return BINARY_INCOMPLETE;
+    *length = record_length;
+
+    op = (uint8_t) p[4];
+    unit = (uint8_t) p[5];
+    memcpy(&reserved, p + 6, 2);
+    memcpy(&alarm_number, p + 8, 4);
+    memcpy(&interval, p + 12, 4);
+    memcpy(&message_length, p + 16, 4);
+    message_length = le32toh(message_length);
+    command->alarm_number = (int32_t) le32toh((uint32_t) alarm_number);
+    command->interval = (int32_t) le32toh((uint32_t) interval);
+    command->unit = unit;
+    command->message = p + BINARY_COMMAND_SIZE;
+    command->message_length = message_length;
+
+    if(message_length != record_length - BINARY_COMMAND_SIZE || reserved != 0)
+        return PARSE_INCORRECT_FORMAT;
+    if(op == BINARY_OP_SET && unit <= PARSE_UNIT_US)
+        return PARSE_SET;
+    if(op == BINARY_OP_CANCEL && message_length == 0)
+        return PARSE_CANCEL;
+    return PARSE_INCORRECT_FORMAT;
+}
+
+/*
+ * Fills in the status record for an event, keeping at most `max_message`
+ * bytes of its message. Returns how many bytes of the message go after it.
+ */
+size_t binary_status(const alarm_event_t *event, size_t max_message, binary_status_t *status){
+    size_t message_length = 0;
+    uint16_t flags = 0;
+
+    switch(event->type){
+        case ALARM_EVENT_STATS:
+        case ALARM_EVENT_FIRED:
+        case ALARM_EVENT_REPLACED:
+        case ALARM_EVENT_CANCELLED:
+            message_length = event->message_length;
+            break;
+    }
+    if(message_length > max_message){
+        message_length = max_message;
+        flags |= BINARY_FLAG_TRUNCATED;
+    }
+    if(event->replaced)
+        flags |= BINARY_FLAG_REPLACED;
+
+    status->length = htole32((uint32_t) (BINARY_STATUS_SIZE + message_length));
+    status->type = (uint8_t) event->type;
+    status->unit = (uint8_t) event->unit;
+    status->flags = htole16(flags);
+    status->alarm_number = (int32_t) htole32((uint32_t) event->alarm_number);
+    status->last_number = (int32_t) htole32((uint32_t) event->last_number);
+    status->interval = (int32_t) htole32((uint32_t) event->interval);
+    status->message_length = htole32((uint32_t) message_length);
+    status->count = htole64((uint64_t) event->count);
+    status->time = (int64_t) htole64((uint64_t) event->time);
+    return message_length;
+}
@@ -0,0 +1,85 @@
+#ifndef __binary_h
+#define __binary_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include "alarm_engine.h"
+#include "parse.h"
+
+/*
+ * Binary command protocol, for programs feeding the alarm program instead
+ * of people typing at it.
+ *
+ * Commands are records of a fixed header followed by the message, with no
+ * separators and no prompt. Every field is little endian:
+ *
+ *     uint32  length          of the whole record, header included
+ *     uint8   op              BINARY_OP_SET or BINARY_OP_CANCEL
+ *     uint8   unit            a PARSE_UNIT_ constant
+ *     uint16  reserved        0, or the record is a bad one
+ *     int32   alarm_number
+ *     int32   interval        ignored by a cancel
+ *     uint32  message_length  0 for a cancel
+ *     char    message[message_length]
+ *
+ * A set of an alarm that exists replaces it, as with the text commands.
+ * The answers come back as status records, one per event the text mode
+ * prints a line for:
+ *
+ *     uint32  length          of the whole record, header included
+ *     uint8   type            an ALARM_EVENT_ or BINARY_STATUS_ constant
+ *     uint8   unit
+ *     uint16  flags           BINARY_FLAG_ bits
+ *     int32   alarm_number
+ *     int32   last_number
+ *     int32   interval
+ *     uint32  message_length
+ *     uint64  count
+ *     int64   time            seconds since the epoch
+ *     char    message[message_length]
+ *
+ * with the fields filled in as in alarm_event_t. Replies to requests leave
+ * the message out, the client has it already; displays and stats carry it.
+ *
+ * A record that is well framed but makes no sense, such as an unknown op,
+ * is skipped with a BINARY_STATUS_BAD_RECORD, which comes after the status
+ * records for every record before it. A length that cannot be a
+ * record's leaves no way to find the next one, so everything from there on
+ * is ignored, after one BINARY_STATUS_BROKEN.
+ */
+#define BINARY_OP_SET 0
+#define BINARY_OP_CANCEL 1
+
+//Past the ALARM_EVENT_ constants
+#define BINARY_STATUS_BAD_RECORD 64
+#define BINARY_STATUS_BROKEN 65
+
+#define BINARY_FLAG_REPLACED 1
+//The message did not fit in an output record, and was cut short
+#define BINARY_FLAG_TRUNCATED 2
+
+#define BINARY_COMMAND_SIZE 20
+#define BINARY_STATUS_SIZE 40
+#define BINARY_MAX_RECORD (1 << 20)
+
+//What binary_parse() returns besides the PARSE_ constants
+#define BINARY_INCOMPLETE -1
+#define BINARY_BROKEN -2
+
+typedef struct binary_status {
+    uint32_t    length;
+    uint8_t     type;
+    uint8_t     unit;
+    uint16_t    flags;
+    int32_t     alarm_number;
+    int32_t     last_number;
+    int32_t     interval;
+    uint32_t    message_length;
+    uint64_t    count;
+    int64_t     time;
+} binary_status_t;
+
+int binary_parse(const char *p, const char *end, parsed_command_t *command, size_t *length);
+size_t binary_status(const alarm_event_t *event, size_t max_message, binary_status_t *status);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+ * cmd_queue.c
+ *
+ * Bounded MPSC command queue. See cmd_queue.h for an overview.
+ */
+#include "cmd_queue.h"
+#include "errors.h"
+#include "mono_clock.h"
+#include <sched.h>
+#include <stdint.h>
+
+//How many times to retry before going to sleep
+#define SPIN_LIMIT 64
+
+/*
+ * Wakes everyone sleeping on the queue, if anyone is.
+ */
+static void wake_waiters(cmd_queue_t *queue){
+    //Order the caller's update before reading waiters, sleepers do the opposite
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&queue->waiters) > 0){
+        pthread_mutex_lock(&queue->mutex);
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->mutex);
+    }
+}
+
+/*
+ * Capacity is rounded up to a power of two.
+ */
+void cmd_queue_init(cmd_queue_t *queue, size_t capacity){
+    pthread_condattr_t cond_attr;
+    size_t size = 2, i;
+
+    while(size < capacity)
+        size *= 2;
+    queue->cells = (cmd_queue_cell *) malloc(size * sizeof(cmd_queue_cell));
+    if(queue->cells == NULL)
+        errno_abort("Allocate command queue");
+    for(i = 0; i < size; i++)
+        atomic_init(&queue->cells[i].sequence, i);
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    atomic_init(&queue->completed, 0);
+    atomic_init(&queue->waiters, 0);
+    //Timed pops wait on CLOCK_MONOTONIC
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&queue->mutex, NULL) != 0
+       || pthread_cond_init(&queue->cond, &cond_attr) != 0)
+        errno_abort("Init command queue");
+    pthread_condattr_destroy(&cond_attr);
+}
+
+/*
+ * Tries to claim a cell and store data in it. Returns 0 if the queue is full.
+ */
+static int try_push(cmd_queue_t *queue, void *data){
+    cmd_queue_cell *cell;
+    size_t pos, sequence;
+    intptr_t diff;
+
+    pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    while(1){
+        cell = &queue->cells[pos & queue->mask];
+        sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        diff = (intptr_t) sequence - (intptr_t) pos;
+        if(diff == 0){
+            if(atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if(diff < 0){
+            return 0;
+        } else {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->data = data;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return 1;
+}
+
+/*
+ * Posts a command. If the queue is full, the producer is held back until
+ * the consumer makes room.
+ */
+void cmd_queue_push(cmd_queue_t *queue, void *data){
+    int spins = 0;
+
+    while(!try_push(queue, data)){
+        if(++spins < SPIN_LIMIT){
+            sched_yield();
+            continue;
+        }
+        atomic_fetch_add(&queue->waiters, 1);
+        pthread_mutex_lock(&queue->mutex);
+        while(!try_push(queue, data))
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        pthread_mutex_unlock(&queue->mutex);
+        atomic_fetch_sub(&queue->waiters, 1);
+        break;
+    }
+    wake_waiters(queue);
+}
+
+/*
+ * Tries to claim up to count consecutive cells at once. The consumer frees
+ * cells in order and only then moves dequeue_pos, so every cell below
+ * dequeue_pos + capacity is free. Returns the number of commands stored.
+ */
+static size_t try_push_batch(cmd_queue_t *queue, void **items, size_t count){
+    size_t pos, room, i;
+
+    pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    do {
+        room = atomic_load_explicit(&queue->dequeue_pos, memory_order_acquire)
+               + queue->mask + 1 - pos;
+        //A stale pos can make room look negative, the compare and swap then fails
+        if(room > queue->mask + 1)
+            room = 0;
+        if(room == 0)
+            return 0;
+        if(room < count)
+            count = room;
+    } while(!atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + count,
+                memory_order_relaxed, memory_order_relaxed));
+
+    for(i = 0; i < count; i++){
+        queue->cells[(pos + i) & queue->mask].data = items[i];
+        atomic_store_explicit(&queue->cells[(pos + i) & queue->mask].sequence,
+                              pos + i + 1, memory_order_release);
+    }
+    return count;
+}
+
+/*
+ * Posts a batch of commands, in order, claiming as many cells as there is
+ * room for with a single compare and swap. Commands posted by other
+ * producers meanwhile may end up in between.
+ */
+void cmd_queue_push_batch(cmd_queue_t *queue, void **items, size_t count){
+    size_t pushed;
+
+    while(count > 0){
+        pushed = try_push_batch(queue, items, count);
+        if(pushed == 0){
+            //Full, wait for room one command at a time
+            cmd_queue_push(queue, items[0]);
+            pushed = 1;
+        }
+        items += pushed;
+        count -= pushed;
+    }
+    wake_waiters(queue);
+}
+
+/*
+ * Takes up to max commands off the queue, in order. Blocks while the queue
+ * is empty. Only one thread may consume.
+ */
+size_t cmd_queue_pop_batch(cmd_queue_t *queue, void **items, size_t max){
+    return cmd_queue_pop_batch_until(queue, items, max, 0);
+}
+
+/*
+ * Same as cmd_queue_pop_batch(), but blocks no later than `deadline`, in
+ * nanoseconds on CLOCK_MONOTONIC, and returns 0 if nothing came by then. A
+ * deadline of 0 blocks for as long as it takes.
+ */
+size_t cmd_queue_pop_batch_until(cmd_queue_t *queue, void **items, size_t max, uint64_t deadline){
+    struct timespec timeout = mono_timespec(deadline);
+    cmd_queue_cell *cell;
+    size_t pos, count = 0;
+    int status = 0;
+
+    pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    while(1){
+        while(count < max){
+            cell = &queue->cells[pos & queue->mask];
+            if(atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1)
+                break;
+            items[count++] = cell->data;
+            //Hand the cell back to the producers for the next lap
+            atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+            pos++;
+        }
+        if(count > 0 || status == ETIMEDOUT)
+            break;
+
+        //Empty, sleep until a producer posts something, or the deadline
+        atomic_fetch_add(&queue->waiters, 1);
+        pthread_mutex_lock(&queue->mutex);
+        cell = &queue->cells[pos & queue->mask];
+        while(atomic_load_explicit(&cell->sequence, memory_order_acquire) != pos + 1
+              && status != ETIMEDOUT){
+            if(deadline == 0)
+                pthread_cond_wait(&queue->cond, &queue->mutex);
+            else
+                status = pthread_cond_timedwait(&queue->cond, &queue->mutex, &timeout);
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        atomic_fetch_sub(&queue->waiters, 1);
+    }
+    if(count == 0)
+        return 0;
+    //Publishes the freed cells to batch producers
+    atomic_store_explicit(&queue->dequeue_pos, pos, memory_order_release);
+
+    //Producers may be waiting for room
+    wake_waiters(queue);
+    return count;
+}
+
+/*
+ * Called by the consumer once it is done with popped commands.
+ */
+void cmd_queue_complete(cmd_queue_t *queue, size_t count){
+    atomic_fetch_add(&queue->completed, count);
+    wake_waiters(queue);
+}
+
+/*
+ * Blocks until every command posted so far has been completed.
+ */
+void cmd_queue_drain(cmd_queue_t *queue){
+    size_t target = atomic_load(&queue->enqueue_pos);
+
+    atomic_fetch_add(&queue->waiters, 1);
+    pthread_mutex_lock(&queue->mutex);
+    while(atomic_load(&queue->completed) < target)
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    pthread_mutex_unlock(&queue->mutex);
+    atomic_fetch_sub(&queue->waiters, 1);
+}
+
+/*
+ * Number of commands posted but not yet taken by the consumer. Only a
+ * snapshot, as producers and the consumer keep going.
+ */
+size_t cmd_queue_depth(cmd_queue_t *queue){
+    size_t dequeued = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    size_t enqueued = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+}
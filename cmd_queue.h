@@ -0,0 +1,45 @@
+#ifndef __cmd_queue_h
+#define __cmd_queue_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*
+ * Bounded lock-free multi-producer, single-consumer command queue.
+ *
+ * Each cell carries a sequence number telling producers and the consumer
+ * whose turn it is, so producers only contend on a single compare and swap
+ * of the enqueue position. The mutex and condition variable are only used
+ * to sleep: the consumer when the queue is empty, producers when it is full
+ * (backpressure), and anyone waiting for the queue to drain.
+ */
+#define CACHE_LINE 64
+
+typedef struct cmd_queue_cell {
+    atomic_size_t   sequence;
+    void *          data;
+} cmd_queue_cell;
+
+typedef struct cmd_queue {
+    cmd_queue_cell *                    cells;
+    size_t                              mask;
+    _Alignas(CACHE_LINE) atomic_size_t  enqueue_pos;
+    _Alignas(CACHE_LINE) atomic_size_t  dequeue_pos;
+    atomic_size_t                       completed;
+    _Alignas(CACHE_LINE) atomic_int     waiters;
+    pthread_mutex_t                     mutex;
+    pthread_cond_t                      cond;
+} cmd_queue_t;
+
+void cmd_queue_init(cmd_queue_t *queue, size_t capacity);
+void cmd_queue_push(cmd_queue_t *queue, void *data);
+void cmd_queue_push_batch(cmd_queue_t *queue, void **items, size_t count);
+size_t cmd_queue_pop_batch(cmd_queue_t *queue, void **items, size_t max);
+size_t cmd_queue_pop_batch_until(cmd_queue_t *queue, void **items, size_t max, uint64_t deadline);
+void cmd_queue_complete(cmd_queue_t *queue, size_t count);
+void cmd_queue_drain(cmd_queue_t *queue);
+size_t cmd_queue_depth(cmd_queue_t *queue);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * epoch.c
+ *
+ * Epoch based reclamation. See epoch.h for an overview.
+ *
+ * A record's state is the epoch its thread entered at, shifted left by
+ * one, with the low bit set while the thread is inside a critical section.
+ * The global epoch only moves forward once every active reader has caught
+ * up with it, so anything retired at epoch e is unreachable once the
+ * global epoch reaches e + 2.
+ */
+#include "epoch.h"
+#include "errors.h"
+#include <pthread.h>
+
+typedef struct retired {
+    void *      object;
+    void        (*destroy)(void *object);
+    uint64_t    epoch;
+} retired_t;
+
+static atomic_uint_fast64_t global_epoch = 1;
+static epoch_record_t records[EPOCH_MAX_THREADS];
+static atomic_int record_count = 0;
+static __thread epoch_record_t *local_record = NULL;
+
+//Retired objects, oldest first. Only writers touch these.
+static pthread_mutex_t retire_mutex = PTHREAD_MUTEX_INITIALIZER;
+static retired_t *retire_list = NULL;
+static size_t retire_count = 0;
+static size_t retire_capacity = 0;
+
+static epoch_record_t * epoch_record(){
+    int index;
+
+    if(local_record == NULL){
+        index = atomic_fetch_add(&record_count, 1);
+        if(index >= EPOCH_MAX_THREADS)
+            err_abort(1, "Too many epoch readers");
+        local_record = &records[index];
+    }
+    return local_record;
+}
+
+void epoch_enter(void){
+    epoch_record_t *record = epoch_record();
+
+    atomic_store_explicit(&record->state,
+                          (atomic_load_explicit(&global_epoch, memory_order_relaxed) << 1) | 1,
+                          memory_order_relaxed);
+    //The record must be visible before any protected pointer is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void){
+    atomic_store_explicit(&epoch_record()->state, 0, memory_order_release);
+}
+
+void epoch_retire(void *object, void (*destroy)(void *object)){
+    retired_t *grown;
+
+    if(object == NULL)
+        return;
+    //The object was unpublished before this point
+    atomic_thread_fence(memory_order_seq_cst);
+
+    pthread_mutex_lock(&retire_mutex);
+    if(retire_count == retire_capacity){
+        retire_capacity = retire_capacity ? retire_capacity * 2 : 256;
+        grown = (retired_t *) realloc(retire_list, retire_capacity * sizeof(retired_t));
+        if(grown == NULL)
+            errno_abort("Grow retire list");
+        retire_list = grown;
+    }
+    retire_list[retire_count].object = object;
+    retire_list[retire_count].destroy = destroy;
+    retire_list[retire_count].epoch = atomic_load(&global_epoch);
+    retire_count++;
+    pthread_mutex_unlock(&retire_mutex);
+}
+
+/*
+ * Tries to move the global epoch forward, then destroys what is safe.
+ */
+void epoch_reclaim(void){
+    uint64_t epoch, state;
+    size_t i, freed;
+    int count, index;
+
+    pthread_mutex_lock(&retire_mutex);
+    if(retire_count == 0){
+        pthread_mutex_unlock(&retire_mutex);
+        return;
+    }
+
+    epoch = atomic_load(&global_epoch);
+    count = atomic_load(&record_count);
+    if(count > EPOCH_MAX_THREADS)
+        count = EPOCH_MAX_THREADS;
+    for(index = 0; index < count; index++){
+        state = atomic_load(&records[index].state);
+        if((state & 1) && (state >> 1) != epoch)
+            break;
+    }
+    if(index == count){
+        atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1);
+        epoch = atomic_load(&global_epoch);
+    }
+
+    //The list is in retire order, so stop at the first object still in use
+    for(freed = 0; freed < retire_count; freed++){
+        if(retire_list[freed].epoch + 2 > epoch)
+            break;
+        retire_list[freed].destroy(retire_list[freed].object);
+    }
+    for(i = freed; i < retire_count; i++)
+        retire_list[i - freed] = retire_list[i];
+    retire_count -= freed;
+    pthread_mutex_unlock(&retire_mutex);
+}
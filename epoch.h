@@ -0,0 +1,32 @@
+#ifndef __epoch_h
+#define __epoch_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Epoch based reclamation.
+ *
+ * Readers bracket their accesses with epoch_enter() and epoch_exit(). The
+ * only thing they write is their own, cache line sized, epoch record, so
+ * readers never contend with each other or with writers.
+ *
+ * Writers publish a new version of an object with an atomic pointer store,
+ * then hand the old version to epoch_retire(). It is destroyed by a later
+ * epoch_reclaim(), once every reader that might still see it has left its
+ * critical section.
+ */
+#define EPOCH_MAX_THREADS 256
+#define EPOCH_CACHE_LINE 64
+
+typedef struct epoch_record {
+    _Alignas(EPOCH_CACHE_LINE) atomic_uint_fast64_t state;
+} epoch_record_t;
+
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *object, void (*destroy)(void *object));
+void epoch_reclaim(void);
+
+#endif
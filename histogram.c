@@ -0,0 +1,86 @@
+/*
+ * histogram.c
+ *
+ * Log-linear histogram. See histogram.h for an overview.
+ */
+#include "histogram.h"
+
+static int bucket_of(uint64_t value){
+    int top;
+
+    if(value < HISTOGRAM_SUB_BUCKETS)
+        return (int) value;
+    top = 63 - __builtin_clzll(value);
+    return (top - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS
+           + (int) ((value >> (top - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/*
+ * The middle of the range of values a bucket counts.
+ */
+static uint64_t value_of(int bucket){
+    int shift;
+    uint64_t low;
+
+    if(bucket < HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t) bucket;
+    shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+    low = (uint64_t) (HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+    return low + (((uint64_t) 1 << shift) >> 1);
+}
+
+void histogram_init(histogram_t *histogram){
+    int i;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_init(&histogram->counts[i], 0);
+    atomic_init(&histogram->total, 0);
+    atomic_init(&histogram->max, 0);
+}
+
+void histogram_record(histogram_t *histogram, uint64_t value){
+    atomic_fetch_add_explicit(&histogram->counts[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    if(value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+void histogram_merge(histogram_t *into, histogram_t *from){
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    int i;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_fetch_add_explicit(&into->counts[i],
+                                  atomic_load_explicit(&from->counts[i], memory_order_relaxed),
+                                  memory_order_relaxed);
+    atomic_fetch_add_explicit(&into->total,
+                              atomic_load_explicit(&from->total, memory_order_relaxed),
+                              memory_order_relaxed);
+    if(max > atomic_load_explicit(&into->max, memory_order_relaxed))
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+}
+
+/*
+ * Returns the value below which `percentile` percent of the values fall,
+ * or 0 if nothing was recorded.
+ */
+uint64_t histogram_percentile(histogram_t *histogram, double percentile){
+    uint64_t total = 0, rank, seen = 0, max;
+    int i;
+
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+    if(total == 0)
+        return 0;
+    rank = (uint64_t) (percentile / 100.0 * (double) total);
+    if(rank >= total)
+        rank = total - 1;
+    max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if(seen > rank)
+            break;
+    }
+    //The top bucket's middle may lie above anything actually recorded
+    return value_of(i) < max ? value_of(i) : max;
+}
@@ -0,0 +1,32 @@
+#ifndef __histogram_h
+#define __histogram_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Log-linear histogram of 64 bit values.
+ *
+ * Values below 2^HISTOGRAM_SUB_BITS get a bucket each. Above that, every
+ * power of two is split into 2^HISTOGRAM_SUB_BITS buckets, so a percentile
+ * is off by at most 1/32 of its value.
+ *
+ * Counts are relaxed atomics: a histogram should have a single writer,
+ * but can be read or merged by anyone at any time.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct histogram {
+    atomic_uint_fast64_t    counts[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t    total;
+    atomic_uint_fast64_t    max;
+} histogram_t;
+
+void histogram_init(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+void histogram_merge(histogram_t *into, histogram_t *from);
+uint64_t histogram_percentile(histogram_t *histogram, double percentile);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ * journal.c
+ *
+ * Snapshot and journal of the alarm store. See journal.h for an overview.
+ *
+ * Each alarm thread fills a `buffer` of its own, and journal_commit() moves
+ * it onto the writer's job list. Jobs are written in the order they were
+ * committed, so a snapshot lands after every record it includes, and before
+ * any record that follows it.
+ */
+#include "journal.h"
+#include "errors.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define JOURNAL_MAGIC "ALRMJRNL"
+#define SNAPSHOT_MAGIC "ALRMSNAP"
+#define SNAPSHOT_VERSION 2
+#define BUFFER_SIZE (1 << 16)
+#define WRITE_BATCH 64
+
+#define JOB_RECORDS 0
+#define JOB_SNAPSHOT 1
+
+//Version 1 snapshots had fixed size entries, with room for 128 bytes of message
+#define SNAPSHOT_V1_MESSAGE 128
+
+typedef struct snapshot_v1_entry {
+    snapshot_entry_t    entry;
+    char                message[SNAPSHOT_V1_MESSAGE];
+} snapshot_v1_entry_t;
+
+#define PADDED(length) (((length) + 3) & ~(size_t) 3)
+
+typedef struct journal_header {
+    char        magic[8];
+    uint64_t    generation;
+} journal_header_t;
+
+typedef struct journal_job {
+    struct journal_job *    next;
+    int                     kind;
+    char *                  data;
+    size_t                  length;
+    uint64_t                generation;
+} journal_job_t;
+
+static uint32_t crc_table[256];
+
+static char journal_path[PATH_MAX];
+static char snapshot_path[PATH_MAX];
+static char directory_path[PATH_MAX];
+static int journal_fd = -1;
+
+//Owned by each alarm thread
+static __thread char *buffer = NULL;
+static __thread size_t buffer_used = 0, buffer_size = 0;
+static __thread size_t buffer_records = 0;
+static atomic_size_t records = 0;
+//Owned by whoever is taking a snapshot, one at a time
+static uint64_t generation = 0;
+
+//Protected by journal_mutex
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static journal_job_t *jobs = NULL, *jobs_last = NULL;
+static size_t pending = 0;
+static uint64_t submitted = 0, completed = 0;
+
+static void crc_init(void){
+    uint32_t c;
+    int i, k;
+
+    for(i = 0; i < 256; i++){
+        c = (uint32_t) i;
+        for(k = 0; k < 8; k++)
+            c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const char *data, size_t length){
+    uint32_t c = 0xFFFFFFFFu;
+    size_t i;
+
+    for(i = 0; i < length; i++)
+        c = crc_table[(c ^ (uint8_t) data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static void write_all(int fd, const char *data, size_t length){
+    ssize_t written;
+
+    while(length > 0){
+        written = write(fd, data, length);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            errno_abort("Write journal");
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+}
+
+/*
+ * Replaces the file at `path` with `length` bytes of `data`, so that a
+ * crash leaves either the old file or the new one.
+ */
+static void replace_file(const char *path, const char *data, size_t length){
+    char temporary[PATH_MAX + 8];
+    int fd;
+
+    snprintf(temporary, sizeof(temporary), "%s.tmp", path);
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+        errno_abort("Create state file");
+    write_all(fd, data, length);
+    if(fsync(fd) < 0)
+        errno_abort("Sync state file");
+    close(fd);
+    if(rename(temporary, path) < 0)
+        errno_abort("Rename state file");
+    fd = open(directory_path, O_RDONLY);
+    if(fd >= 0){
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Starts an empty journal of the given generation.
+ */
+static void journal_rotate(uint64_t next){
+    journal_header_t header;
+
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.generation = next;
+    replace_file(journal_path, (const char *) &header, sizeof(header));
+    if(journal_fd >= 0)
+        close(journal_fd);
+    journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+    if(journal_fd < 0)
+        errno_abort("Open journal");
+}
+
+/*
+ * Writes a run of record jobs, up to WRITE_BATCH of them per writev().
+ */
+static void write_records(journal_job_t *job, journal_job_t *end){
+    struct iovec iov[WRITE_BATCH], *next;
+    ssize_t written;
+    int count;
+
+    while(job != end){
+        for(count = 0; job != end && count < WRITE_BATCH; job = job->next){
+            iov[count].iov_base = job->data;
+            iov[count].iov_len = job->length;
+            count++;
+        }
+        next = iov;
+        while(count > 0){
+            written = writev(journal_fd, next, count);
+            if(written < 0){
+                if(errno == EINTR)
+                    continue;
+                errno_abort("Write journal");
+            }
+            while(count > 0 && (size_t) written >= next->iov_len){
+                written -= (ssize_t) next->iov_len;
+                next++;
+                count--;
+            }
+            if(count > 0){
+                next->iov_base = (char *) next->iov_base + written;
+                next->iov_len -= (size_t) written;
+            }
+        }
+    }
+}
+
+static void * journal_writer(void *arg){
+    journal_job_t *batch, *job, *run, *next;
+    size_t bytes;
+    uint64_t count;
+
+    while(1){
+        pthread_mutex_lock(&journal_mutex);
+        while(jobs == NULL)
+            pthread_cond_wait(&journal_cond, &journal_mutex);
+        batch = jobs;
+        jobs = jobs_last = NULL;
+        pthread_mutex_unlock(&journal_mutex);
+
+        bytes = 0;
+        count = 0;
+        for(job = batch; job != NULL; ){
+            if(job->kind == JOB_SNAPSHOT){
+                //Everything before the snapshot is in it, so the old journal can go
+                replace_file(snapshot_path, job->data, job->length);
+                journal_rotate(job->generation);
+                next = job->next;
+            } else {
+                for(run = job; run != NULL && run->kind == JOB_RECORDS; run = run->next)
+                    ;
+                write_records(job, run);
+                if(fdatasync(journal_fd) < 0)
+                    errno_abort("Sync journal");
+                next = run;
+            }
+            for(; job != next; job = run){
+                run = job->next;
+                bytes += job->length;
+                count++;
+                free(job->data);
+                free(job);
+            }
+        }
+
+        pthread_mutex_lock(&journal_mutex);
+        pending -= bytes;
+        completed += count;
+        pthread_cond_broadcast(&journal_cond);
+        pthread_mutex_unlock(&journal_mutex);
+    }
+    return NULL;
+}
+
+static void submit(int kind, char *data, size_t length, uint64_t job_generation){
+    journal_job_t *job = (journal_job_t *) malloc(sizeof(journal_job_t));
+
+    if(job == NULL)
+        errno_abort("Allocate journal job");
+    job->next = NULL;
+    job->kind = kind;
+    job->data = data;
+    job->length = length;
+    job->generation = job_generation;
+
+    pthread_mutex_lock(&journal_mutex);
+    //Backpressure: only wait for the disk when the writer is far behind
+    while(pending > JOURNAL_MAX_PENDING)
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    if(jobs == NULL)
+        jobs = job;
+    else
+        jobs_last->next = job;
+    jobs_last = job;
+    pending += length;
+    submitted++;
+    pthread_cond_broadcast(&journal_cond);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/*
+ * Applies the snapshot, if there is one. Returns its generation, or 0.
+ */
+static uint64_t load_snapshot(journal_apply_t apply, size_t *applied){
+    snapshot_header_t *header;
+    snapshot_v1_entry_t *old;
+    snapshot_entry_t entry;
+    struct stat info;
+    uint64_t found = 0, i;
+    size_t offset, size;
+    char *map;
+    int fd, readable = 0;
+
+    fd = open(snapshot_path, O_RDONLY);
+    if(fd < 0)
+        return 0;
+    if(fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(snapshot_header_t)){
+        close(fd);
+        return 0;
+    }
+    map = (char *) mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        errno_abort("Map snapshot");
+
+    header = (snapshot_header_t *) map;
+    size = (size_t) info.st_size;
+    if(memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0){
+        //Not a snapshot
+    } else if(header->version == SNAPSHOT_VERSION
+              && header->entry_size == sizeof(snapshot_entry_t)){
+        offset = sizeof(snapshot_header_t);
+        for(i = 0; i < header->count && offset + sizeof(entry) <= size; i++){
+            memcpy(&entry, map + offset, sizeof(entry));
+            if(entry.length > size - offset - sizeof(entry))
+                break;
+            apply(JOURNAL_SET, entry.alarm_number, entry.interval, entry.unit,
+                  map + offset + sizeof(entry), entry.length);
+            offset += sizeof(entry) + PADDED(entry.length);
+        }
+        readable = i == header->count;
+    } else if(header->version == 1
+              && header->entry_size == sizeof(snapshot_v1_entry_t)
+              && header->count <= (size - sizeof(snapshot_header_t))
+                                  / sizeof(snapshot_v1_entry_t)){
+        old = (snapshot_v1_entry_t *) (map + sizeof(snapshot_header_t));
+        for(i = 0; i < header->count; i++){
+            if(old[i].entry.length > SNAPSHOT_V1_MESSAGE)
+                continue;
+            apply(JOURNAL_SET, old[i].entry.alarm_number, old[i].entry.interval,
+                  old[i].entry.unit, old[i].message, old[i].entry.length);
+        }
+        readable = 1;
+    }
+    if(readable){
+        *applied += header->count;
+        found = header->generation;
+    } else {
+        fprintf(stderr, "Ignoring unreadable snapshot %s\n", snapshot_path);
+    }
+    munmap(map, (size_t) info.st_size);
+    return found;
+}
+
+/*
+ * Replays the journal, if it follows the snapshot. Returns the journal's
+ * generation, and leaves journal_fd open past its last good record.
+ */
+static uint64_t replay_journal(journal_apply_t apply, uint64_t snapshot_generation,
+                               size_t *applied){
+    journal_header_t header;
+    journal_record_t record;
+    struct stat info;
+    size_t offset, valid, header_size;
+    uint32_t length;
+    char *map;
+    int fd;
+
+    fd = open(journal_path, O_RDWR);
+    if(fd < 0 || fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(journal_header_t)){
+        if(fd >= 0)
+            close(fd);
+        journal_rotate(snapshot_generation);
+        return snapshot_generation;
+    }
+    map = (char *) mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED)
+        errno_abort("Map journal");
+    memcpy(&header, map, sizeof(header));
+    //A journal older than the snapshot is already in it
+    if(memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0
+       || header.generation < snapshot_generation){
+        munmap(map, (size_t) info.st_size);
+        close(fd);
+        journal_rotate(snapshot_generation);
+        return snapshot_generation;
+    }
+
+    offset = valid = sizeof(journal_header_t);
+    while(offset + sizeof(record) <= (size_t) info.st_size){
+        memcpy(&record, map + offset, sizeof(record));
+        header_size = sizeof(record);
+        length = record.length;
+        if(length == JOURNAL_LONG_MESSAGE){
+            if(offset + sizeof(record) + sizeof(length) > (size_t) info.st_size)
+                break;
+            memcpy(&length, map + offset + sizeof(record), sizeof(length));
+            header_size += sizeof(length);
+        }
+        if(length > (size_t) info.st_size - offset - header_size
+           || crc32(map + offset + sizeof(record.crc),
+                    header_size - sizeof(record.crc) + length) != record.crc)
+            break;
+        apply(record.type, record.alarm_number, record.interval, record.unit,
+              map + offset + header_size, length);
+        (*applied)++;
+        offset += header_size + length;
+        valid = offset;
+    }
+    munmap(map, (size_t) info.st_size);
+
+    //Drop whatever a crash left half written
+    if(valid < (size_t) info.st_size && ftruncate(fd, (off_t) valid) < 0)
+        errno_abort("Truncate journal");
+    close(fd);
+    journal_fd = open(journal_path, O_WRONLY | O_APPEND);
+    if(journal_fd < 0)
+        errno_abort("Open journal");
+    return header.generation;
+}
+
+/*
+ * Recovers the state kept in `directory`, creating it if needed, then
+ * starts the writer. Returns the number of snapshot entries and journal
+ * records applied.
+ */
+size_t journal_open(const char *directory, journal_apply_t apply){
+    uint64_t snapshot_generation;
+    size_t applied = 0;
+    pthread_t thread;
+    int status;
+
+    crc_init();
+    if(mkdir(directory, 0755) < 0 && errno != EEXIST)
+        errno_abort("Create state directory");
+    snprintf(directory_path, sizeof(directory_path), "%s", directory);
+    snprintf(journal_path, sizeof(journal_path), "%s/journal", directory);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/snapshot", directory);
+
+    snapshot_generation = load_snapshot(apply, &applied);
+    generation = replay_journal(apply, snapshot_generation, &applied);
+    atomic_store(&records, applied);
+
+    status = pthread_create(&thread, NULL, journal_writer, NULL);
+    if(status != 0)
+        err_abort(status, "Create journal writer");
+    return applied;
+}
+
+/*
+ * Appends a record. It is written at the next journal_commit().
+ */
+void journal_append(int type, int alarm_number, int interval, int unit,
+                    const char *message, size_t length){
+    journal_record_t record;
+    size_t header_size = sizeof(record);
+    uint32_t long_length = (uint32_t) length;
+
+    if(length >= JOURNAL_LONG_MESSAGE)
+        header_size += sizeof(long_length);
+    if(buffer_used + header_size + length > buffer_size){
+        if(buffer_size == 0)
+            buffer_size = BUFFER_SIZE;
+        while(buffer_used + header_size + length > buffer_size)
+            buffer_size *= 2;
+        buffer = (char *) realloc(buffer, buffer_size);
+        if(buffer == NULL)
+            errno_abort("Grow journal buffer");
+    }
+
+    record.type = (uint8_t) type;
+    record.unit = (uint8_t) unit;
+    record.length = (uint16_t) (length >= JOURNAL_LONG_MESSAGE ? JOURNAL_LONG_MESSAGE : length);
+    record.alarm_number = alarm_number;
+    record.interval = interval;
+    if(length >= JOURNAL_LONG_MESSAGE)
+        memcpy(buffer + buffer_used + sizeof(record), &long_length, sizeof(long_length));
+    //Cancels have no message
+    if(length > 0)
+        memcpy(buffer + buffer_used + header_size, message, length);
+    memcpy(buffer + buffer_used, &record, sizeof(record));
+    record.crc = crc32(buffer + buffer_used + sizeof(record.crc),
+                       header_size - sizeof(record.crc) + length);
+    memcpy(buffer + buffer_used, &record.crc, sizeof(record.crc));
+    buffer_used += header_size + length;
+    buffer_records++;
+}
+
+/*
+ * Hands the records the calling thread appended so far to the writer.
+ */
+void journal_commit(void){
+    if(buffer_used == 0)
+        return;
+    submit(JOB_RECORDS, buffer, buffer_used, 0);
+    atomic_fetch_add(&records, buffer_records);
+    buffer_records = 0;
+    buffer_size = BUFFER_SIZE;
+    buffer_used = 0;
+    buffer = (char *) malloc(buffer_size);
+    if(buffer == NULL)
+        errno_abort("Allocate journal buffer");
+}
+
+/*
+ * Blocks until everything committed so far is on disk.
+ */
+void journal_flush(void){
+    uint64_t target;
+
+    pthread_mutex_lock(&journal_mutex);
+    target = submitted;
+    while(completed < target)
+        pthread_cond_wait(&journal_cond, &journal_mutex);
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+/*
+ * Records committed since the last snapshot, or since recovery.
+ */
+size_t journal_records(void){
+    return atomic_load(&records);
+}
+
+/*
+ * Adds an alarm to a part of a snapshot in the making. A part starts out
+ * zeroed.
+ */
+void journal_snapshot_add(snapshot_part_t *part, int alarm_number, int interval, int unit,
+                          const char *message, size_t length){
+    snapshot_entry_t entry;
+    size_t size = sizeof(entry) + PADDED(length);
+
+    if(part->used + size > part->size){
+        if(part->size == 0)
+            part->size = BUFFER_SIZE;
+        while(part->used + size > part->size)
+            part->size *= 2;
+        part->data = (char *) realloc(part->data, part->size);
+        if(part->data == NULL)
+            errno_abort("Grow snapshot");
+    }
+    entry.alarm_number = alarm_number;
+    entry.interval = interval;
+    entry.unit = unit;
+    entry.length = (uint32_t) length;
+    memcpy(part->data + part->used, &entry, sizeof(entry));
+    memcpy(part->data + part->used + sizeof(entry), message, length);
+    //Zero the padding rather than write out whatever was there
+    memset(part->data + part->used + sizeof(entry) + length, 0, PADDED(length) - length);
+    part->used += size;
+    part->count++;
+}
+
+/*
+ * Joins the parts of a snapshot, frees them, and hands the snapshot to the
+ * writer. Records the snapshot includes may be committed before, and go in
+ * the old journal; records it does not include must only be committed
+ * after, so that they land in the new journal.
+ */
+void journal_snapshot_commit(snapshot_part_t *parts, int count){
+    snapshot_header_t *header;
+    size_t length = sizeof(snapshot_header_t), entries = 0;
+    char *snapshot;
+    int i;
+
+    for(i = 0; i < count; i++)
+        length += parts[i].used;
+    snapshot = (char *) malloc(length);
+    if(snapshot == NULL)
+        errno_abort("Allocate snapshot");
+    length = sizeof(snapshot_header_t);
+    for(i = 0; i < count; i++){
+        if(parts[i].used > 0)
+            memcpy(snapshot + length, parts[i].data, parts[i].used);
+        length += parts[i].used;
+        entries += parts[i].count;
+        free(parts[i].data);
+        memset(&parts[i], 0, sizeof(parts[i]));
+    }
+
+    generation++;
+    header = (snapshot_header_t *) snapshot;
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->entry_size = sizeof(snapshot_entry_t);
+    header->generation = generation;
+    header->count = entries;
+    submit(JOB_SNAPSHOT, snapshot, length, generation);
+    atomic_store(&records, 0);
+}
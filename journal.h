@@ -0,0 +1,93 @@
+#ifndef __journal_h
+#define __journal_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Persistent alarm state: a snapshot plus an append-only journal.
+ *
+ * The alarm threads append a record for every accepted change to the alarm
+ * store, each to a buffer of its own, and hand what they appended to the
+ * journal writer thread at the end of each batch with journal_commit(). The
+ * writer takes everything handed to it since its last write, writes it with
+ * one writev() and syncs it with one fdatasync(): a group commit, so ingest
+ * never waits for the disk unless the writer falls more than
+ * JOURNAL_MAX_PENDING bytes behind.
+ *
+ * Every so often the alarm threads dump the whole store into a snapshot.
+ * The writer stores it next to the journal and then starts an empty
+ * journal, so the journal only ever holds what came after the snapshot.
+ * Both files carry a generation number to tell whether they belong
+ * together.
+ *
+ * A snapshot is a header followed by entries, each an entry header and the
+ * message, padded to 4 bytes, so that it can be mapped and read in place
+ * when restarting. Threads build their parts of a snapshot with
+ * journal_snapshot_add(), and journal_snapshot_commit() joins them. Journal
+ * records are a header, protected by a CRC, followed by the message; a
+ * message of JOURNAL_LONG_MESSAGE bytes or more has its length in a 32 bit
+ * word between the two. A torn record at the end of the journal is dropped
+ * on recovery.
+ *
+ * Records are applied last writer wins, per alarm number, so replaying a
+ * journal on top of a snapshot that already includes it is harmless.
+ * Commits from different threads interleave, so the records for any one
+ * alarm number must all come from the same thread.
+ */
+#define JOURNAL_SET 1
+#define JOURNAL_REPLACE 2
+#define JOURNAL_CANCEL 3
+
+#define JOURNAL_LONG_MESSAGE 0xFFFF
+#define JOURNAL_MAX_PENDING (64 << 20)
+
+typedef struct journal_record {
+    uint32_t    crc;
+    uint8_t     type;
+    uint8_t     unit;
+    uint16_t    length;
+    int32_t     alarm_number;
+    int32_t     interval;
+} journal_record_t;
+
+typedef struct snapshot_header {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    entry_size;
+    uint64_t    generation;
+    uint64_t    count;
+} snapshot_header_t;
+
+typedef struct snapshot_entry {
+    int32_t     alarm_number;
+    int32_t     interval;
+    int32_t     unit;
+    uint32_t    length;
+} snapshot_entry_t;
+
+typedef struct snapshot_part {
+    char *      data;
+    size_t      used;
+    size_t      size;
+    size_t      count;
+} snapshot_part_t;
+
+/*
+ * Called for every alarm found while recovering, in order. `message` is
+ * not terminated, and is unused for JOURNAL_CANCEL.
+ */
+typedef void (*journal_apply_t)(int type, int alarm_number, int interval, int unit,
+                                const char *message, size_t length);
+
+size_t journal_open(const char *directory, journal_apply_t apply);
+void journal_append(int type, int alarm_number, int interval, int unit,
+                    const char *message, size_t length);
+void journal_commit(void);
+void journal_flush(void);
+size_t journal_records(void);
+void journal_snapshot_add(snapshot_part_t *part, int alarm_number, int interval, int unit,
+                          const char *message, size_t length);
+void journal_snapshot_commit(snapshot_part_t *parts, int count);
+
+#endif
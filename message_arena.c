@@ -0,0 +1,218 @@
+/*
+ * message_arena.c
+ *
+ * Interned alarm messages. See message_arena.h for an overview.
+ */
+#include "message_arena.h"
+#include "slab.h"
+#include "errors.h"
+
+/*
+ * FNV-1a. Messages are short, so anything fancier would not pay off.
+ */
+static uint32_t hash_text(const char *text, size_t length){
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for(i = 0; i < length; i++)
+        hash = (hash ^ (uint8_t) text[i]) * 16777619u;
+    return hash;
+}
+
+static slab_cache_t caches[MESSAGE_CLASSES];
+static pthread_once_t caches_once = PTHREAD_ONCE_INIT;
+
+static void caches_init(void){
+    static const char *names[MESSAGE_CLASSES] = {
+        "message_16", "message_32", "message_64", "message_128", "message_256"
+    };
+    int size_class;
+
+    for(size_class = 0; size_class < MESSAGE_CLASSES; size_class++)
+        slab_init(&caches[size_class], names[size_class],
+                  (size_t) MESSAGE_MIN_BLOCK << size_class);
+}
+
+/*
+ * Bytes a message of `length` takes, header and terminator included.
+ */
+static size_t message_size(size_t length){
+    return sizeof(message_t) + length + 1;
+}
+
+/*
+ * The slab cache a message of `length` comes from, or MESSAGE_CLASSES if
+ * it is too long for any.
+ */
+static int class_of(size_t length){
+    int size_class = 0;
+
+    while(size_class < MESSAGE_CLASSES
+          && ((size_t) MESSAGE_MIN_BLOCK << size_class) < message_size(length))
+        size_class++;
+    return size_class;
+}
+
+static size_t block_size(size_t length){
+    int size_class = class_of(length);
+
+    return size_class < MESSAGE_CLASSES ? (size_t) MESSAGE_MIN_BLOCK << size_class
+                                        : message_size(length);
+}
+
+static message_t * block_alloc(size_t length){
+    int size_class = class_of(length);
+    message_t *message;
+
+    if(size_class < MESSAGE_CLASSES)
+        message = (message_t *) slab_alloc(&caches[size_class]);
+    else if((message = (message_t *) malloc(message_size(length))) == NULL)
+        errno_abort("Allocate message");
+    return message;
+}
+
+/*
+ * Gives back a reference to a message, from any thread, freeing it with
+ * the last one.
+ */
+void message_drop(message_t *message){
+    int size_class;
+
+    if(atomic_fetch_sub_explicit(&message->holders, 1, memory_order_acq_rel) != 1)
+        return;
+    size_class = class_of(message->length);
+    if(size_class < MESSAGE_CLASSES)
+        slab_free(&caches[size_class], message);
+    else
+        free(message);
+}
+
+static void index_insert(message_arena_t *arena, uint32_t handle){
+    size_t mask = arena->index_capacity - 1;
+    size_t i = arena->entries[handle].hash & mask;
+
+    while(arena->index[i] != 0)
+        i = (i + 1) & mask;
+    arena->index[i] = handle;
+}
+
+static void index_grow(message_arena_t *arena){
+    uint32_t *old = arena->index;
+    size_t old_capacity = arena->index_capacity, i;
+
+    arena->index_capacity = old_capacity * 2;
+    arena->index = (uint32_t *) calloc(arena->index_capacity, sizeof(uint32_t));
+    if(arena->index == NULL)
+        errno_abort("Grow message index");
+    for(i = 0; i < old_capacity; i++){
+        if(old[i] != 0)
+            index_insert(arena, old[i]);
+    }
+    free(old);
+}
+
+/*
+ * Same backward shift deletion as alarm_store, so there are no tombstones.
+ */
+static void index_remove(message_arena_t *arena, uint32_t handle){
+    size_t mask = arena->index_capacity - 1, i, j, home;
+
+    i = arena->entries[handle].hash & mask;
+    while(arena->index[i] != handle)
+        i = (i + 1) & mask;
+
+    j = i;
+    while(1){
+        arena->index[i] = 0;
+        do {
+            j = (j + 1) & mask;
+            if(arena->index[j] == 0)
+                return;
+            home = arena->entries[arena->index[j]].hash & mask;
+        } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        arena->index[i] = arena->index[j];
+        i = j;
+    }
+}
+
+void message_arena_init(message_arena_t *arena){
+    pthread_once(&caches_once, caches_init);
+    memset(arena, 0, sizeof(*arena));
+    arena->entry_capacity = 1024;
+    arena->entries = (message_entry_t *) calloc(arena->entry_capacity, sizeof(message_entry_t));
+    arena->index_capacity = 2048;
+    arena->index = (uint32_t *) calloc(arena->index_capacity, sizeof(uint32_t));
+    if(arena->entries == NULL || arena->index == NULL)
+        errno_abort("Allocate message arena");
+    //Handle 0 stands for no message
+    arena->entry_count = 1;
+}
+
+/*
+ * Returns the handle of a message with the given text, adding a reference
+ * to it.
+ */
+uint32_t message_intern(message_arena_t *arena, const char *text, size_t length){
+    size_t mask = arena->index_capacity - 1, i;
+    message_entry_t *entry;
+    uint32_t hash, handle;
+
+    hash = hash_text(text, length);
+    for(i = hash & mask; (handle = arena->index[i]) != 0; i = (i + 1) & mask){
+        entry = &arena->entries[handle];
+        if(entry->hash == hash && entry->message->length == length
+           && memcmp(entry->message->text, text, length) == 0){
+            entry->references++;
+            return handle;
+        }
+    }
+
+    if(arena->free_entries != 0){
+        handle = arena->free_entries;
+        arena->free_entries = arena->entries[handle].hash;
+    } else {
+        if(arena->entry_count == arena->entry_capacity){
+            arena->entry_capacity *= 2;
+            arena->entries = (message_entry_t *) realloc(arena->entries,
+                             arena->entry_capacity * sizeof(message_entry_t));
+            if(arena->entries == NULL)
+                errno_abort("Grow message arena");
+        }
+        handle = arena->entry_count++;
+    }
+
+    entry = &arena->entries[handle];
+    entry->message = block_alloc(length);
+    //The arena's own reference, given back once no alarm refers to it
+    atomic_init(&entry->message->holders, 1);
+    entry->message->length = (uint32_t) length;
+    memcpy(entry->message->text, text, length);
+    entry->message->text[length] = '\0';
+    entry->hash = hash;
+    entry->references = 1;
+    arena->bytes += block_size(length);
+
+    if((arena->live + 1) * 2 > arena->index_capacity)
+        index_grow(arena);
+    index_insert(arena, handle);
+    arena->live++;
+    return handle;
+}
+
+/*
+ * Drops a reference, freeing the message once nothing refers to it.
+ */
+void message_release(message_arena_t *arena, uint32_t handle){
+    message_entry_t *entry = &arena->entries[handle];
+
+    if(handle == 0 || --entry->references > 0)
+        return;
+    index_remove(arena, handle);
+    arena->bytes -= block_size(entry->message->length);
+    message_drop(entry->message);
+    entry->message = NULL;
+    //Free entries are linked through their hash
+    entry->hash = arena->free_entries;
+    arena->free_entries = handle;
+    arena->live--;
+}
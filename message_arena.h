@@ -0,0 +1,79 @@
+#ifndef __message_arena_h
+#define __message_arena_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Interned alarm messages.
+ *
+ * Each distinct message is stored once, however long it is, and referenced
+ * by a 32 bit handle, counting how many alarms refer to it. The text lives
+ * in a message_t, taken from a slab cache per power of two size, from
+ * MESSAGE_MIN_BLOCK up to MESSAGE_MAX_BLOCK bytes, or from malloc() past
+ * that. A hash index of the handles finds the message a text was already
+ * interned as.
+ *
+ * Other threads may keep a message past the last alarm referring to it,
+ * such as the display workers showing it. message_hold() and
+ * message_share() take a reference on the message_t itself, which the
+ * holder gives back with message_drop(), from any thread. The text never
+ * changes, and is freed once the arena and every holder are done with it.
+ *
+ * Handle 0 is never used, so it can stand for no message.
+ *
+ * The arena does no locking of its own; the caller must serialize access,
+ * except to message_share() and message_drop().
+ */
+#define MESSAGE_MIN_BLOCK 16
+#define MESSAGE_MAX_BLOCK 256
+#define MESSAGE_CLASSES 5
+
+typedef struct message {
+    atomic_uint     holders;
+    uint32_t        length;
+    char            text[];
+} message_t;
+
+typedef struct message_entry {
+    message_t * message;
+    uint32_t    hash;
+    uint32_t    references;
+} message_entry_t;
+
+typedef struct message_arena {
+    message_entry_t *   entries;
+    uint32_t            entry_count;
+    uint32_t            entry_capacity;
+    uint32_t            free_entries;
+    uint32_t *          index;
+    size_t              index_capacity;
+    size_t              live;
+    //Bytes taken by the messages interned
+    size_t              bytes;
+} message_arena_t;
+
+void message_arena_init(message_arena_t *arena);
+uint32_t message_intern(message_arena_t *arena, const char *text, size_t length);
+void message_release(message_arena_t *arena, uint32_t handle);
+void message_drop(message_t *message);
+
+static inline const char * message_text(message_arena_t *arena, uint32_t handle){
+    return arena->entries[handle].message->text;
+}
+
+static inline size_t message_length(message_arena_t *arena, uint32_t handle){
+    return arena->entries[handle].message->length;
+}
+
+static inline message_t * message_share(message_t *message){
+    atomic_fetch_add_explicit(&message->holders, 1, memory_order_relaxed);
+    return message;
+}
+
+static inline message_t * message_hold(message_arena_t *arena, uint32_t handle){
+    return message_share(arena->entries[handle].message);
+}
+
+#endif
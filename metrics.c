@@ -0,0 +1,78 @@
+/*
+ * metrics.c
+ *
+ * Per-thread metric records. See metrics.h for an overview.
+ */
+#include "metrics.h"
+
+#ifdef ALARM_METRICS
+
+#include "errors.h"
+#include "mono_clock.h"
+
+__thread metrics_record_t *metrics_local = NULL;
+
+static metrics_record_t *records[METRICS_MAX_THREADS];
+static atomic_int record_count = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Gives the calling thread its record. Records are never freed: a thread
+ * that exits leaves its counts behind for the totals.
+ */
+metrics_record_t * metrics_register(void){
+    metrics_record_t *record;
+    int index, i;
+
+    record = (metrics_record_t *) aligned_alloc(METRICS_CACHE_LINE, sizeof(metrics_record_t));
+    if(record == NULL)
+        errno_abort("Allocate metrics record");
+    for(i = 0; i < METRIC_COUNTERS; i++)
+        atomic_init(&record->counters[i], 0);
+    for(i = 0; i < METRIC_HISTOGRAMS; i++)
+        histogram_init(&record->histograms[i]);
+
+    pthread_mutex_lock(&registry_mutex);
+    index = atomic_load(&record_count);
+    if(index == METRICS_MAX_THREADS)
+        err_abort(1, "Too many threads for metrics");
+    records[index] = record;
+    atomic_store_explicit(&record_count, index + 1, memory_order_release);
+    pthread_mutex_unlock(&registry_mutex);
+
+    metrics_local = record;
+    return record;
+}
+
+/*
+ * Sums every thread's record. `histograms` must have been initialized.
+ */
+void metrics_collect(uint64_t *counters, histogram_t *histograms){
+    int count = atomic_load_explicit(&record_count, memory_order_acquire), i, j;
+
+    for(j = 0; j < METRIC_COUNTERS; j++)
+        counters[j] = 0;
+    for(i = 0; i < count; i++){
+        for(j = 0; j < METRIC_COUNTERS; j++)
+            counters[j] += atomic_load_explicit(&records[i]->counters[j], memory_order_relaxed);
+        for(j = 0; j < METRIC_HISTOGRAMS; j++)
+            histogram_merge(&histograms[j], &records[i]->histograms[j]);
+    }
+}
+
+/*
+ * Locks a mutex, timing the wait only when it is contended, so that
+ * uncontended locking costs no more than it did.
+ */
+void metrics_lock(pthread_mutex_t *mutex){
+    uint64_t start;
+
+    if(pthread_mutex_trylock(mutex) == 0)
+        return;
+    start = mono_now();
+    pthread_mutex_lock(mutex);
+    metrics_add(METRIC_LOCK_WAITS, 1);
+    metrics_record(METRIC_LOCK_WAIT, mono_now() - start);
+}
+
+#endif
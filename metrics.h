@@ -0,0 +1,90 @@
+#ifndef __metrics_h
+#define __metrics_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "histogram.h"
+#include "mono_clock.h"
+
+/*
+ * Engine metrics.
+ *
+ * Every thread counts into its own record, padded to a cache line, so
+ * counting is a plain add on memory no other thread writes. Readers sum
+ * the records with metrics_collect() whenever they want a report; a sum
+ * taken while threads are counting may be a few events behind.
+ *
+ * Everything here only exists when built with ALARM_METRICS. Without it,
+ * the METRIC_ macros compile to nothing, or to the plain operation they
+ * instrument.
+ */
+#define METRICS_MAX_THREADS 256
+#define METRICS_CACHE_LINE 64
+
+//Counters
+#define METRIC_INSERTS 0
+#define METRIC_REPLACEMENTS 1
+#define METRIC_CANCELS 2
+#define METRIC_ERRORS 3
+#define METRIC_DISPLAYS 4
+#define METRIC_LOCK_WAITS 5
+#define METRIC_REJECTS 6
+#define METRIC_COUNTERS 7
+
+//Histograms, in nanoseconds
+#define METRIC_LOCK_WAIT 0
+#define METRIC_ENQUEUE_WAIT 1
+#define METRIC_HISTOGRAMS 2
+
+typedef struct metrics_record {
+    _Alignas(METRICS_CACHE_LINE) atomic_uint_fast64_t counters[METRIC_COUNTERS];
+    histogram_t histograms[METRIC_HISTOGRAMS];
+} metrics_record_t;
+
+#ifdef ALARM_METRICS
+
+extern __thread metrics_record_t *metrics_local;
+
+metrics_record_t * metrics_register(void);
+void metrics_collect(uint64_t *counters, histogram_t *histograms);
+void metrics_lock(pthread_mutex_t *mutex);
+
+static inline void metrics_add(int counter, uint64_t n){
+    metrics_record_t *record = metrics_local;
+
+    if(record == NULL)
+        record = metrics_register();
+    //Only this thread writes the counter, so it needs no atomic add
+    atomic_store_explicit(&record->counters[counter],
+                          atomic_load_explicit(&record->counters[counter], memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void metrics_record(int histogram, uint64_t value){
+    metrics_record_t *record = metrics_local;
+
+    if(record == NULL)
+        record = metrics_register();
+    histogram_record(&record->histograms[histogram], value);
+}
+
+#define METRIC_ADD(counter, n) metrics_add((counter), (n))
+#define METRIC_RECORD(histogram, value) metrics_record((histogram), (value))
+#define METRIC_LOCK(mutex) metrics_lock(mutex)
+#define METRIC_TIMED(histogram, statement) do { \
+        uint64_t metric_start = mono_now(); \
+        statement; \
+        metrics_record((histogram), mono_now() - metric_start); \
+    } while(0)
+
+#else
+
+#define METRIC_ADD(counter, n) ((void) 0)
+#define METRIC_RECORD(histogram, value) ((void) 0)
+#define METRIC_LOCK(mutex) pthread_mutex_lock(mutex)
+#define METRIC_TIMED(histogram, statement) do { statement; } while(0)
+
+#endif
+
+#endif
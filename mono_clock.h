@@ -0,0 +1,28 @@
+#ifndef __mono_clock_h
+#define __mono_clock_h
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Nanoseconds on CLOCK_MONOTONIC. Unlike time(NULL), it never jumps when
+ * the wall clock is set, so deadlines taken from it stay put.
+ */
+#define NSEC_PER_SEC 1000000000ull
+
+static inline uint64_t mono_now(void){
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * NSEC_PER_SEC + (uint64_t) now.tv_nsec;
+}
+
+static inline struct timespec mono_timespec(uint64_t ns){
+    struct timespec result;
+
+    result.tv_sec = (time_t) (ns / NSEC_PER_SEC);
+    result.tv_nsec = (long) (ns % NSEC_PER_SEC);
+    return result;
+}
+
+#endif
@@ -0,0 +1,658 @@
+/*
+ * output.c
+ *
+ * Buffered, asynchronous output. See output.h for an overview.
+ *
+ * Each ring holds records made of a header and the formatted line, padded
+ * to 16 bytes. A record that would not fit before the end of the ring is
+ * preceded by a skip record covering the rest of the ring. `head` is where
+ * the owning thread writes next, `read` is how far the writer has gathered,
+ * and `tail` how far the writer has actually written out; everything in
+ * between belongs to the writer.
+ *
+ * Opening and closing a destination are records too, so they take effect
+ * in ticket order with the lines around them. Only the writer looks at the
+ * table of open destinations. Tickets are kept to 32 bits in the header,
+ * which is plenty to tell the next one from those still in the rings.
+ */
+#include "output.h"
+#include "errors.h"
+#include "alarm_store.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/uio.h>
+
+typedef struct record_header {
+    uint32_t    length;
+    uint32_t    kind;
+    uint32_t    destination;
+    uint32_t    ticket;
+} record_header_t;
+
+#define RECORD_LINE 0
+#define RECORD_SKIP 1
+//Carries the destination's file descriptor
+#define RECORD_OPEN 2
+#define RECORD_CLOSE 3
+
+#define HEADER_SIZE sizeof(record_header_t)
+#define RECORD_SIZE(length) ((HEADER_SIZE + (length) + 15) & ~((size_t) 15))
+#define RING_MASK (OUTPUT_RING_SIZE - 1)
+//Most lines are shorter than this, longer ones are formatted twice
+#define LINE_GUESS 256
+#define WRITE_BATCH 1024
+
+#define WRITER_BUSY 0
+#define WRITER_IDLE 1
+#define WRITER_COLLECTING 2
+
+static output_ring_t *rings[OUTPUT_MAX_RINGS];
+static atomic_int ring_count = 0;
+static __thread output_ring_t *local_ring = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int output_fd = STDOUT_FILENO;
+//Destinations other than OUTPUT_CONSOLE, mapped to their descriptor plus one
+static alarm_store_t destinations;
+static atomic_uint next_destination = OUTPUT_CONSOLE + 1;
+static output_policy_t policy;
+/*
+ * One ticket order for every destination, so that a line waits for all the
+ * lines before it, whoever they go to. A client that reads slowly holds up
+ * everyone else's output, and the console's, for as long as the writer
+ * blocks on it: up to SERVER_SEND_TIMEOUT_MS per write, until it stops
+ * reading altogether and is closed.
+ */
+static _Alignas(OUTPUT_CACHE_LINE) atomic_uint_fast64_t next_ticket = 0;
+static _Alignas(OUTPUT_CACHE_LINE) atomic_uint_fast64_t written_ticket = 0;
+static atomic_int writer_state = WRITER_BUSY;
+static atomic_int wakeup = 0;
+
+//Protects flush_waiters, and is what the writer and flushers sleep on
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static int flush_waiters = 0;
+
+void output_default_policy(int mode, output_policy_t *out){
+    out->mode = mode;
+    if(mode == OUTPUT_THROUGHPUT){
+        out->delay_us = 100000;
+        out->threshold = 64 * 1024;
+    } else {
+        out->delay_us = 1000;
+        out->threshold = 16 * 1024;
+    }
+}
+
+/*
+ * Parses "latency[:usec]" or "throughput[:usec]". Returns 0 on error.
+ */
+int output_parse_policy(const char *text, output_policy_t *out){
+    const char *colon = strchr(text, ':');
+    size_t length = colon ? (size_t) (colon - text) : strlen(text);
+    char *end;
+    long delay;
+
+    if(length == strlen("latency") && strncmp(text, "latency", length) == 0)
+        output_default_policy(OUTPUT_LATENCY, out);
+    else if(length == strlen("throughput") && strncmp(text, "throughput", length) == 0)
+        output_default_policy(OUTPUT_THROUGHPUT, out);
+    else
+        return 0;
+
+    if(colon != NULL){
+        delay = strtol(colon + 1, &end, 10);
+        if(*end != '\0' || delay < 0)
+            return 0;
+        out->delay_us = delay;
+    }
+    return 1;
+}
+
+static void wake_writer(){
+    //Only the first producer to raise the flag has to signal
+    if(atomic_exchange(&wakeup, 1) == 0){
+        pthread_mutex_lock(&writer_mutex);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_mutex);
+    }
+}
+
+static output_ring_t * output_ring(){
+    output_ring_t *ring;
+    int index;
+
+    if(local_ring != NULL)
+        return local_ring;
+
+    ring = (output_ring_t *) calloc(1, sizeof(output_ring_t));
+    if(ring == NULL || (ring->data = (char *) malloc(OUTPUT_RING_SIZE)) == NULL)
+        errno_abort("Allocate output ring");
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    pthread_mutex_lock(&registry_mutex);
+    index = atomic_load(&ring_count);
+    if(index == OUTPUT_MAX_RINGS)
+        err_abort(1, "Too many output rings");
+    rings[index] = ring;
+    atomic_store_explicit(&ring_count, index + 1, memory_order_release);
+    pthread_mutex_unlock(&registry_mutex);
+
+    local_ring = ring;
+    return ring;
+}
+
+/*
+ * Waits until `needed` contiguous bytes are free at the head of the ring,
+ * wrapping around if needed. Returns the head, and how much room there is.
+ */
+static size_t reserve(output_ring_t *ring, size_t needed, size_t *room){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t free, to_end;
+    record_header_t *skip;
+
+    while(1){
+        free = OUTPUT_RING_SIZE - (head - atomic_load_explicit(&ring->tail, memory_order_acquire));
+        to_end = OUTPUT_RING_SIZE - (head & RING_MASK);
+        if(to_end < needed && free >= to_end){
+            skip = (record_header_t *) (ring->data + (head & RING_MASK));
+            skip->length = (uint32_t) to_end;
+            skip->kind = RECORD_SKIP;
+            head += to_end;
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+            continue;
+        }
+        if(to_end >= needed && free >= needed){
+            *room = to_end < free ? to_end : free;
+            return head;
+        }
+        //Full, the writer has to catch up
+        if(atomic_load(&writer_state) != WRITER_BUSY)
+            wake_writer();
+        sched_yield();
+    }
+}
+
+/*
+ * Lets the writer know about a new record, if the policy says it should.
+ */
+static void notify(output_ring_t *ring, size_t head){
+    int state;
+
+    //Order the head update before reading the state, the writer does the opposite
+    atomic_thread_fence(memory_order_seq_cst);
+    state = atomic_load(&writer_state);
+    if(state == WRITER_IDLE
+       || (state == WRITER_COLLECTING
+           && head - atomic_load_explicit(&ring->tail, memory_order_relaxed) >= policy.threshold))
+        wake_writer();
+}
+
+/*
+ * Formats the common case, plain %d and %s conversions, by hand: going
+ * through vsnprintf costs about twice what the same fprintf would.
+ * Returns -1 if the line does not fit or uses anything else.
+ */
+static int format_line(char *out, size_t size, const char *format, va_list args){
+    char *p = out, *end = out + size, digits[12];
+    const char *string;
+    unsigned int value;
+    size_t length;
+    int count;
+
+    for(; *format != '\0'; format++){
+        if(*format != '%'){
+            for(string = format; *string != '%' && *string != '\0'; string++)
+                ;
+            length = (size_t) (string - format);
+            if((size_t) (end - p) < length)
+                return -1;
+            memcpy(p, format, length);
+            p += length;
+            format = string - 1;
+            continue;
+        }
+        switch(*++format){
+            case 'd':
+                count = va_arg(args, int);
+                if(count < 0){
+                    if(p == end)
+                        return -1;
+                    *p++ = '-';
+                    value = 0u - (unsigned int) count;
+                } else {
+                    value = (unsigned int) count;
+                }
+                count = 0;
+                do {
+                    digits[count++] = (char) ('0' + value % 10);
+                    value /= 10;
+                } while(value != 0);
+                if(end - p < count)
+                    return -1;
+                while(count > 0)
+                    *p++ = digits[--count];
+                break;
+            case 's':
+                string = va_arg(args, const char *);
+                length = strlen(string);
+                if((size_t) (end - p) < length)
+                    return -1;
+                memcpy(p, string, length);
+                p += length;
+                break;
+            case '%':
+                if(p == end)
+                    return -1;
+                *p++ = '%';
+                break;
+            default:
+                return -1;
+        }
+    }
+    //Room for the terminator, like vsnprintf
+    if(p == end)
+        return -1;
+    *p = '\0';
+    return (int) (p - out);
+}
+
+/*
+ * Formats a line for a destination into the calling thread's ring.
+ */
+static void format_record(uint32_t destination, const char *format, va_list args){
+    output_ring_t *ring = output_ring();
+    size_t needed = HEADER_SIZE + LINE_GUESS, room, head;
+    record_header_t *header;
+    va_list copy;
+    int length;
+
+    while(1){
+        head = reserve(ring, needed, &room);
+        va_copy(copy, args);
+        length = format_line(ring->data + (head & RING_MASK) + HEADER_SIZE,
+                             room - HEADER_SIZE, format, copy);
+        va_end(copy);
+        if(length < 0){
+            va_copy(copy, args);
+            length = vsnprintf(ring->data + (head & RING_MASK) + HEADER_SIZE,
+                               room - HEADER_SIZE, format, copy);
+            va_end(copy);
+        }
+        if(length < 0)
+            return;
+        if((size_t) length < room - HEADER_SIZE)
+            break;
+        //Did not fit. Lines longer than half the ring are cut short, but
+        //still end the line.
+        if(needed == OUTPUT_RING_SIZE / 2){
+            length = (int) (room - HEADER_SIZE - 1);
+            ring->data[(head & RING_MASK) + HEADER_SIZE + length - 1] = '\n';
+            break;
+        }
+        needed = HEADER_SIZE + (size_t) length + 1;
+        if(needed > OUTPUT_RING_SIZE / 2)
+            needed = OUTPUT_RING_SIZE / 2;
+    }
+
+    header = (record_header_t *) (ring->data + (head & RING_MASK));
+    header->length = (uint32_t) length;
+    header->kind = RECORD_LINE;
+    header->destination = destination;
+    header->ticket = (uint32_t) atomic_fetch_add_explicit(&next_ticket, 1, memory_order_relaxed);
+    head += RECORD_SIZE(length);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    notify(ring, head);
+}
+
+void output_printf(const char *format, ...){
+    va_list args;
+
+    va_start(args, format);
+    format_record(OUTPUT_CONSOLE, format, args);
+    va_end(args);
+}
+
+void output_printf_to(uint32_t destination, const char *format, ...){
+    va_list args;
+
+    va_start(args, format);
+    format_record(destination, format, args);
+    va_end(args);
+}
+
+/*
+ * Copies a record made of `count` parts into the calling thread's ring,
+ * as is, for a destination. Records longer than OUTPUT_MAX_WRITE are cut
+ * short.
+ */
+void output_write_to(uint32_t destination, const struct iovec *parts, int count){
+    output_ring_t *ring = output_ring();
+    size_t length = 0, room, head, part;
+    record_header_t *header;
+    char *p;
+    int i;
+
+    for(i = 0; i < count; i++)
+        length += parts[i].iov_len;
+    if(length > OUTPUT_MAX_WRITE)
+        length = OUTPUT_MAX_WRITE;
+    head = reserve(ring, HEADER_SIZE + length, &room);
+    header = (record_header_t *) (ring->data + (head & RING_MASK));
+    p = (char *) header + HEADER_SIZE;
+    for(i = 0; i < count && p < (char *) header + HEADER_SIZE + length; i++){
+        part = parts[i].iov_len;
+        if(part > (size_t) ((char *) header + HEADER_SIZE + length - p))
+            part = (size_t) ((char *) header + HEADER_SIZE + length - p);
+        memcpy(p, parts[i].iov_base, part);
+        p += part;
+    }
+    header->length = (uint32_t) length;
+    header->kind = RECORD_LINE;
+    header->destination = destination;
+    header->ticket = (uint32_t) atomic_fetch_add_explicit(&next_ticket, 1, memory_order_relaxed);
+    head += RECORD_SIZE(length);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    notify(ring, head);
+}
+
+/*
+ * Queues the opening or closing of a destination.
+ */
+static void control_record(int kind, uint32_t destination, int fd){
+    output_ring_t *ring = output_ring();
+    size_t length = kind == RECORD_OPEN ? sizeof(int) : 0, room, head;
+    record_header_t *header;
+
+    head = reserve(ring, HEADER_SIZE + length, &room);
+    header = (record_header_t *) (ring->data + (head & RING_MASK));
+    memcpy((char *) header + HEADER_SIZE, &fd, length);
+    header->length = (uint32_t) length;
+    header->kind = (uint32_t) kind;
+    header->destination = destination;
+    header->ticket = (uint32_t) atomic_fetch_add_explicit(&next_ticket, 1, memory_order_relaxed);
+    head += RECORD_SIZE(length);
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    notify(ring, head);
+}
+
+/*
+ * Makes a new destination writing to `fd`, and returns it. The writer owns
+ * the descriptor from then on, and closes it along with the destination.
+ * Destinations are never reused, so lines for one that was closed are
+ * dropped rather than going to someone else.
+ */
+uint32_t output_open(int fd){
+    uint32_t destination = atomic_fetch_add(&next_destination, 1);
+
+    control_record(RECORD_OPEN, destination, fd);
+    return destination;
+}
+
+/*
+ * Closes a destination once every line formatted for it so far is written.
+ */
+void output_close(uint32_t destination){
+    control_record(RECORD_CLOSE, destination, -1);
+}
+
+/*
+ * Returns the next real record of a ring the writer has not gathered yet,
+ * or NULL.
+ */
+static record_header_t * peek(output_ring_t *ring){
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    record_header_t *header;
+
+    while(ring->read < head){
+        header = (record_header_t *) (ring->data + (ring->read & RING_MASK));
+        if(header->kind != RECORD_SKIP)
+            return header;
+        ring->read += header->length;
+    }
+    return NULL;
+}
+
+static int has_pending(){
+    int count = atomic_load_explicit(&ring_count, memory_order_acquire), i;
+
+    for(i = 0; i < count; i++){
+        if(atomic_load_explicit(&rings[i]->head, memory_order_acquire) != rings[i]->read)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * Opens or closes a destination, for the writer.
+ */
+static void apply_control(record_header_t *header){
+    void *value;
+    int fd;
+
+    if(header->kind == RECORD_OPEN){
+        memcpy(&fd, (char *) header + HEADER_SIZE, sizeof(int));
+        alarm_store_insert(&destinations, (int) header->destination,
+                           (void *) (intptr_t) (fd + 1));
+        return;
+    }
+    //Already gone if writing to it failed
+    value = alarm_store_remove(&destinations, (int) header->destination);
+    if(value != NULL)
+        close((int) (intptr_t) value - 1);
+}
+
+/*
+ * Gathers up to WRITE_BATCH lines, in ticket order, along with their
+ * destinations. Opening and closing a destination ends a batch, and is
+ * applied once the lines before it are written, at the start of the next.
+ */
+static int gather(struct iovec *iov, uint32_t *destination, uint64_t *expected){
+    int count, n = 0, i, last = 0, pending, spins = 0;
+    record_header_t *header;
+    output_ring_t *ring;
+
+    while(n < WRITE_BATCH){
+        count = atomic_load_explicit(&ring_count, memory_order_acquire);
+        pending = 0;
+        header = NULL;
+        //Lines from the same thread tend to follow each other
+        for(i = 0; i < count; i++){
+            ring = rings[(last + i) % count];
+            header = peek(ring);
+            if(header == NULL)
+                continue;
+            pending = 1;
+            if(header->ticket == (uint32_t) *expected)
+                break;
+            header = NULL;
+        }
+        if(header == NULL){
+            //A producer took a ticket and is about to publish its line
+            if(pending && n == 0 && ++spins < 1000){
+                sched_yield();
+                continue;
+            }
+            break;
+        }
+        last = (last + i) % count;
+        if(header->kind != RECORD_LINE){
+            if(n > 0)
+                break;
+            apply_control(header);
+        } else {
+            iov[n].iov_base = (char *) header + HEADER_SIZE;
+            iov[n].iov_len = header->length;
+            destination[n] = header->destination;
+            n++;
+        }
+        ring->read += RECORD_SIZE(header->length);
+        (*expected)++;
+    }
+    return n;
+}
+
+/*
+ * Returns -1 if the lines could not all be written.
+ */
+static int write_all(int fd, struct iovec *iov, int count){
+    ssize_t written;
+
+    while(count > 0){
+        written = writev(fd, iov, count);
+        if(written < 0){
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        while(count > 0 && (size_t) written >= iov->iov_len){
+            written -= (ssize_t) iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= (size_t) written;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes a batch, one writev() per run of lines for the same destination.
+ * Lines for a destination that is not open are dropped. A destination that
+ * cannot be written to, because it went away or stopped reading for longer
+ * than its send timeout, is closed, so that it does not hold up the rest.
+ */
+static void write_lines(struct iovec *iov, uint32_t *destination, int count){
+    void *value;
+    int start, end, fd;
+
+    for(start = 0; start < count; start = end){
+        for(end = start + 1; end < count && destination[end] == destination[start]; end++)
+            ;
+        if(destination[start] == OUTPUT_CONSOLE){
+            write_all(output_fd, iov + start, end - start);
+            continue;
+        }
+        value = alarm_store_find(&destinations, (int) destination[start]);
+        //Nowhere to write to, drop the lines
+        if(value == NULL)
+            continue;
+        fd = (int) (intptr_t) value - 1;
+        if(write_all(fd, iov + start, end - start) < 0){
+            alarm_store_remove(&destinations, (int) destination[start]);
+            close(fd);
+        }
+    }
+}
+
+/*
+ * Sleeps until there is something to write, then keeps collecting lines
+ * for as long as the policy allows.
+ */
+static void wait_for_lines(){
+    struct timespec deadline;
+
+    pthread_mutex_lock(&writer_mutex);
+    atomic_store(&writer_state, WRITER_IDLE);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(has_pending() || flush_waiters > 0){
+        atomic_store(&writer_state, WRITER_BUSY);
+        pthread_mutex_unlock(&writer_mutex);
+        return;
+    }
+    while(!atomic_load(&wakeup))
+        pthread_cond_wait(&writer_cond, &writer_mutex);
+    atomic_store(&wakeup, 0);
+
+    atomic_store(&writer_state, WRITER_COLLECTING);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += policy.delay_us / 1000000;
+    deadline.tv_nsec += (policy.delay_us % 1000000) * 1000;
+    if(deadline.tv_nsec >= 1000000000){
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    while(!atomic_load(&wakeup) && flush_waiters == 0){
+        if(pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline) != 0)
+            break;
+    }
+    atomic_store(&wakeup, 0);
+    atomic_store(&writer_state, WRITER_BUSY);
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+static void * writer_thread(void *arg){
+    struct iovec iov[WRITE_BATCH];
+    uint32_t destination[WRITE_BATCH];
+    uint64_t expected = 0, start;
+    int count, i;
+
+    while(1){
+        start = expected;
+        count = gather(iov, destination, &expected);
+        if(expected == start){
+            wait_for_lines();
+            continue;
+        }
+        write_lines(iov, destination, count);
+
+        //Hand the space back to the producers
+        for(i = 0; i < atomic_load_explicit(&ring_count, memory_order_acquire); i++)
+            atomic_store_explicit(&rings[i]->tail, rings[i]->read, memory_order_release);
+        atomic_store(&written_ticket, expected);
+
+        pthread_mutex_lock(&writer_mutex);
+        if(flush_waiters > 0)
+            pthread_cond_broadcast(&flush_cond);
+        pthread_mutex_unlock(&writer_mutex);
+    }
+    return NULL;
+}
+
+void output_init(int fd, output_policy_t *out){
+    pthread_t thread;
+    int status;
+
+    output_fd = fd;
+    policy = *out;
+    alarm_store_init(&destinations, 64);
+    status = pthread_create(&thread, NULL, writer_thread, NULL);
+    if(status != 0)
+        err_abort(status, "Create output writer");
+}
+
+/*
+ * Blocks until every line formatted so far has been written.
+ */
+void output_flush(void){
+    uint64_t target = atomic_load(&next_ticket);
+
+    pthread_mutex_lock(&writer_mutex);
+    flush_waiters++;
+    pthread_cond_signal(&writer_cond);
+    while(atomic_load(&written_ticket) < target)
+        pthread_cond_wait(&flush_cond, &writer_mutex);
+    flush_waiters--;
+    pthread_mutex_unlock(&writer_mutex);
+}
+
+/*
+ * Bytes formatted but not written out yet, over all the rings.
+ */
+size_t output_backlog(void){
+    int count = atomic_load_explicit(&ring_count, memory_order_acquire), i;
+    size_t total = 0, tail;
+
+    for(i = 0; i < count; i++){
+        //The tail never passes the head, so read it first
+        tail = atomic_load_explicit(&rings[i]->tail, memory_order_acquire);
+        total += atomic_load_explicit(&rings[i]->head, memory_order_acquire) - tail;
+    }
+    return total;
+}
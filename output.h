@@ -0,0 +1,67 @@
+#ifndef __output_h
+#define __output_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+/*
+ * Buffered, asynchronous output.
+ *
+ * output_printf() formats a line into a ring buffer owned by the calling
+ * thread. A single writer thread drains every ring with large writev()
+ * calls. Every line takes a ticket from a global counter once it is
+ * formatted, and the writer emits lines strictly in ticket order, so lines
+ * come out in the order they were produced even across threads.
+ *
+ * Every line goes to a destination. output_printf() writes to
+ * OUTPUT_CONSOLE, the descriptor given to output_init(), and
+ * output_printf_to() to a destination made with output_open(), such as a
+ * client connection. Ordering holds across destinations too.
+ * output_write_to() queues bytes as they are, such as a binary record, in
+ * the same order as the lines; it takes at most OUTPUT_MAX_WRITE of them.
+ *
+ * The flush policy bounds how long a line may sit in a ring:
+ *  - latency:    the writer collects lines for at most `delay_us` after
+ *                the first one arrives, then writes them.
+ *  - throughput: same, with a long delay, but a ring holding more than
+ *                `threshold` bytes makes the writer flush early.
+ */
+#define OUTPUT_RING_SIZE (1 << 18)
+#define OUTPUT_MAX_RINGS 256
+#define OUTPUT_CACHE_LINE 64
+//Leaves room for a record's header in half a ring
+#define OUTPUT_MAX_WRITE (OUTPUT_RING_SIZE / 2 - 64)
+
+#define OUTPUT_CONSOLE 0
+
+#define OUTPUT_LATENCY 0
+#define OUTPUT_THROUGHPUT 1
+
+typedef struct output_policy {
+    int     mode;
+    long    delay_us;
+    size_t  threshold;
+} output_policy_t;
+
+typedef struct output_ring {
+    char *                                      data;
+    _Alignas(OUTPUT_CACHE_LINE) atomic_size_t   head;
+    _Alignas(OUTPUT_CACHE_LINE) atomic_size_t   tail;
+    size_t                                      read;
+} output_ring_t;
+
+int output_parse_policy(const char *text, output_policy_t *policy);
+void output_default_policy(int mode, output_policy_t *policy);
+void output_init(int fd, output_policy_t *policy);
+void output_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+void output_printf_to(uint32_t destination, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+void output_write_to(uint32_t destination, const struct iovec *parts, int count);
+uint32_t output_open(int fd);
+void output_close(uint32_t destination);
+void output_flush(void);
+size_t output_backlog(void);
+
+#endif
@@ -0,0 +1,284 @@
+/*
+ * parse.c
+ *
+ * Zero copy command scanner. See parse.h for the grammar.
+ */
+#include "parse.h"
+#include <string.h>
+#include <limits.h>
+
+static int is_space(char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+static const char * skip_space(const char *p, const char *end){
+    while(p < end && is_space(*p))
+        p++;
+    return p;
+}
+
+/*
+ * Like %d: skips leading white space, takes an optional sign and at least
+ * one digit. Out of range values end up the way glibc's sscanf leaves
+ * them: saturated as a long, then truncated to an int.
+ * Returns NULL if there is no number.
+ */
+static const char * scan_int(const char *p, const char *end, int *value){
+    int negative = 0;
+    unsigned long result = 0, limit;
+
+    p = skip_space(p, end);
+    if(p < end && (*p == '-' || *p == '+')){
+        negative = *p == '-';
+        p++;
+    }
+    if(p == end || *p < '0' || *p > '9')
+        return NULL;
+    limit = negative ? (unsigned long) LONG_MAX + 1 : (unsigned long) LONG_MAX;
+    while(p < end && *p >= '0' && *p <= '9'){
+        if(result > (limit - (unsigned long) (*p - '0')) / 10)
+            result = limit;
+        else
+            result = result * 10 + (unsigned long) (*p - '0');
+        p++;
+    }
+    *value = (int) (negative ? (long) (0 - result) : (long) result);
+    return p;
+}
+
+/*
+ * The optional unit right after the interval. It only counts as one when
+ * white space follows, so that "5ms(1)" still fails the way it used to.
+ */
+static const char * scan_unit(const char *p, const char *end, int *unit){
+    *unit = PARSE_UNIT_S;
+    if(end - p >= 3 && (p[0] == 'm' || p[0] == 'u') && p[1] == 's' && is_space(p[2])){
+        *unit = p[0] == 'm' ? PARSE_UNIT_MS : PARSE_UNIT_US;
+        return p + 2;
+    }
+    if(end - p >= 2 && p[0] == 's' && is_space(p[1]))
+        return p + 1;
+    return p;
+}
+
+/*
+ * Like %10[^(] followed by a literal "(": at most 10 characters up to the
+ * parenthesis. Returns a pointer past the parenthesis, or NULL.
+ */
+static const char * scan_word(const char *p, const char *end,
+                              const char **word, size_t *length){
+    const char *start = p;
+
+    while(p < end && *p != '(' && p - start < 10)
+        p++;
+    if(p == start || p == end || *p != '(')
+        return NULL;
+    *word = start;
+    *length = (size_t) (p - start);
+    return p + 1;
+}
+
+static int is_word(const char *word, size_t length, const char *expected){
+    return length == strlen(expected) && memcmp(word, expected, length) == 0;
+}
+
+/*
+ * "%d %10[^(](%d) %128[^\n]"
+ * Returns 1 if all four conversions match, and sets *message_ok if the
+ * word is "Message".
+ */
+static int scan_set(const char *p, const char *end, parsed_command_t *command,
+                    int *message_ok){
+    const char *word, *message;
+    size_t length;
+
+    if((p = scan_int(p, end, &command->interval)) == NULL)
+        return 0;
+    p = scan_unit(p, end, &command->unit);
+    p = skip_space(p, end);
+    if((p = scan_word(p, end, &word, &length)) == NULL)
+        return 0;
+    if((p = scan_int(p, end, &command->alarm_number)) == NULL)
+        return 0;
+    if(p == end || *p != ')')
+        return 0;
+    p = skip_space(p + 1, end);
+
+    message = p;
+    while(p < end && *p != '\n')
+        p++;
+    if(p == message)
+        return 0;
+    command->message = message;
+    command->message_length = (size_t) (p - message);
+    *message_ok = is_word(word, length, "Message");
+    return 1;
+}
+
+/*
+ * "%[^:]: %10[^(](%d)"
+ * Returns 1 if all three conversions match, and sets *cancel_ok if the
+ * first word is "Cancel".
+ */
+static int scan_cancel(const char *p, const char *end, parsed_command_t *command,
+                       int *cancel_ok){
+    const char *start = p, *word;
+    size_t length;
+
+    while(p < end && *p != ':')
+        p++;
+    if(p == start || p == end)
+        return 0;
+    *cancel_ok = is_word(start, (size_t) (p - start), "Cancel");
+    p = skip_space(p + 1, end);
+    if((p = scan_word(p, end, &word, &length)) == NULL)
+        return 0;
+    if(scan_int(p, end, &command->alarm_number) == NULL)
+        return 0;
+    return 1;
+}
+
+/*
+ * "Message(<first>..<last>)", or just "Message(<first>)" if `single` is
+ * set, followed by nothing but white space. Returns 1 if it matches.
+ */
+static int scan_range(const char *p, const char *end, parsed_command_t *command, int single){
+    const char *word;
+    size_t length;
+
+    if((p = scan_word(p, end, &word, &length)) == NULL || !is_word(word, length, "Message"))
+        return 0;
+    if((p = scan_int(p, end, &command->alarm_number)) == NULL)
+        return 0;
+    command->last_number = command->alarm_number;
+    if(end - p >= 2 && p[0] == '.' && p[1] == '.'){
+        if((p = scan_int(p + 2, end, &command->last_number)) == NULL)
+            return 0;
+    } else if(!single){
+        return 0;
+    }
+    if(p == end || *p != ')')
+        return 0;
+    return skip_space(p + 1, end) == end;
+}
+
+/*
+ * The bulk commands. Returns the kind of command, or -1 if it is not one.
+ */
+static int scan_bulk(const char *p, const char *end, parsed_command_t *command){
+    const char *start = p, *rest;
+
+    while(p < end && *p != ':')
+        p++;
+    if(p == end)
+        return -1;
+    rest = skip_space(p + 1, end);
+
+    if(is_word(start, (size_t) (p - start), "Cancel")){
+        while(end > rest && is_space(end[-1]))
+            end--;
+        if(is_word(rest, (size_t) (end - rest), "All")){
+            command->alarm_number = INT_MIN;
+            command->last_number = INT_MAX;
+            return PARSE_CANCEL_ALL;
+        }
+        return scan_range(rest, end, command, 0) ? PARSE_CANCEL_RANGE : -1;
+    }
+    if(is_word(start, (size_t) (p - start), "Interval")){
+        if((p = scan_int(rest, end, &command->interval)) == NULL)
+            return PARSE_INCORRECT_FORMAT;
+        p = scan_unit(p, end, &command->unit);
+        return scan_range(skip_space(p, end), end, command, 1)
+               ? PARSE_INTERVAL_RANGE : PARSE_INCORRECT_FORMAT;
+    }
+    return -1;
+}
+
+/*
+ * "List" or "Count", alone or followed by "range <first>..<last>", and
+ * nothing but white space. Returns the kind of command, or -1 if the line
+ * does not start with either word.
+ */
+static int scan_query(const char *p, const char *end, parsed_command_t *command){
+    const char *start;
+    int kind;
+
+    start = p = skip_space(p, end);
+    while(p < end && !is_space(*p))
+        p++;
+    if(is_word(start, (size_t) (p - start), "List"))
+        kind = PARSE_LIST;
+    else if(is_word(start, (size_t) (p - start), "Count"))
+        kind = PARSE_COUNT;
+    else
+        return -1;
+    command->alarm_number = INT_MIN;
+    command->last_number = INT_MAX;
+    while(end > p && is_space(end[-1]))
+        end--;
+    start = p = skip_space(p, end);
+    if(p == end)
+        return kind;
+
+    while(p < end && !is_space(*p))
+        p++;
+    if(!is_word(start, (size_t) (p - start), "range"))
+        return PARSE_INCORRECT_FORMAT;
+    if((p = scan_int(p, end, &command->alarm_number)) == NULL
+       || end - p < 2 || p[0] != '.' || p[1] != '.'
+       || (p = scan_int(p + 2, end, &command->last_number)) == NULL || p != end)
+        return PARSE_INCORRECT_FORMAT;
+    return kind;
+}
+
+/*
+ * Parses one line, which may or may not include its newline.
+ */
+int parse_command(const char *line, const char *end, parsed_command_t *command){
+    int ok = 0, kind;
+
+    if(scan_set(line, end, command, &ok))
+        return ok ? PARSE_SET : PARSE_INCORRECT_FORMAT;
+    if((kind = scan_bulk(line, end, command)) >= 0)
+        return kind;
+    if(scan_cancel(line, end, command, &ok))
+        return ok ? PARSE_CANCEL : PARSE_INCORRECT_FORMAT;
+    if((kind = scan_query(line, end, command)) >= 0)
+        return kind;
+    //Commands without arguments, surrounded by nothing but white space
+    line = skip_space(line, end);
+    while(end > line && is_space(end[-1]))
+        end--;
+    if(is_word(line, (size_t) (end - line), "Stats"))
+        return PARSE_STATS;
+    return PARSE_BAD_COMMAND;
+}
+
+/*
+ * What follows the interval when a command is echoed back. Whole seconds
+ * print the way they always have.
+ */
+const char * parse_unit_suffix(int unit){
+    switch(unit){
+        case PARSE_UNIT_MS:
+            return "ms";
+        case PARSE_UNIT_US:
+            return "us";
+    }
+    return "";
+}
+
+/*
+ * Returns the interval in nanoseconds, or 0 if it is not positive.
+ */
+uint64_t parse_interval_ns(int interval, int unit){
+    if(interval <= 0)
+        return 0;
+    switch(unit){
+        case PARSE_UNIT_MS:
+            return (uint64_t) interval * 1000000;
+        case PARSE_UNIT_US:
+            return (uint64_t) interval * 1000;
+    }
+    return (uint64_t) interval * 1000000000;
+}
@@ -0,0 +1,60 @@
+#ifndef __parse_h
+#define __parse_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hand written scanner for the command grammar:
+ *
+ *     <interval>[s|ms|us] Message(<alarm number>) <message>
+ *     Cancel: Message(<alarm number>)
+ *     Cancel: Message(<first>..<last>)
+ *     Cancel: All
+ *     Interval: <interval>[s|ms|us] Message(<first>[..<last>])
+ *     Stats
+ *     List [range <first>..<last>]
+ *     Count [range <first>..<last>]
+ *
+ * Apart from the optional unit, which must be followed by white space, it
+ * accepts what the two sscanf patterns main used to try,
+ *     "%d %10[^(](%d) %128[^\n]"  and  "%[^:]: %10[^(](%d)",
+ * without copying anything: the message is returned as a pointer into the
+ * line and a length. Unlike with sscanf, the message is not cut short at
+ * 128 characters; it is the rest of the line, however long.
+ *
+ * The bulk forms apply to every alarm numbered from `alarm_number` to
+ * `last_number`, both included. A range cancel only counts as one when the
+ * range closes with ")", so that anything sscanf used to take for a single
+ * cancel still is one. List and Count without a range cover every alarm
+ * number.
+ */
+#define PARSE_UNIT_S 0
+#define PARSE_UNIT_MS 1
+#define PARSE_UNIT_US 2
+
+#define PARSE_SET 0
+#define PARSE_CANCEL 1
+#define PARSE_INCORRECT_FORMAT 2
+#define PARSE_BAD_COMMAND 3
+#define PARSE_STATS 4
+#define PARSE_CANCEL_RANGE 5
+#define PARSE_CANCEL_ALL 6
+#define PARSE_INTERVAL_RANGE 7
+#define PARSE_LIST 8
+#define PARSE_COUNT 9
+
+typedef struct parsed_command {
+    int             interval;
+    int             unit;
+    int             alarm_number;
+    int             last_number;
+    const char *    message;
+    size_t          message_length;
+} parsed_command_t;
+
+int parse_command(const char *line, const char *end, parsed_command_t *command);
+const char * parse_unit_suffix(int unit);
+uint64_t parse_interval_ns(int interval, int unit);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * server.c
+ *
+ * Socket front end. See server.h for an overview.
+ *
+ * The loop owns the reading side of every connection. The output writer
+ * gets a duplicate of the descriptor when the client's destination is
+ * opened, and closes it along with the destination, so a connection is
+ * only really gone once both have let go of it. Client sockets stay
+ * blocking for the writer's sake; the loop reads them with MSG_DONTWAIT.
+ *
+ * A pending connection keeps a listener readable, so one that cannot be
+ * accepted for want of descriptors would wake the loop over and over. The
+ * loop keeps a spare descriptor to accept it with and close it right
+ * away. Should the spare be gone too, the listeners are left unwatched
+ * until a client hangs up, or for SERVER_RETRY_MS.
+ */
+#include "server.h"
+#include "output.h"
+#include "errors.h"
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SERVER_EVENTS 64
+#define SERVER_RETRY_MS 100
+
+typedef struct connection {
+    int         fd;
+    int         listening;
+    uint32_t    client;
+    size_t      used;
+    size_t      size;
+    char *      buffer;
+    //Set while the rest of a line too long to take is being skipped
+    int         skipping;
+} connection_t;
+
+//Held open to turn clients away with when out of descriptors
+static int spare_fd = -1;
+//The listeners, and whether they are left unwatched for now
+static connection_t **listening = NULL;
+static int listening_count = 0, paused = 0;
+
+/*
+ * Listens on a Unix domain socket at `path`, replacing a socket left
+ * there by an earlier run. Anything else at `path` is left alone, and
+ * the bind fails.
+ */
+int server_listen_unix(const char *path){
+    struct sockaddr_un address;
+    struct stat info;
+    int fd;
+
+    if(strlen(path) >= sizeof(address.sun_path))
+        err_abort(ENAMETOOLONG, "Socket path");
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        errno_abort("Create socket");
+    if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path);
+    if(bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+        errno_abort("Bind socket");
+    if(listen(fd, SOMAXCONN) < 0)
+        errno_abort("Listen on socket");
+    return fd;
+}
+
+/*
+ * Listens on a TCP port of the loopback interface.
+ */
+int server_listen_tcp(int port){
+    struct sockaddr_in address;
+    int fd, on = 1;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16_t) port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        errno_abort("Create socket");
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0)
+        errno_abort("Bind socket");
+    if(listen(fd, SOMAXCONN) < 0)
+        errno_abort("Listen on socket");
+    return fd;
+}
+
+static void watch(int epoll_fd, connection_t *connection){
+    struct epoll_event event;
+
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0)
+        errno_abort("Watch connection");
+}
+
+/*
+ * Stops watching the listeners, or watches them again.
+ */
+static void pause_listeners(int epoll_fd, int pause){
+    int i;
+
+    if(paused == pause)
+        return;
+    for(i = 0; i < listening_count; i++){
+        if(pause)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listening[i]->fd, NULL);
+        else
+            watch(epoll_fd, listening[i]);
+    }
+    paused = pause;
+}
+
+/*
+ * Turns away the first pending connection on a listening socket, using
+ * the spare descriptor to accept it with. Returns 1 if there was one, 0
+ * if there was none, and -1 if there is no spare.
+ */
+static int turn_away(connection_t *listener){
+    int fd;
+
+    if(spare_fd < 0)
+        spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if(spare_fd < 0)
+        return -1;
+    close(spare_fd);
+    fd = accept(listener->fd, NULL, NULL);
+    if(fd >= 0)
+        close(fd);
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0;
+}
+
+/*
+ * Accepts every pending connection on a listening socket.
+ */
+static void accept_clients(int epoll_fd, connection_t *listener){
+    struct timeval timeout = {
+        SERVER_SEND_TIMEOUT_MS / 1000, (SERVER_SEND_TIMEOUT_MS % 1000) * 1000
+    };
+    connection_t *connection;
+    int fd, writer_fd, on = 1, turned;
+
+    while(1){
+        fd = accept(listener->fd, NULL, NULL);
+        if(fd < 0 && (errno == EMFILE || errno == ENFILE)){
+            turned = turn_away(listener);
+            if(turned > 0)
+                continue;
+            if(turned < 0)
+                pause_listeners(epoll_fd, 1);
+            return;
+        }
+        if(fd < 0)
+            break;
+        writer_fd = fcntl(fd, F_DUPFD, 0);
+        connection = (connection_t *) malloc(sizeof(connection_t));
+        if(connection != NULL && (connection->buffer = (char *) malloc(SERVER_BUFFER)) == NULL){
+            free(connection);
+            connection = NULL;
+        }
+        if(writer_fd < 0 || connection == NULL){
+            //Out of descriptors or memory, turn the client away
+            if(writer_fd >= 0)
+                close(writer_fd);
+            free(connection);
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        //Answers are small and should not wait for more
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        connection->fd = fd;
+        connection->listening = 0;
+        connection->used = 0;
+        connection->size = SERVER_BUFFER;
+        connection->skipping = 0;
+        connection->client = output_open(writer_fd);
+        watch(epoll_fd, connection);
+    }
+    if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+        errno_abort("Accept connection");
+}
+
+static void hang_up(int epoll_fd, connection_t *connection, server_closed_t closed){
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    closed(connection->client);
+    free(connection->buffer);
+    free(connection);
+    //A descriptor is free again
+    pause_listeners(epoll_fd, 0);
+}
+
+/*
+ * Reads what a client sent, and hands over the complete lines.
+ */
+static void read_client(int epoll_fd, connection_t *connection, server_lines_t lines,
+                        server_closed_t closed){
+    const char *done, *newline;
+    char *buffer;
+    ssize_t bytes;
+    size_t rest;
+
+    bytes = recv(connection->fd, connection->buffer + connection->used,
+                 connection->size - connection->used, MSG_DONTWAIT);
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return;
+    if(bytes <= 0){
+        hang_up(epoll_fd, connection, closed);
+        return;
+    }
+    connection->used += (size_t) bytes;
+    done = connection->buffer;
+    if(connection->skipping){
+        newline = memchr(done, '\n', connection->used);
+        if(newline == NULL){
+            connection->used = 0;
+            return;
+        }
+        connection->skipping = 0;
+        done = newline + 1;
+    }
+    done = lines(connection->client, done, connection->buffer + connection->used);
+    rest = connection->used - (size_t) (done - connection->buffer);
+    memmove(connection->buffer, done, rest);
+    connection->used = rest;
+    if(rest < connection->size)
+        return;
+
+    //A partial line fills the buffer. Make room for more of it, or drop it
+    //if it is too long to be taken.
+    buffer = connection->size * 2 <= SERVER_MAX_LINE
+             ? (char *) realloc(connection->buffer, connection->size * 2) : NULL;
+    if(buffer == NULL){
+        connection->skipping = 1;
+        connection->used = 0;
+        return;
+    }
+    connection->buffer = buffer;
+    connection->size *= 2;
+}
+
+/*
+ * Serves clients on the listening sockets until the process exits.
+ */
+void server_run(int *listeners, int count, server_lines_t lines, server_closed_t closed){
+    struct epoll_event events[SERVER_EVENTS];
+    connection_t *connection;
+    int epoll_fd, ready, i;
+
+    //A client that hangs up makes the writer fail, not the process die
+    signal(SIGPIPE, SIG_IGN);
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(epoll_fd < 0)
+        errno_abort("Create epoll");
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    listening = (connection_t **) malloc(count * sizeof(connection_t *));
+    if(listening == NULL)
+        errno_abort("Allocate listeners");
+    listening_count = count;
+    for(i = 0; i < count; i++){
+        connection = (connection_t *) calloc(1, sizeof(connection_t));
+        if(connection == NULL)
+            errno_abort("Allocate listener");
+        connection->fd = listeners[i];
+        connection->listening = 1;
+        listening[i] = connection;
+        watch(epoll_fd, connection);
+    }
+
+    while(1){
+        ready = epoll_wait(epoll_fd, events, SERVER_EVENTS, paused ? SERVER_RETRY_MS : -1);
+        if(ready < 0){
+            if(errno == EINTR)
+                continue;
+            errno_abort("Wait for clients");
+        }
+        if(ready == 0)
+            pause_listeners(epoll_fd, 0);
+        for(i = 0; i < ready; i++){
+            connection = (connection_t *) events[i].data.ptr;
+            if(connection->listening)
+                accept_clients(epoll_fd, connection);
+            else
+                read_client(epoll_fd, connection, lines, closed);
+        }
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef __server_h
+#define __server_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Socket front end.
+ *
+ * Listens on a Unix domain socket, on a TCP port on the loopback
+ * interface, or both, and serves any number of clients from one epoll
+ * loop. Clients send the same lines as are typed at the prompt, and may
+ * send as many as they like without waiting for the answers.
+ *
+ * Each connection gets an output destination (see output.h), which names
+ * the client. Whatever arrives on a connection is handed in blocks of
+ * complete lines to `lines`, which returns how far it got; a partial last
+ * line is kept for the next read. A connection reads into SERVER_BUFFER
+ * bytes, and more for longer lines, but a line of SERVER_MAX_LINE bytes
+ * or more is dropped. Once the client hangs up, `closed` is
+ * called, and must see to it that the destination gets closed.
+ *
+ * Output goes to clients through the output writer, which blocks on a
+ * client for at most SERVER_SEND_TIMEOUT_MS before giving up on it.
+ */
+#define SERVER_BUFFER 16384
+#define SERVER_MAX_LINE (1 << 20)
+#define SERVER_SEND_TIMEOUT_MS 1000
+
+typedef const char * (*server_lines_t)(uint32_t client, const char *p, const char *end);
+typedef void (*server_closed_t)(uint32_t client);
+
+int server_listen_unix(const char *path);
+int server_listen_tcp(int port);
+void server_run(int *listeners, int count, server_lines_t lines, server_closed_t closed);
+
+#endif
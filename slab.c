@@ -0,0 +1,186 @@
+/*
+ * slab.c
+ *
+ * Fixed size slab allocator. See slab.h for an overview.
+ */
+#include "slab.h"
+#include "errors.h"
+
+/*
+ * A thread's own free list for one cache, and the allocations it made
+ * since it last folded its statistics into the cache.
+ */
+typedef struct slab_local {
+    void *  head;
+    int     count;
+    long    allocs;
+    int     registered;
+} slab_local_t;
+
+static __thread slab_local_t local_lists[SLAB_MAX_CACHES];
+
+static slab_cache_t *caches[SLAB_MAX_CACHES];
+static int cache_count = 0;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+//Free objects are linked through their first word
+#define NEXT(object) (*(void **) (object))
+
+/*
+ * Requires the cache mutex.
+ */
+static void fold_stats(slab_cache_t *cache, slab_local_t *local){
+    cache->live += local->allocs;
+    local->allocs = 0;
+    if(cache->live > 0 && (size_t) cache->live > cache->high_water)
+        cache->high_water = (size_t) cache->live;
+}
+
+/*
+ * Carves a new slab into objects on the cache's free list.
+ * Requires the cache mutex.
+ */
+static void carve_slab(slab_cache_t *cache){
+    size_t count = SLAB_SIZE / cache->size, i;
+    char *slab;
+
+    if(count < SLAB_BATCH)
+        count = SLAB_BATCH;
+    slab = (char *) malloc(count * cache->size);
+    if(slab == NULL){
+        printf("Out of memory!\n");
+        exit(1);
+    }
+    for(i = 0; i < count; i++){
+        NEXT(slab + i * cache->size) = cache->free_list;
+        cache->free_list = slab + i * cache->size;
+    }
+    cache->total += count;
+}
+
+/*
+ * Gives back all but `keep` objects of a thread's list to the cache.
+ */
+static void flush_local(slab_cache_t *cache, slab_local_t *local, int keep){
+    void *object;
+
+    pthread_mutex_lock(&cache->mutex);
+    fold_stats(cache, local);
+    while(local->count > keep){
+        object = local->head;
+        local->head = NEXT(object);
+        NEXT(object) = cache->free_list;
+        cache->free_list = object;
+        local->count--;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+ * Returns a thread's objects to their caches when the thread exits.
+ */
+static void flush_thread(void *unused){
+    int i;
+
+    for(i = 0; i < cache_count; i++){
+        if(local_lists[i].registered)
+            flush_local(caches[i], &local_lists[i], 0);
+    }
+}
+
+static void create_exit_key(){
+    if(pthread_key_create(&exit_key, flush_thread) != 0)
+        errno_abort("Create slab key");
+}
+
+static slab_local_t * local_list(slab_cache_t *cache){
+    slab_local_t *local = &local_lists[cache->index];
+
+    if(!local->registered){
+        local->registered = 1;
+        //Any non-NULL value makes the destructor run on thread exit
+        pthread_setspecific(exit_key, (void *) 1);
+    }
+    return local;
+}
+
+void slab_init(slab_cache_t *cache, const char *name, size_t size){
+    pthread_once(&exit_key_once, create_exit_key);
+
+    //Room for the free list link, and keep objects aligned
+    if(size < sizeof(void *))
+        size = sizeof(void *);
+    size = (size + 15) & ~((size_t) 15);
+
+    cache->name = name;
+    cache->size = size;
+    cache->free_list = NULL;
+    cache->total = 0;
+    cache->live = 0;
+    cache->high_water = 0;
+    if(pthread_mutex_init(&cache->mutex, NULL) != 0)
+        errno_abort("Init slab mutex");
+
+    pthread_mutex_lock(&registry_mutex);
+    if(cache_count == SLAB_MAX_CACHES)
+        err_abort(1, "Too many slab caches");
+    cache->index = cache_count;
+    caches[cache_count++] = cache;
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+void * slab_alloc(slab_cache_t *cache){
+    slab_local_t *local = local_list(cache);
+    void *object;
+
+    if(local->head == NULL){
+        //Take a batch from the cache
+        pthread_mutex_lock(&cache->mutex);
+        fold_stats(cache, local);
+        while(local->count < SLAB_BATCH){
+            if(cache->free_list == NULL)
+                carve_slab(cache);
+            object = cache->free_list;
+            cache->free_list = NEXT(object);
+            NEXT(object) = local->head;
+            local->head = object;
+            local->count++;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+    }
+
+    object = local->head;
+    local->head = NEXT(object);
+    local->count--;
+    local->allocs++;
+    return object;
+}
+
+void slab_free(slab_cache_t *cache, void *object){
+    slab_local_t *local = local_list(cache);
+
+    if(object == NULL)
+        return;
+    NEXT(object) = local->head;
+    local->head = object;
+    local->count++;
+    local->allocs--;
+
+    //Keep a batch around for the next allocations, give back the rest
+    if(local->count >= 2 * SLAB_BATCH)
+        flush_local(cache, local, SLAB_BATCH);
+}
+
+void slab_get_stats(slab_cache_t *cache, slab_stats_t *stats){
+    long live;
+
+    pthread_mutex_lock(&cache->mutex);
+    fold_stats(cache, local_list(cache));
+    live = cache->live < 0 ? 0 : cache->live;
+    stats->live = (size_t) live;
+    stats->free = cache->total - (size_t) live;
+    stats->high_water = cache->high_water;
+    pthread_mutex_unlock(&cache->mutex);
+}
@@ -0,0 +1,47 @@
+#ifndef __slab_h
+#define __slab_h
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Fixed size slab allocator.
+ *
+ * Each cache hands out objects of one size, carved out of large slabs that
+ * are never given back to malloc. Freed objects are recycled through a free
+ * list in the freeing thread, so allocating and freeing is usually just a
+ * pointer swap with no locking. When a thread's list runs empty or grows too
+ * long, objects move in batches to or from the cache's shared free list.
+ * Objects may be freed by a different thread than the one that allocated
+ * them.
+ *
+ * Statistics are folded into the cache whenever a thread exchanges a batch,
+ * so they are exact to within one batch per thread.
+ */
+#define SLAB_MAX_CACHES 16
+#define SLAB_BATCH 32
+#define SLAB_SIZE (64 * 1024)
+
+typedef struct slab_stats {
+    size_t  live;
+    size_t  free;
+    size_t  high_water;
+} slab_stats_t;
+
+typedef struct slab_cache {
+    const char *        name;
+    size_t              size;
+    int                 index;
+    pthread_mutex_t     mutex;
+    void *              free_list;
+    size_t              total;
+    long                live;
+    size_t              high_water;
+} slab_cache_t;
+
+void slab_init(slab_cache_t *cache, const char *name, size_t size);
+void * slab_alloc(slab_cache_t *cache);
+void slab_free(slab_cache_t *cache, void *object);
+void slab_get_stats(slab_cache_t *cache, slab_stats_t *stats);
+
+#endif
@@ -0,0 +1,238 @@
+/*
+ * sweep.c
+ *
+ * Central deadline sweep. See sweep.h for an overview.
+ */
+#include "sweep.h"
+#include "errors.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SWEEP_X86
+#endif
+
+typedef size_t (*sweep_kernel_t)(uint64_t *deadlines, const uint64_t *periods, size_t count,
+                                 uint64_t now, uint32_t *due, uint64_t *next);
+
+/*
+ * Re-arms one due deadline.
+ */
+static inline uint64_t rearm(uint64_t deadline, uint64_t period, uint64_t now){
+    deadline += period;
+    return deadline > now ? deadline : now + period;
+}
+
+/*
+ * Sweeps deadlines from `start` on, one at a time. Also finishes off what
+ * the vector kernels leave over.
+ */
+static size_t sweep_tail(uint64_t *deadlines, const uint64_t *periods, size_t start,
+                         size_t count, uint64_t now, uint32_t *due, size_t found,
+                         uint64_t *next){
+    uint64_t earliest = *next;
+    size_t i;
+
+    for(i = start; i < count; i++){
+        if(deadlines[i] <= now){
+            due[found++] = (uint32_t) i;
+            deadlines[i] = rearm(deadlines[i], periods[i], now);
+        }
+        if(deadlines[i] < earliest)
+            earliest = deadlines[i];
+    }
+    *next = earliest;
+    return found;
+}
+
+static size_t sweep_scalar(uint64_t *deadlines, const uint64_t *periods, size_t count,
+                           uint64_t now, uint32_t *due, uint64_t *next){
+    *next = UINT64_MAX;
+    return sweep_tail(deadlines, periods, 0, count, now, due, 0, next);
+}
+
+#ifdef SWEEP_X86
+__attribute__((target("avx2")))
+static size_t sweep_avx2(uint64_t *deadlines, const uint64_t *periods, size_t count,
+                         uint64_t now, uint32_t *due, uint64_t *next){
+    __m256i vnow = _mm256_set1_epi64x((long long) now);
+    __m256i earliest = _mm256_set1_epi64x(INT64_MAX);
+    __m256i deadline, period, armed, later;
+    uint64_t lanes[4];
+    size_t i, found = 0;
+    int mask;
+
+    for(i = 0; i + 4 <= count; i += 4){
+        deadline = _mm256_loadu_si256((const __m256i *) (deadlines + i));
+        later = _mm256_cmpgt_epi64(deadline, vnow);
+        mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(later)) & 0xF;
+        if(mask != 0){
+            period = _mm256_loadu_si256((const __m256i *) (periods + i));
+            armed = _mm256_add_epi64(deadline, period);
+            armed = _mm256_blendv_epi8(_mm256_add_epi64(vnow, period), armed,
+                                       _mm256_cmpgt_epi64(armed, vnow));
+            deadline = _mm256_blendv_epi8(armed, deadline, later);
+            _mm256_storeu_si256((__m256i *) (deadlines + i), deadline);
+            do {
+                due[found++] = (uint32_t) (i + __builtin_ctz(mask));
+                mask &= mask - 1;
+            } while(mask != 0);
+        }
+        earliest = _mm256_blendv_epi8(earliest, deadline, _mm256_cmpgt_epi64(earliest, deadline));
+    }
+
+    _mm256_storeu_si256((__m256i *) lanes, earliest);
+    *next = lanes[0];
+    for(mask = 1; mask < 4; mask++)
+        if(lanes[mask] < *next)
+            *next = lanes[mask];
+    return sweep_tail(deadlines, periods, i, count, now, due, found, next);
+}
+
+__attribute__((target("sse4.2")))
+static size_t sweep_sse(uint64_t *deadlines, const uint64_t *periods, size_t count,
+                        uint64_t now, uint32_t *due, uint64_t *next){
+    __m128i vnow = _mm_set1_epi64x((long long) now);
+    __m128i earliest = _mm_set1_epi64x(INT64_MAX);
+    __m128i deadline, period, armed, later;
+    uint64_t lanes[2];
+    size_t i, found = 0;
+    int mask;
+
+    for(i = 0; i + 2 <= count; i += 2){
+        deadline = _mm_loadu_si128((const __m128i *) (deadlines + i));
+        later = _mm_cmpgt_epi64(deadline, vnow);
+        mask = ~_mm_movemask_pd(_mm_castsi128_pd(later)) & 0x3;
+        if(mask != 0){
+            period = _mm_loadu_si128((const __m128i *) (periods + i));
+            armed = _mm_add_epi64(deadline, period);
+            armed = _mm_blendv_epi8(_mm_add_epi64(vnow, period), armed,
+                                    _mm_cmpgt_epi64(armed, vnow));
+            deadline = _mm_blendv_epi8(armed, deadline, later);
+            _mm_storeu_si128((__m128i *) (deadlines + i), deadline);
+            do {
+                due[found++] = (uint32_t) (i + __builtin_ctz(mask));
+                mask &= mask - 1;
+            } while(mask != 0);
+        }
+        earliest = _mm_blendv_epi8(earliest, deadline, _mm_cmpgt_epi64(earliest, deadline));
+    }
+
+    _mm_storeu_si128((__m128i *) lanes, earliest);
+    *next = lanes[0] < lanes[1] ? lanes[0] : lanes[1];
+    return sweep_tail(deadlines, periods, i, count, now, due, found, next);
+}
+#endif
+
+static const struct {
+    const char *    name;
+    sweep_kernel_t  kernel;
+} kernels[] = {
+#ifdef SWEEP_X86
+    {"avx2", sweep_avx2},
+    {"sse", sweep_sse},
+#endif
+    {"scalar", sweep_scalar},
+};
+
+#define KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static size_t selected = KERNELS;
+
+static int supported(size_t kernel){
+#ifdef SWEEP_X86
+    if(kernels[kernel].kernel == sweep_avx2)
+        return __builtin_cpu_supports("avx2");
+    if(kernels[kernel].kernel == sweep_sse)
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    return 1;
+}
+
+/*
+ * Picks the sweep kernel by name, "avx2", "sse" or "scalar". Returns 0 if
+ * there is no such kernel, or the processor does not support it.
+ */
+int sweep_select(const char *kernel){
+    size_t i;
+
+    for(i = 0; i < KERNELS; i++){
+        if(strcmp(kernels[i].name, kernel) == 0 && supported(i)){
+            selected = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char * sweep_kernel(void){
+    return kernels[selected].name;
+}
+
+/*
+ * Unless one was selected already, picks the fastest kernel the processor
+ * supports.
+ */
+void sweep_init(sweep_t *sweep, size_t capacity){
+    size_t i;
+
+    if(selected == KERNELS){
+        for(i = 0; !supported(i); i++)
+            ;
+        selected = i;
+    }
+    sweep->count = 0;
+    sweep->capacity = capacity < 16 ? 16 : capacity;
+    sweep->deadlines = (uint64_t *) malloc(sweep->capacity * sizeof(uint64_t));
+    sweep->periods = (uint64_t *) malloc(sweep->capacity * sizeof(uint64_t));
+    sweep->items = (void **) malloc(sweep->capacity * sizeof(void *));
+    if(sweep->deadlines == NULL || sweep->periods == NULL || sweep->items == NULL)
+        errno_abort("Allocate sweep");
+}
+
+/*
+ * Adds an item and returns its slot.
+ */
+size_t sweep_add(sweep_t *sweep, void *item, uint64_t deadline, uint64_t period){
+    if(sweep->count == sweep->capacity){
+        sweep->capacity *= 2;
+        sweep->deadlines = (uint64_t *) realloc(sweep->deadlines,
+                                                sweep->capacity * sizeof(uint64_t));
+        sweep->periods = (uint64_t *) realloc(sweep->periods, sweep->capacity * sizeof(uint64_t));
+        sweep->items = (void **) realloc(sweep->items, sweep->capacity * sizeof(void *));
+        if(sweep->deadlines == NULL || sweep->periods == NULL || sweep->items == NULL)
+            errno_abort("Grow sweep");
+    }
+    sweep->deadlines[sweep->count] = deadline;
+    sweep->periods[sweep->count] = period;
+    sweep->items[sweep->count] = item;
+    return sweep->count++;
+}
+
+/*
+ * Removes a slot. Returns the item moved into it, whose slot the caller
+ * must update, or NULL if it was the last.
+ */
+void * sweep_remove(sweep_t *sweep, size_t slot){
+    size_t last = --sweep->count;
+
+    if(slot == last)
+        return NULL;
+    sweep->deadlines[slot] = sweep->deadlines[last];
+    sweep->periods[slot] = sweep->periods[last];
+    sweep->items[slot] = sweep->items[last];
+    return sweep->items[slot];
+}
+
+/*
+ * Finds every slot due at `now`, re-arms it, and stores its number in
+ * `due`, which must have room for every slot. Sets `next` to the earliest
+ * deadline after the sweep, or UINT64_MAX if there are no slots. Returns
+ * the number of due slots, in slot order.
+ */
+size_t sweep_run(sweep_t *sweep, uint64_t now, uint32_t *due, uint64_t *next){
+    if(sweep->count == 0){
+        *next = UINT64_MAX;
+        return 0;
+    }
+    return kernels[selected].kernel(sweep->deadlines, sweep->periods, sweep->count,
+                                    now, due, next);
+}
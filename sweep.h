@@ -0,0 +1,40 @@
+#ifndef __sweep_h
+#define __sweep_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Central deadline sweep.
+ *
+ * An alternative to the timing wheel, for a single thread firing a large
+ * number of periodic alarms. Deadlines and periods are kept in packed
+ * arrays, and one pass over them finds every due alarm, re-arms it by
+ * adding its period to its deadline, and works out the earliest deadline
+ * left. An alarm that fell more than a period behind is re-armed a period
+ * from now instead, skipping the displays it missed.
+ *
+ * The pass compares four deadlines at a time with AVX2, or two with SSE4.2,
+ * whichever the processor supports; sweep_select() picks one by name.
+ * Deadlines must stay under 2^63, as the vector compares are signed.
+ *
+ * Slots are dense: removing one moves the last into its place.
+ *
+ * The sweep does no locking of its own; the caller must serialize access.
+ */
+typedef struct sweep {
+    uint64_t *  deadlines;
+    uint64_t *  periods;
+    void **     items;
+    size_t      count;
+    size_t      capacity;
+} sweep_t;
+
+void sweep_init(sweep_t *sweep, size_t capacity);
+int sweep_select(const char *kernel);
+const char * sweep_kernel(void);
+size_t sweep_add(sweep_t *sweep, void *item, uint64_t deadline, uint64_t period);
+void * sweep_remove(sweep_t *sweep, size_t slot);
+size_t sweep_run(sweep_t *sweep, uint64_t now, uint32_t *due, uint64_t *next);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * binary_test.c
+ *
+ * Binary command records read back what was written, status records
+ * carry the event they were made from, and malformed records are caught.
+ */
+#include <string.h>
+#include <endian.h>
+#include "check.h"
+#include "../binary.h"
+
+/*
+ * Writes a command record the way a producer would, and returns its length.
+ */
+static size_t command(char *out, int op, int unit, int reserved, int32_t number,
+                      int32_t interval, const char *message){
+    uint32_t length = (uint32_t) (BINARY_COMMAND_SIZE + strlen(message));
+    uint32_t message_length = htole32((uint32_t) strlen(message));
+    uint16_t reserved16 = htole16((uint16_t) reserved);
+
+    length = htole32(length);
+    number = (int32_t) htole32((uint32_t) number);
+    interval = (int32_t) htole32((uint32_t) interval);
+    memcpy(out, &length, 4);
+    out[4] = (char) op;
+    out[5] = (char) unit;
+    memcpy(out + 6, &reserved16, 2);
+    memcpy(out + 8, &number, 4);
+    memcpy(out + 12, &interval, 4);
+    memcpy(out + 16, &message_length, 4);
+    memcpy(out + BINARY_COMMAND_SIZE, message, strlen(message));
+    return BINARY_COMMAND_SIZE + strlen(message);
+}
+
+static void check_records(){
+    parsed_command_t parsed;
+    char buffer[256];
+    uint32_t bad;
+    size_t length, size, used;
+
+    size = command(buffer, BINARY_OP_SET, PARSE_UNIT_MS, 0, -42, 250, "hello");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_SET);
+    CHECK(length == size);
+    CHECK(parsed.alarm_number == -42 && parsed.interval == 250 && parsed.unit == PARSE_UNIT_MS);
+    CHECK(parsed.message_length == 5 && memcmp(parsed.message, "hello", 5) == 0);
+
+    //Two records back to back, the second cut short
+    used = command(buffer, BINARY_OP_CANCEL, 0, 0, 7, 0, "");
+    size = used + command(buffer + used, BINARY_OP_SET, 0, 0, 8, 1, "again");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_CANCEL);
+    CHECK(length == used && parsed.alarm_number == 7);
+    CHECK(binary_parse(buffer + used, buffer + size - 1, &parsed, &length) == BINARY_INCOMPLETE);
+    CHECK(binary_parse(buffer + used, buffer + used + 3, &parsed, &length) == BINARY_INCOMPLETE);
+    CHECK(binary_parse(buffer + used, buffer + size, &parsed, &length) == PARSE_SET);
+
+    //Well framed, but meaningless
+    size = command(buffer, 9, 0, 0, 1, 1, "x");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    CHECK(length == size && parsed.alarm_number == 1);
+    size = command(buffer, BINARY_OP_SET, 3, 0, 1, 1, "x");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    size = command(buffer, BINARY_OP_CANCEL, 0, 0, 1, 0, "x");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    size = command(buffer, BINARY_OP_SET, 0, 1, 1, 1, "x");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    size = command(buffer, BINARY_OP_CANCEL, 0, 0x100, 1, 0, "");
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    size = command(buffer, BINARY_OP_SET, 0, 0, 1, 1, "abc");
+    buffer[16] = 2;
+    CHECK(binary_parse(buffer, buffer + size, &parsed, &length) == PARSE_INCORRECT_FORMAT);
+    CHECK(length == size);
+
+    //Lengths that cannot be a record's
+    bad = htole32(BINARY_COMMAND_SIZE - 1);
+    memcpy(buffer, &bad, 4);
+    CHECK(binary_parse(buffer, buffer + sizeof(buffer), &parsed, &length) == BINARY_BROKEN);
+    bad = htole32(BINARY_MAX_RECORD + 1);
+    memcpy(buffer, &bad, 4);
+    CHECK(binary_parse(buffer, buffer + sizeof(buffer), &parsed, &length) == BINARY_BROKEN);
+}
+
+static void check_status(){
+    alarm_event_t event;
+    binary_status_t status;
+    size_t message;
+
+    memset(&event, 0, sizeof(event));
+    event.type = ALARM_EVENT_FIRED;
+    event.alarm_number = 12;
+    event.interval = 3;
+    event.unit = PARSE_UNIT_US;
+    event.replaced = 1;
+    event.message = "displayed";
+    event.message_length = 9;
+    event.time = 1700000000;
+    message = binary_status(&event, 100, &status);
+    CHECK(message == 9);
+    CHECK(le32toh(status.length) == BINARY_STATUS_SIZE + 9);
+    CHECK(status.type == ALARM_EVENT_FIRED && status.unit == PARSE_UNIT_US);
+    CHECK(le16toh(status.flags) == BINARY_FLAG_REPLACED);
+    CHECK((int32_t) le32toh((uint32_t) status.alarm_number) == 12);
+    CHECK((int32_t) le32toh((uint32_t) status.interval) == 3);
+    CHECK(le32toh(status.message_length) == 9);
+    CHECK((int64_t) le64toh((uint64_t) status.time) == 1700000000);
+    CHECK(sizeof(status) == BINARY_STATUS_SIZE);
+
+    //Cut short to fit
+    message = binary_status(&event, 4, &status);
+    CHECK(message == 4 && le32toh(status.length) == BINARY_STATUS_SIZE + 4);
+    CHECK(le16toh(status.flags) == (BINARY_FLAG_REPLACED | BINARY_FLAG_TRUNCATED));
+
+    //Replies leave the message out
+    memset(&event, 0, sizeof(event));
+    event.type = ALARM_EVENT_CANCEL_RANGE;
+    event.alarm_number = 1;
+    event.last_number = 9;
+    event.count = 5;
+    event.message = "unused";
+    event.message_length = 6;
+    message = binary_status(&event, 100, &status);
+    CHECK(message == 0 && le32toh(status.length) == BINARY_STATUS_SIZE);
+    CHECK((int32_t) le32toh((uint32_t) status.last_number) == 9);
+    CHECK(le64toh(status.count) == 5);
+}
+
+int main(){
+    check_records();
+    check_status();
+    return check_result("binary_test");
+}
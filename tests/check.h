@@ -0,0 +1,29 @@
+#ifndef __check_h
+#define __check_h
+
+#include <stdio.h>
+
+/*
+ * What the tests share: CHECK() notes a failed condition, with where it
+ * is, and carries on, so that one run shows every failure. A test's main
+ * returns check_result().
+ */
+static int check_failures = 0;
+
+#define CHECK(condition) do { \
+    if(!(condition)){ \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        check_failures++; \
+    } \
+} while(0)
+
+static inline int check_result(const char *name){
+    if(check_failures > 0){
+        fprintf(stderr, "%s: %d checks failed\n", name, check_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+#endif
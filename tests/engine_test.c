@@ -0,0 +1,182 @@
+/*
+ * engine_test.c
+ *
+ * Sequences of requests against the engine on the virtual clock, where
+ * every event comes on this thread, in an order that is the same every run.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include "check.h"
+#include "../alarm_engine.h"
+
+#define MAX_EVENTS 64
+#define START (1000 * 1000000000ull)
+#define SECOND 1000000000ull
+
+typedef struct seen {
+    int     type;
+    int     alarm_number;
+    size_t  count;
+    char    message[16];
+} seen_t;
+
+static seen_t events[MAX_EVENTS];
+static int event_count = 0;
+//The entries of the last list page, and the last Stats line
+static alarm_entry_t listed[8];
+static char stats[4096];
+
+static void record(const alarm_event_t *event, void *context){
+    seen_t *seen;
+
+    (void) context;
+    if(event_count == MAX_EVENTS)
+        return;
+    seen = &events[event_count++];
+    seen->type = event->type;
+    seen->alarm_number = event->alarm_number;
+    seen->count = event->count;
+    if(event->type == ALARM_EVENT_STATS)
+        snprintf(stats, sizeof(stats), "%.*s", (int) event->message_length, event->message);
+    if(event->type == ALARM_EVENT_LIST_PAGE)
+        memcpy(listed, event->entries,
+               (event->count < 8 ? event->count : 8) * sizeof(alarm_entry_t));
+    memset(seen->message, 0, sizeof(seen->message));
+    if(event->message != NULL)
+        memcpy(seen->message, event->message,
+               event->message_length < sizeof(seen->message) - 1
+               ? event->message_length : sizeof(seen->message) - 1);
+}
+
+/*
+ * How many of the events since `from` are of `type`, for `alarm_number`,
+ * with `message` if it is not NULL.
+ */
+static int seen(int from, int type, int alarm_number, const char *message){
+    int i, found = 0;
+
+    for(i = from; i < event_count; i++)
+        if(events[i].type == type && events[i].alarm_number == alarm_number
+           && (message == NULL || strcmp(events[i].message, message) == 0))
+            found++;
+    return found;
+}
+
+/*
+ * A set after a cancel still waiting to be carried out sets a new alarm:
+ * the cancel goes first, and takes the old alarm with it.
+ */
+static void check_cancel_then_set(){
+    int from = event_count;
+
+    alarm_engine_set(1, 1, 5, PARSE_UNIT_S, "a", 1);
+    alarm_engine_cancel(1, 1);
+    alarm_engine_set(1, 1, 5, PARSE_UNIT_S, "b", 1);
+    alarm_engine_flush();
+    CHECK(event_count - from == 3);
+    CHECK(events[from].type == ALARM_EVENT_SET);
+    CHECK(events[from + 1].type == ALARM_EVENT_CANCEL);
+    CHECK(events[from + 2].type == ALARM_EVENT_SET && strcmp(events[from + 2].message, "b") == 0);
+
+    from = event_count;
+    alarm_engine_advance(START + SECOND);
+    CHECK(seen(from, ALARM_EVENT_CANCELLED, 1, "a") == 1);
+    CHECK(seen(from, ALARM_EVENT_FIRED, 1, "b") == 1);
+    CHECK(seen(from, ALARM_EVENT_FIRED, 1, "a") == 0);
+
+    //The new alarm stays
+    from = event_count;
+    alarm_engine_count(1, 1, 1);
+    CHECK(event_count - from == 1 && events[from].type == ALARM_EVENT_COUNT);
+    CHECK(events[from].count == 1);
+    from = event_count;
+    alarm_engine_advance(START + 6 * SECOND);
+    CHECK(seen(from, ALARM_EVENT_FIRED, 1, "b") == 1);
+    CHECK(seen(from, ALARM_EVENT_CANCELLED, 1, NULL) == 0);
+}
+
+/*
+ * A set of an alarm that is not being cancelled still replaces it, and a
+ * second cancel is still turned down.
+ */
+static void check_replace_and_cancel(){
+    int from = event_count;
+
+    alarm_engine_set(1, 2, 5, PARSE_UNIT_S, "first", 5);
+    alarm_engine_set(1, 2, 5, PARSE_UNIT_S, "second", 6);
+    alarm_engine_cancel(1, 2);
+    alarm_engine_cancel(1, 2);
+    alarm_engine_cancel(1, 3);
+    alarm_engine_flush();
+    CHECK(event_count - from == 5);
+    CHECK(events[from].type == ALARM_EVENT_SET);
+    CHECK(events[from + 1].type == ALARM_EVENT_REPLACE);
+    CHECK(events[from + 2].type == ALARM_EVENT_CANCEL);
+    CHECK(events[from + 3].type == ALARM_EVENT_ALREADY_CANCELLING);
+    CHECK(events[from + 4].type == ALARM_EVENT_NO_SUCH_ALARM);
+
+    from = event_count;
+    alarm_engine_count(1, 2, 2);
+    CHECK(event_count - from == 1 && events[from].count == 0);
+}
+
+/*
+ * A list shows what each alarm is up to, with the requests before it
+ * applied, up to where a shard would be when getting to it.
+ */
+static void check_list(){
+    int from;
+
+    alarm_engine_set(1, 10, 5, PARSE_UNIT_S, "ten", 3);
+    alarm_engine_set(1, 11, 5, PARSE_UNIT_S, "eleven", 6);
+    alarm_engine_set(1, 12, 5, PARSE_UNIT_S, "twelve", 6);
+    alarm_engine_flush();
+    from = event_count;
+    alarm_engine_set(1, 11, 250, PARSE_UNIT_MS, "eleven", 6);
+    alarm_engine_cancel(1, 12);
+    alarm_engine_list(1, 10, 12);
+    CHECK(event_count - from == 4);
+    CHECK(events[from].type == ALARM_EVENT_REPLACE);
+    CHECK(events[from + 1].type == ALARM_EVENT_CANCEL);
+    CHECK(events[from + 2].type == ALARM_EVENT_LIST && events[from + 2].count == 2);
+    CHECK(events[from + 3].type == ALARM_EVENT_LIST_PAGE && events[from + 3].count == 2);
+    CHECK(listed[0].alarm_number == 10 && listed[0].state == ALARM_ENTRY_SET);
+    CHECK(listed[0].interval == 5 && listed[0].unit == PARSE_UNIT_S);
+    //Its first display is due right away
+    CHECK(listed[0].next == START + 6 * SECOND);
+    //Not published until the end of the batch
+    CHECK(listed[1].alarm_number == 11 && listed[1].state == ALARM_ENTRY_REPLACING);
+    CHECK(listed[1].interval == 250 && listed[1].unit == PARSE_UNIT_MS);
+}
+
+/*
+ * The Stats line counts the objects of every slab cache.
+ */
+static void check_stats(){
+    const char *key;
+    size_t high_water = 0;
+
+    alarm_engine_stats(1, 0);
+    CHECK(strstr(stats, " live_alarms=3 ") != NULL);
+    CHECK(strstr(stats, " slab_alarm_live=") != NULL);
+    CHECK(strstr(stats, " slab_append_list_free=") != NULL);
+    CHECK(strstr(stats, " slab_thread_alarm_high_water=") != NULL);
+    key = strstr(stats, " slab_alarm_body_high_water=");
+    CHECK(key != NULL && sscanf(key, " slab_alarm_body_high_water=%zu", &high_water) == 1);
+    CHECK(high_water >= 3);
+}
+
+int main(){
+    alarm_engine_config_t config;
+
+    alarm_engine_default_config(&config);
+    config.virtual_clock = 1;
+    config.virtual_start = START;
+    alarm_engine_create(&config, record, NULL);
+
+    check_cancel_then_set();
+    check_replace_and_cancel();
+    check_list();
+    check_stats();
+    return check_result("engine_test");
+}
@@ -0,0 +1,165 @@
+/*
+ * journal_test.c
+ *
+ * Recovery from a journal a crash left torn, or a disk left corrupt: the
+ * records before the damage are replayed, and the rest is cut off so that
+ * new records follow the last good one.
+ *
+ * journal_open() starts a writer for the life of the process, so every
+ * open happens in a child of its own.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "check.h"
+#include "../journal.h"
+
+#define LONG_LENGTH 70000
+//The journal header, then the records below
+#define HEADER_SIZE 16
+#define RECORD_SIZE(length) (sizeof(journal_record_t) \
+        + ((length) >= JOURNAL_LONG_MESSAGE ? 4 : 0) + (length))
+
+typedef struct applied {
+    int     type;
+    int     alarm_number;
+    int     interval;
+    size_t  length;
+    char    first;
+} applied_t;
+
+static char directory[] = "/tmp/journal_testXXXXXX";
+static char path[sizeof(directory) + 16];
+static char long_message[LONG_LENGTH];
+static applied_t applied[16];
+static int applied_count = 0;
+
+static void apply(int type, int alarm_number, int interval, int unit,
+                  const char *message, size_t length){
+    (void) unit;
+    if(applied_count == 16)
+        return;
+    applied[applied_count].type = type;
+    applied[applied_count].alarm_number = alarm_number;
+    applied[applied_count].interval = interval;
+    applied[applied_count].length = length;
+    applied[applied_count].first = length > 0 ? message[0] : 0;
+    applied_count++;
+}
+
+/*
+ * Runs `child` in a process of its own, and returns what it exited with.
+ */
+static int in_child(int (*child)(void)){
+    int status;
+    pid_t pid;
+
+    fflush(NULL);
+    pid = fork();
+    if(pid == 0)
+        _exit(child());
+    if(pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return 1;
+    return WEXITSTATUS(status);
+}
+
+static int write_records(void){
+    if(journal_open(directory, apply) != 0)
+        return 1;
+    journal_append(JOURNAL_SET, 1, 5, 0, "one", 3);
+    journal_append(JOURNAL_SET, 2, 6, 1, long_message, LONG_LENGTH);
+    journal_append(JOURNAL_CANCEL, 1, 0, 0, NULL, 0);
+    journal_append(JOURNAL_SET, 3, 7, 2, "three", 5);
+    journal_commit();
+    journal_flush();
+    return 0;
+}
+
+static off_t file_size(){
+    struct stat info;
+
+    return stat(path, &info) == 0 ? info.st_size : -1;
+}
+
+/*
+ * Opens the journal and checks that the first `expected` records of the
+ * ones written come back, and nothing after them.
+ */
+static int expect(size_t expected){
+    static const off_t ends[] = {
+        HEADER_SIZE,
+        HEADER_SIZE + RECORD_SIZE(3),
+        HEADER_SIZE + RECORD_SIZE(3) + RECORD_SIZE(LONG_LENGTH),
+        HEADER_SIZE + RECORD_SIZE(3) + RECORD_SIZE(LONG_LENGTH) + RECORD_SIZE(0),
+        HEADER_SIZE + RECORD_SIZE(3) + RECORD_SIZE(LONG_LENGTH) + RECORD_SIZE(0)
+            + RECORD_SIZE(5),
+    };
+
+    CHECK(journal_open(directory, apply) == expected);
+    CHECK(applied_count == (int) expected);
+    if(expected >= 1)
+        CHECK(applied[0].type == JOURNAL_SET && applied[0].alarm_number == 1
+              && applied[0].length == 3 && applied[0].first == 'o');
+    if(expected >= 2)
+        CHECK(applied[1].type == JOURNAL_SET && applied[1].alarm_number == 2
+              && applied[1].interval == 6 && applied[1].length == LONG_LENGTH
+              && applied[1].first == 'x');
+    if(expected >= 3)
+        CHECK(applied[2].type == JOURNAL_CANCEL && applied[2].alarm_number == 1);
+    if(expected >= 4)
+        CHECK(applied[3].type == JOURNAL_SET && applied[3].alarm_number == 3
+              && applied[3].length == 5 && applied[3].first == 't');
+    CHECK(file_size() == ends[expected]);
+    return check_failures > 0;
+}
+
+static int expect_all(void){
+    return expect(4);
+}
+
+static int expect_three(void){
+    return expect(3);
+}
+
+static int expect_one(void){
+    return expect(1);
+}
+
+/*
+ * Flips a byte `offset` bytes into the journal.
+ */
+static void corrupt(off_t offset){
+    char byte;
+    int fd = open(path, O_RDWR);
+
+    CHECK(fd >= 0 && pread(fd, &byte, 1, offset) == 1);
+    byte ^= 0x40;
+    CHECK(pwrite(fd, &byte, 1, offset) == 1);
+    close(fd);
+}
+
+int main(){
+    memset(long_message, 'x', sizeof(long_message));
+    CHECK(mkdtemp(directory) != NULL);
+    snprintf(path, sizeof(path), "%s/journal", directory);
+
+    CHECK(in_child(write_records) == 0);
+    CHECK(in_child(expect_all) == 0);
+
+    //A record torn off at the end by a crash
+    CHECK(truncate(path, file_size() - 2) == 0);
+    CHECK(in_child(expect_three) == 0);
+
+    //A byte gone bad in the long record loses it and all after it
+    corrupt(HEADER_SIZE + RECORD_SIZE(3) + RECORD_SIZE(LONG_LENGTH) / 2);
+    CHECK(in_child(expect_one) == 0);
+
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/snapshot", directory);
+    unlink(path);
+    rmdir(directory);
+    return check_result("journal_test");
+}
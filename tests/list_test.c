@@ -0,0 +1,101 @@
+/*
+ * list_test.c
+ *
+ * Lists on the real engine, with its threads: a list shows the alarms as
+ * they were when it was asked for, whatever comes after it, and any
+ * number of lists can be asked for, one after the other.
+ */
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include "check.h"
+#include "../alarm_engine.h"
+#include "../output.h"
+
+#define ALARMS 200000
+#define MANY_LISTS 300
+#define LISTS (2 + MANY_LISTS)
+
+//Only the list thread touches these, one list after the other
+static int lists = 0;
+static size_t headers[LISTS], entries[LISTS];
+static int intervals[LISTS], out_of_order[LISTS];
+static int last_number;
+
+static void record(const alarm_event_t *event, void *context){
+    size_t i;
+    int list;
+
+    (void) context;
+    //Displays go through the output rings, from the display workers
+    if(event->type != ALARM_EVENT_LIST && event->type != ALARM_EVENT_LIST_PAGE){
+        output_printf("event %d alarm %d\n", event->type, event->alarm_number);
+        return;
+    }
+    if(event->type == ALARM_EVENT_LIST){
+        output_printf("list of %zu\n", event->count);
+        if(lists < LISTS)
+            headers[lists] = event->count;
+        lists++;
+        last_number = INT_MIN;
+        return;
+    }
+    output_printf("page of %zu\n", event->count);
+    list = lists - 1;
+    if(list < 0 || list >= LISTS)
+        return;
+    for(i = 0; i < event->count; i++){
+        out_of_order[list] += event->entries[i].alarm_number <= last_number;
+        last_number = event->entries[i].alarm_number;
+        if(intervals[list] == 0)
+            intervals[list] = event->entries[i].interval;
+        else if(intervals[list] != event->entries[i].interval)
+            intervals[list] = -1;
+    }
+    entries[list] += event->count;
+}
+
+int main(){
+    alarm_engine_config_t config;
+    output_policy_t policy;
+    int i;
+
+    output_default_policy(OUTPUT_LATENCY, &policy);
+    output_init(open("/dev/null", O_WRONLY), &policy);
+    alarm_engine_default_config(&config);
+    config.shards = 4;
+    config.workers = 4;
+    alarm_engine_create(&config, record, NULL);
+
+    for(i = 1; i <= ALARMS; i++)
+        alarm_engine_set(1, i, 1000, PARSE_UNIT_S, "listed", 6);
+    //Whatever follows the list changes nothing in it
+    alarm_engine_list(1, INT_MIN, INT_MAX);
+    for(i = 1; i <= 1000; i++)
+        alarm_engine_cancel(1, i);
+    for(i = 1001; i <= 2000; i++)
+        alarm_engine_set(1, i, 9, PARSE_UNIT_S, "replaced", 8);
+    alarm_engine_interval_range(1, 2001, 3000, 9, PARSE_UNIT_S);
+    alarm_engine_cancel_all(1);
+    for(i = 1; i <= 100; i++)
+        alarm_engine_set(1, i, 7, PARSE_UNIT_S, "after", 5);
+    alarm_engine_list(1, INT_MIN, INT_MAX);
+    //More lists than there were once output rings to go round
+    for(i = 0; i < MANY_LISTS; i++)
+        alarm_engine_list(1, 10, 19);
+    alarm_engine_drain();
+    output_flush();
+
+    CHECK(lists == LISTS);
+    CHECK(headers[0] == ALARMS && entries[0] == ALARMS);
+    CHECK(intervals[0] == 1000 && out_of_order[0] == 0);
+    CHECK(headers[1] == 100 && entries[1] == 100);
+    CHECK(intervals[1] == 7 && out_of_order[1] == 0);
+    for(i = 2; i < LISTS; i++){
+        CHECK(headers[i] == 10 && entries[i] == 10);
+        CHECK(intervals[i] == 7 && out_of_order[i] == 0);
+    }
+    return check_result("list_test");
+}
@@ -0,0 +1,127 @@
+/*
+ * parse_test.c
+ *
+ * The hand written scanner against the two sscanf patterns main used to
+ * try, on lines both are meant to agree on, and on the forms only the
+ * scanner knows.
+ */
+#include <string.h>
+#include <limits.h>
+#include "check.h"
+#include "../parse.h"
+
+/*
+ * What main made of a line before the scanner, as a PARSE_ kind.
+ */
+static int old_parse(const char *line, parsed_command_t *command, char *message){
+    char word[11], first[256];
+
+    if(sscanf(line, "%d %10[^(](%d) %128[^\n]", &command->interval, word,
+              &command->alarm_number, message) == 4)
+        return strcmp(word, "Message") == 0 ? PARSE_SET : PARSE_INCORRECT_FORMAT;
+    if(sscanf(line, "%255[^:]: %10[^(](%d)", first, word, &command->alarm_number) == 3)
+        return strcmp(first, "Cancel") == 0 ? PARSE_CANCEL : PARSE_INCORRECT_FORMAT;
+    if(strcmp(line, "Stats") == 0)
+        return PARSE_STATS;
+    return PARSE_BAD_COMMAND;
+}
+
+static const char *same_lines[] = {
+    "2 Message(1) hello",
+    "  10   Message(42)    spaced out  message",
+    "-5 Message(3) negative interval",
+    "5 Message(-7) negative number",
+    "5 Message(99999999999) saturates",
+    "5 Mesage(1) misspelled",
+    "5 Message(1)",
+    "5 Message 1 no parenthesis",
+    "5 VeryLongWordHere(1) too long a word",
+    "Message(1) no interval",
+    "Cancel: Message(4)",
+    "Cancel:Message(4)",
+    "Cancel:    Message(12) trailing words",
+    "Cancle: Message(4)",
+    "Cancel: Mess(4)",
+    "Cancel: Message()",
+    "Cancel Message(4)",
+    "Stats",
+    "hello",
+    "5",
+    ":",
+};
+
+static void check_same(const char *line){
+    parsed_command_t expected, command;
+    char message[129];
+    int kind = old_parse(line, &expected, message);
+
+    memset(&command, 0, sizeof(command));
+    if(parse_command(line, line + strlen(line), &command) != kind){
+        fprintf(stderr, "kind differs for \"%s\"\n", line);
+        CHECK(0);
+        return;
+    }
+    if(kind == PARSE_SET){
+        CHECK(command.interval == expected.interval);
+        CHECK(command.unit == PARSE_UNIT_S);
+        CHECK(command.message_length == strlen(message));
+        CHECK(memcmp(command.message, message, command.message_length) == 0);
+    }
+    if(kind == PARSE_SET || kind == PARSE_CANCEL)
+        CHECK(command.alarm_number == expected.alarm_number);
+}
+
+static int parse(const char *line, parsed_command_t *command){
+    memset(command, 0, sizeof(*command));
+    return parse_command(line, line + strlen(line), command);
+}
+
+int main(){
+    parsed_command_t command;
+    char line[512];
+    size_t i;
+
+    for(i = 0; i < sizeof(same_lines) / sizeof(same_lines[0]); i++)
+        check_same(same_lines[i]);
+
+    //Messages are no longer cut short at 128 characters
+    memset(line, 'x', sizeof(line));
+    memcpy(line, "1 Message(5) ", 13);
+    line[sizeof(line) - 1] = '\0';
+    CHECK(parse(line, &command) == PARSE_SET);
+    CHECK(command.message_length == sizeof(line) - 14);
+
+    CHECK(parse("250ms Message(1) beat", &command) == PARSE_SET);
+    CHECK(command.interval == 250 && command.unit == PARSE_UNIT_MS);
+    CHECK(parse("7us Message(1) beat", &command) == PARSE_SET);
+    CHECK(command.unit == PARSE_UNIT_US);
+    CHECK(parse("3s Message(1) beat", &command) == PARSE_SET);
+    CHECK(command.interval == 3 && command.unit == PARSE_UNIT_S);
+    CHECK(parse("5ms(1) beat", &command) == PARSE_INCORRECT_FORMAT);
+
+    CHECK(parse("Cancel: Message(10..20)", &command) == PARSE_CANCEL_RANGE);
+    CHECK(command.alarm_number == 10 && command.last_number == 20);
+    CHECK(parse("Cancel: Message(10..20", &command) == PARSE_CANCEL);
+    CHECK(parse("Cancel: All", &command) == PARSE_CANCEL_ALL);
+    CHECK(command.alarm_number == INT_MIN && command.last_number == INT_MAX);
+    CHECK(parse("Interval: 5ms Message(3..4)", &command) == PARSE_INTERVAL_RANGE);
+    CHECK(command.interval == 5 && command.unit == PARSE_UNIT_MS);
+    CHECK(command.alarm_number == 3 && command.last_number == 4);
+    CHECK(parse("Interval: 5 Message(3)", &command) == PARSE_INTERVAL_RANGE);
+    CHECK(command.last_number == 3);
+    CHECK(parse("Interval: x Message(3)", &command) == PARSE_INCORRECT_FORMAT);
+
+    CHECK(parse(" Stats \n", &command) == PARSE_STATS);
+    CHECK(parse("List\n", &command) == PARSE_LIST);
+    CHECK(command.alarm_number == INT_MIN && command.last_number == INT_MAX);
+    CHECK(parse("List range 2..9", &command) == PARSE_LIST);
+    CHECK(command.alarm_number == 2 && command.last_number == 9);
+    CHECK(parse("Count", &command) == PARSE_COUNT);
+    CHECK(parse("Count range -3..3 ", &command) == PARSE_COUNT);
+    CHECK(command.alarm_number == -3 && command.last_number == 3);
+    CHECK(parse("List rang 1..2", &command) == PARSE_INCORRECT_FORMAT);
+    CHECK(parse("List range 1..", &command) == PARSE_INCORRECT_FORMAT);
+    CHECK(parse("List range 1..2 more", &command) == PARSE_INCORRECT_FORMAT);
+    CHECK(parse("Lists", &command) == PARSE_BAD_COMMAND);
+    return check_result("parse_test");
+}
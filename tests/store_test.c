@@ -0,0 +1,66 @@
+/*
+ * store_test.c
+ *
+ * The alarm store finds, replaces and removes what was put in it, and
+ * keeps its probe runs short whatever the alarm numbers are: consecutive,
+ * or a large power of two apart.
+ */
+#include <stdlib.h>
+#include "check.h"
+#include "../alarm_store.h"
+
+#define KEYS 32000
+
+/*
+ * The longest run of taken slots, going round the end of the table.
+ */
+static size_t longest_run(alarm_store_t *store){
+    size_t i, run = 0, longest = 0;
+
+    for(i = 0; i < 2 * store->capacity; i++){
+        run = store->slots[i & (store->capacity - 1)].value != NULL ? run + 1 : 0;
+        if(run > longest)
+            longest = run;
+    }
+    return longest < store->capacity ? longest : store->capacity;
+}
+
+/*
+ * Loads KEYS numbers `stride` apart, starting at `first`, and checks the
+ * store on them as it is filled and emptied.
+ */
+static void check_stride(int first, unsigned stride){
+    alarm_store_t store;
+    static char values[KEYS];
+    int i;
+
+    alarm_store_init(&store, 16);
+    for(i = 0; i < KEYS; i++)
+        alarm_store_insert(&store, (int) ((unsigned) first + (unsigned) i * stride), &values[i]);
+    CHECK(store.count == KEYS);
+    //Under half full, a fair spread has no run anywhere near this long
+    CHECK(longest_run(&store) < 100);
+    for(i = 0; i < KEYS; i++)
+        CHECK(alarm_store_find(&store, (int) ((unsigned) first + (unsigned) i * stride)) == &values[i]);
+    CHECK(alarm_store_find(&store, (int) ((unsigned) first + KEYS * stride)) == NULL);
+
+    //Every other one changed, then the rest removed
+    for(i = 0; i < KEYS; i += 2)
+        alarm_store_set(&store, (int) ((unsigned) first + (unsigned) i * stride), &values[KEYS - 1 - i]);
+    for(i = 1; i < KEYS; i += 2)
+        CHECK(alarm_store_remove(&store, (int) ((unsigned) first + (unsigned) i * stride)) == &values[i]);
+    CHECK(store.count == KEYS / 2);
+    for(i = 0; i < KEYS; i++)
+        CHECK(alarm_store_find(&store, (int) ((unsigned) first + (unsigned) i * stride))
+              == (i % 2 == 0 ? &values[KEYS - 1 - i] : NULL));
+    CHECK(alarm_store_remove(&store, (int) ((unsigned) first + stride)) == NULL);
+    free(store.slots);
+}
+
+int main(){
+    check_stride(1, 1);
+    check_stride(-16000, 1);
+    check_stride(0, 65536);
+    check_stride(7, 1u << 17);
+    return check_result("store_test");
+}
@@ -0,0 +1,90 @@
+/*
+ * wheel_test.c
+ *
+ * The timing wheel hands every entry over once it expires, and not
+ * before, however far it is turned at a time, and turning it a long way
+ * costs no more than the entries on the way.
+ */
+#include <stdlib.h>
+#include <time.h>
+#include "check.h"
+#include "../timer_wheel.h"
+
+#define ENTRIES 20000
+//Past the last level, so that some entries start on the overflow list
+#define HORIZON ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS + 2))
+
+static wheel_entry_t entries[ENTRIES];
+static int popped[ENTRIES];
+
+static uint64_t random_below(uint64_t bound){
+    return (((uint64_t) rand() << 31) ^ (uint64_t) rand()) % bound;
+}
+
+/*
+ * Pops what is due at `now`, checking none of it is early or popped twice,
+ * and returns how many there were.
+ */
+static int pop_due(timer_wheel_t *wheel, uint64_t now){
+    wheel_entry_t *entry;
+    int count = 0;
+
+    while((entry = wheel_pop_due(wheel)) != NULL){
+        CHECK(entry->expires <= now);
+        CHECK(popped[entry - entries] == 0);
+        popped[entry - entries] = 1;
+        count++;
+    }
+    return count;
+}
+
+static void check_random(){
+    timer_wheel_t wheel;
+    uint64_t start = 12345, now = start, expires;
+    int i, seen = 0;
+
+    wheel_init(&wheel, start);
+    for(i = 0; i < ENTRIES; i++)
+        wheel_add(&wheel, &entries[i], start + 1 + random_below(HORIZON));
+    while(seen < ENTRIES){
+        //Nothing left is due before the next expiry the wheel gives
+        CHECK(wheel_next_expiry(&wheel, &expires) && expires > now);
+        now += 1 + random_below(rand() % 2 ? 64 : HORIZON / 64);
+        wheel_advance(&wheel, now);
+        seen += pop_due(&wheel, now);
+        for(i = 0; i < ENTRIES; i++)
+            if(!popped[i] && entries[i].expires <= now){
+                CHECK(0);
+                break;
+            }
+    }
+    CHECK(wheel.count == 0 && !wheel_next_expiry(&wheel, &expires));
+}
+
+/*
+ * An entry left on the due list, and another far away: turning the wheel
+ * up to a day of 100 microsecond ticks only stops where the entries are.
+ */
+static void check_long_turn(){
+    timer_wheel_t wheel;
+    wheel_entry_t due = {0}, far = {0};
+    uint64_t day = 24ull * 3600 * 10000;
+    clock_t started = clock();
+    int turn;
+
+    wheel_init(&wheel, 0);
+    wheel_add(&wheel, &due, 1);
+    wheel_add(&wheel, &far, day / 2);
+    for(turn = 1; turn <= 100; turn++)
+        wheel_advance(&wheel, turn * day);
+    CHECK(far.state == WHEEL_DUE && due.state == WHEEL_DUE);
+    CHECK(wheel.current == 100 * day);
+    CHECK((double) (clock() - started) / CLOCKS_PER_SEC < 1.0);
+}
+
+int main(){
+    srand(1);
+    check_random();
+    check_long_turn();
+    return check_result("wheel_test");
+}
@@ -0,0 +1,200 @@
+/*
+ * timer_wheel.c
+ *
+ * Hierarchical timing wheel used to schedule alarm displays.
+ * See timer_wheel.h for an overview.
+ */
+#include "timer_wheel.h"
+
+static void list_init(wheel_entry_t *head){
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(wheel_entry_t *head, wheel_entry_t *entry){
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static void list_unlink(wheel_entry_t *entry){
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = NULL;
+}
+
+/*
+ * Places an entry in the slot matching its expiry, relative to the
+ * current tick. Entries that are already due go straight to the due list.
+ */
+static void wheel_place(timer_wheel_t *wheel, wheel_entry_t *entry){
+    uint64_t delta;
+    int level;
+
+    if(entry->expires <= wheel->current){
+        entry->state = WHEEL_DUE;
+        list_append(&wheel->due, entry);
+        return;
+    }
+
+    entry->state = WHEEL_SCHEDULED;
+
+    delta = entry->expires - wheel->current;
+    for(level = 0; level < WHEEL_LEVELS; level++){
+        if(delta < ((uint64_t) 1 << (WHEEL_BITS * (level + 1)))){
+            list_append(&wheel->slots[level]
+                        [(entry->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], entry);
+            wheel->count++;
+            return;
+        }
+    }
+    list_append(&wheel->overflow, entry);
+    wheel->count++;
+}
+
+/*
+ * Re-places every entry of a list. Used to move entries down a level as
+ * the wheel turns.
+ */
+static void wheel_cascade(timer_wheel_t *wheel, wheel_entry_t *head){
+    wheel_entry_t pending, *entry;
+
+    if(head->next == head)
+        return;
+    //Detach the whole list first, since entries may land back on it
+    pending.next = head->next;
+    pending.prev = head->prev;
+    pending.next->prev = &pending;
+    pending.prev->next = &pending;
+    list_init(head);
+
+    while(pending.next != &pending){
+        entry = pending.next;
+        list_unlink(entry);
+        wheel->count--;
+        wheel_place(wheel, entry);
+    }
+}
+
+void wheel_init(timer_wheel_t *wheel, uint64_t now){
+    int level, slot;
+
+    wheel->current = now;
+    wheel->count = 0;
+    for(level = 0; level < WHEEL_LEVELS; level++)
+        for(slot = 0; slot < WHEEL_SIZE; slot++)
+            list_init(&wheel->slots[level][slot]);
+    list_init(&wheel->overflow);
+    list_init(&wheel->due);
+}
+
+void wheel_add(timer_wheel_t *wheel, wheel_entry_t *entry, uint64_t expires){
+    wheel_remove(wheel, entry);
+    entry->expires = expires;
+    wheel_place(wheel, entry);
+}
+
+void wheel_remove(timer_wheel_t *wheel, wheel_entry_t *entry){
+    if(entry->state == WHEEL_IDLE)
+        return;
+    //Entries on the due list are not counted
+    if(entry->state == WHEEL_SCHEDULED)
+        wheel->count--;
+    list_unlink(entry);
+    entry->state = WHEEL_IDLE;
+}
+
+/*
+ * Finds the first tick after the current one at which an entry on the
+ * wheel expires or gets cascaded. For the coarser levels this is the start
+ * of the first occupied slot. Returns 0 if nothing is scheduled, 1
+ * otherwise.
+ */
+static int next_occupied(timer_wheel_t *wheel, uint64_t *tick){
+    int level, i, found = 0;
+    uint64_t base, start, best = 0;
+
+    if(wheel->count == 0)
+        return 0;
+
+    for(level = 0; level < WHEEL_LEVELS; level++){
+        base = wheel->current >> (WHEEL_BITS * level);
+        for(i = 1; i <= WHEEL_SIZE; i++){
+            if(wheel->slots[level][(base + i) & WHEEL_MASK].next
+               != &wheel->slots[level][(base + i) & WHEEL_MASK]){
+                start = (base + i) << (WHEEL_BITS * level);
+                if(!found || start < best)
+                    best = start;
+                found = 1;
+                break;
+            }
+        }
+    }
+    //Overflow entries are looked at whenever the top level wraps
+    if(wheel->overflow.next != &wheel->overflow){
+        start = ((wheel->current >> (WHEEL_BITS * WHEEL_LEVELS)) + 1)
+                << (WHEEL_BITS * WHEEL_LEVELS);
+        if(!found || start < best)
+            best = start;
+        found = 1;
+    }
+    *tick = best;
+    return found;
+}
+
+/*
+ * Turns the wheel up to `now`, moving everything that expired onto the
+ * due list. The ticks in between where no slot is occupied are skipped
+ * over, so the cost is in the occupied slots, not in how far the wheel
+ * turns.
+ */
+void wheel_advance(timer_wheel_t *wheel, uint64_t now){
+    int level;
+    uint64_t index, next;
+
+    while(wheel->current < now){
+        //Nothing expires or cascades before the next occupied slot
+        if(!next_occupied(wheel, &next) || next > now){
+            wheel->current = now;
+            return;
+        }
+        wheel->current = next;
+
+        //Cascade each level whose lower level just wrapped around
+        for(level = 1; level < WHEEL_LEVELS; level++){
+            if((wheel->current & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            index = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+            wheel_cascade(wheel, &wheel->slots[level][index]);
+        }
+        if(level == WHEEL_LEVELS)
+            wheel_cascade(wheel, &wheel->overflow);
+
+        wheel_cascade(wheel, &wheel->slots[0][wheel->current & WHEEL_MASK]);
+    }
+}
+
+wheel_entry_t * wheel_pop_due(timer_wheel_t *wheel){
+    wheel_entry_t *entry = wheel->due.next;
+
+    if(entry == &wheel->due)
+        return NULL;
+    list_unlink(entry);
+    entry->state = WHEEL_IDLE;
+    return entry;
+}
+
+/*
+ * Finds the earliest tick at which the wheel may have something due.
+ * For the coarser levels this is the start of the first occupied slot,
+ * which is when its entries get cascaded, so it is a lower bound on the
+ * actual expiry. Returns 0 if nothing is scheduled, 1 otherwise.
+ */
+int wheel_next_expiry(timer_wheel_t *wheel, uint64_t *expires){
+    if(wheel->due.next != &wheel->due){
+        *expires = wheel->current;
+        return 1;
+    }
+    return next_occupied(wheel, expires);
+}
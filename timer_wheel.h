@@ -0,0 +1,53 @@
+#ifndef __timer_wheel_h
+#define __timer_wheel_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Hierarchical timing wheel.
+ *
+ * Time is measured in abstract ticks. Each level holds WHEEL_SIZE slots,
+ * and every level covers WHEEL_SIZE times the range of the level below it,
+ * so an entry expiring far in the future sits in a coarse slot and is
+ * cascaded down as the wheel turns. Entries beyond the last level are kept
+ * on an overflow list which is rescanned whenever the top level wraps.
+ *
+ * Entries are intrusive: embed a wheel_entry_t in the structure to be
+ * scheduled. Expired entries are moved onto the `due` list, where they stay
+ * until popped with wheel_pop_due().
+ *
+ * The wheel does no locking of its own; the caller must serialize access.
+ */
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+
+typedef struct wheel_entry {
+    struct wheel_entry *    next;
+    struct wheel_entry *    prev;
+    uint64_t                expires;
+    int                     state;
+} wheel_entry_t;
+
+#define WHEEL_IDLE 0
+#define WHEEL_SCHEDULED 1
+#define WHEEL_DUE 2
+
+typedef struct timer_wheel {
+    uint64_t        current;
+    size_t          count;
+    wheel_entry_t   slots[WHEEL_LEVELS][WHEEL_SIZE];
+    wheel_entry_t   overflow;
+    wheel_entry_t   due;
+} timer_wheel_t;
+
+void wheel_init(timer_wheel_t *wheel, uint64_t now);
+void wheel_add(timer_wheel_t *wheel, wheel_entry_t *entry, uint64_t expires);
+void wheel_remove(timer_wheel_t *wheel, wheel_entry_t *entry);
+void wheel_advance(timer_wheel_t *wheel, uint64_t now);
+wheel_entry_t * wheel_pop_due(timer_wheel_t *wheel);
+int wheel_next_expiry(timer_wheel_t *wheel, uint64_t *expires);
+
+#endif